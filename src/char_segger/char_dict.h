@@ -15,6 +15,7 @@ class Learner;
 
 class Dict {
 private:
+    friend class Learner;
     vector<double> _data;
     vector<size_t> _ends;
     map<string, size_t> _map;
@@ -152,23 +153,48 @@ public:
     }
 };
 
+/**
+ * 平均感知器. `_acc` sums each update times its step, and has the rows of
+ * the model, which are updated by the same gradients
+ * */
 class Learner {
 private:
     Dict _acc;
     size_t _step;
+    vector<double> _raw;    ///< the weights of the model while it is averaged
+    bool _averaged;
 public:
     Learner() {
         _step = 0;
+        _averaged = false;
     }
     void update(Dict& model, Dict& gradient) {
+        resume(model);
         _step++;
         model.update(gradient, 1.0);
         _acc.update(gradient, _step);
     }
-    void average(Dict& model, Dict& ave) {
-        ave.clear();
-        ave.update(model, 1.0);
-        ave.update(_acc, - 1.0 / _step);
+    /// the weights of `model` replaced with their average in place, until `resume`
+    void average(Dict& model) {
+        if (_averaged) return;
+        _raw.assign(model._data.begin(), model._data.end());
+        double eta = - 1.0 / _step;
+        double* acc;
+        size_t len;
+        for (auto it = _acc._map.begin(); it != _acc._map.end(); ++it) {
+            _acc.get(it->first, acc, len);
+            double* m = model.get(it->first);
+            for (size_t i = 0; i < len; i++) {
+                m[i] += acc[i] * eta;
+            }
+        }
+        _averaged = true;
+    }
+    /// back to the raw weights after `average`
+    void resume(Dict& model) {
+        if (!_averaged) return;
+        model._data.swap(_raw);
+        _averaged = false;
     }
 };
 
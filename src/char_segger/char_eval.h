@@ -56,6 +56,12 @@ public:
         }
         if (dbg) report();
     }
+    /// adds the counts of `other`, e.g. of another thread
+    void merge(const Eval& other) {
+        _std += other._std;
+        _rst += other._rst;
+        _cor += other._cor;
+    }
     void report() {
         double p = 1.0 * _cor / _rst;
         double r = 1.0 * _cor / _std;
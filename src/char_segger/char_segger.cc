@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cstdio>
+#include <memory>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -6,9 +8,12 @@
 #include "char_dict.h"
 #include "char_searcher.h"
 #include "char_eval.h"
+#include "common/utf8.h"
+#include "common/workers.h"
 
 using std::string;
 using std::vector;
+using tenseg::Workers;
 
 const size_t N = 4;
 
@@ -65,13 +70,7 @@ void calc_emission(dict::Dict& model, const string& raw,
         vector<double>& emission, bool update) {
     //fprintf(stderr, "%lu\n", raw.size());
     vector<size_t> begins;
-    for (size_t i = 0; i < raw.size(); i++) {
-        if ((0xc0 == (raw[i] & 0xc0))
-                || !(raw[i] & 0x80)) { // first char
-            begins.push_back(i);
-        }
-    }
-    begins.push_back(raw.size());
+    tenseg::utf8_off(raw, begins);
 
     if (!update) {
         emission.clear();
@@ -180,60 +179,72 @@ void update(dict::Dict& model, string& raw,
 
 void test(dict::Dict& model, 
         vector<string>& test_raws,
-        vector<vector<size_t>>& test_tags
+        vector<vector<size_t>>& test_tags,
+        Workers& workers
         ) {
     tenseg::Eval e;
-    vector<size_t> result;
-
-    for (size_t i = 0; i < test_raws.size(); i++) {
-        tagging(model, test_raws[i], result);
-        e.eval(result, test_tags[i]);
-    }
+    vector<tenseg::Eval> evals(workers.size());
+    vector<vector<size_t>> results(workers.size());
+    workers.run(0, test_raws.size(), [&](size_t t, size_t i) {
+        tagging(model, test_raws[i], results[t]);
+        evals[t].eval(results[t], test_tags[i]);
+    });
+    for (auto& other : evals) e.merge(other);
     e.report();
 }
 
+/**
+ * the sentences of a mini-batch of `batch` sentences are decoded against
+ * the same weights, by the threads of `workers`, and their gradients are
+ * summed into one update. the gradients are counts, so the model only
+ * depends on `batch`, a batch of one being the online perceptron
+ * */
 void train(dict::Dict& model, vector<string>& train_raws,
         vector<vector<size_t>>& train_tags,
         vector<string>& test_raws,
-        vector<vector<size_t>>& test_tags, size_t iter) {
+        vector<vector<size_t>>& test_tags, size_t iter,
+        Workers& workers, size_t batch) {
 
-    dict::Dict ave;
     dict::Dict gradient;
     dict::Learner learner;
-    vector<size_t> result;
+    size_t threads = workers.size();
+    vector<dict::Dict> gradients(threads);
+    vector<vector<size_t>> results(threads);
+    vector<tenseg::Eval> evals(threads);
+    vector<char> wrong(threads);
+    if (batch < 1) batch = 1;
     for (size_t it = 0; it < iter; it++) {
         printf("it %lu\n", it);
+        learner.resume(model);
         tenseg::Eval e;
-        for (size_t i = 0; i < train_raws.size(); i++) {
-            tagging(model, train_raws[i], result);
-            e.eval(result, train_tags[i]);
+        for (auto& other : evals) other.reset();
+        for (size_t begin = 0; begin < train_raws.size(); begin += batch) {
+            size_t end = std::min(train_raws.size(), begin + batch);
+            for (auto& g : gradients) g.clear();
+            std::fill(wrong.begin(), wrong.end(), 0);
+            workers.run(begin, end, [&](size_t t, size_t i) {
+                vector<size_t>& result = results[t];
+                tagging(model, train_raws[i], result);
+                evals[t].eval(result, train_tags[i]);
+                if (!std::equal(result.begin(), result.end(), train_tags[i].begin())) {
+                    update(gradients[t], train_raws[i], result, train_tags[i]);
+                    wrong[t] = 1;
+                }
+            });
+            if (std::find(wrong.begin(), wrong.end(), 1) == wrong.end()) continue;
 
             gradient.clear();
-            bool flag_right = true;
-            for (size_t j = 0; j < result.size(); j++) {
-                if (result[j] != train_tags[i][j]) {
-                    flag_right = false;
-                    break;
-                }
-            }
-            if (!flag_right) {
-                update(gradient, train_raws[i], result, train_tags[i]);
-                learner.update(model, gradient);
-            }
+            for (auto& g : gradients) gradient.update(g, 1.0);
+            learner.update(model, gradient);
         }
+        for (auto& other : evals) e.merge(other);
         e.report();
 
-        e.reset();
-        learner.average(model, ave);
-        for (size_t i = 0; i < test_raws.size(); i++) {
-            tagging(ave, test_raws[i], result);
-            e.eval(result, test_tags[i]);
-        }
-        e.report();
+        learner.average(model);
+        test(model, test_raws, test_tags, workers);
     }
-    ave.dump("model.txt");
-    model.clear();
-    model.update(ave, 1);
+    /// the model is left averaged
+    model.dump("model.txt");
 }
 
 void do_viterbi(const char* modelfile) {
@@ -310,6 +321,9 @@ void shell() {
     // train or test
     dict::Dict model;
     size_t iter = 10;
+    size_t threads = 1;
+    size_t batch = 0;   ///< 0 for one sentence, or two for each thread
+    std::unique_ptr<Workers> workers(new Workers(threads));
 
     vector<string> train_raws;
     vector<vector<size_t>> train_tags;
@@ -345,8 +359,21 @@ void shell() {
             fprintf(stderr, "iteration is set to %lu\n", iter);
             continue;
         }
+        if (cmd == string("threads")) {
+            iss >> threads;
+            if (threads < 1) threads = 1;
+            workers.reset(new Workers(threads));
+            fprintf(stderr, "threads is set to %lu\n", threads);
+            continue;
+        }
+        if (cmd == string("batch")) {
+            iss >> batch;
+            fprintf(stderr, "batch is set to %lu\n", batch);
+            continue;
+        }
         if (cmd == string("train")) {
-            train(model, train_raws, train_tags, test_raws, test_tags, iter);
+            train(model, train_raws, train_tags, test_raws, test_tags, iter, *workers,
+                    batch ? batch : ((threads > 1) ? 2 * threads : 1));
             continue;
         }
         if (cmd == string("save")) {
@@ -364,7 +391,7 @@ void shell() {
             continue;
         }
         if (cmd == string("test")) {
-            test(model, test_raws, test_tags);
+            test(model, test_raws, test_tags, *workers);
             continue;
         }
     }
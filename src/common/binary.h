@@ -0,0 +1,237 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * binary model bundles
+ *
+ * a bundle is a list of named sections. every section starts at an 8-byte
+ * aligned offset so that arrays of PODs can be used straight from the
+ * mapped file.
+ * */
+namespace tenseg {
+using std::map;
+using std::string;
+using std::vector;
+
+const char BUNDLE_MAGIC[8] = {'t', 'e', 'n', 's', 'e', 'g', 0, 0};
+const uint32_t BUNDLE_VERSION = 3;
+
+template<class T>
+inline void binary_append(string& out, const T* ptr, size_t n) {
+    out.append((const char*)ptr, n * sizeof(T));
+}
+template<class T>
+inline void binary_append(string& out, const T& value) {
+    binary_append(out, &value, 1);
+}
+inline void binary_append(string& out, const string& str) {
+    binary_append(out, (uint64_t)str.size());
+    out.append(str);
+}
+inline void binary_align(string& out) {
+    while (out.size() % 8) out.push_back(0);
+}
+
+/**
+ * a cursor over a section, all `take`s are checked against its end
+ * */
+class BinaryReader {
+private:
+    const char* _begin;
+    const char* _ptr;
+    const char* _end;
+    bool _ok;
+public:
+    BinaryReader(const char* data, size_t size)
+        : _begin(data), _ptr(data), _end(data + size), _ok(true) {}
+
+    bool ok() const { return _ok; }
+
+    /// points at `n` items in place, nullptr if the section is too short
+    template<class T>
+    const T* take(size_t n) {
+        if (!_ok || n > (size_t)(_end - _ptr) / sizeof(T)) {
+            _ok = false;
+            return nullptr;
+        }
+        const T* ptr = (const T*)_ptr;
+        _ptr += n * sizeof(T);
+        return ptr;
+    }
+    template<class T>
+    bool read(T& value) {
+        const T* ptr = take<T>(1);
+        if (!ptr) return false;
+        memcpy(&value, ptr, sizeof(T));
+        return true;
+    }
+    bool read(string& str) {
+        uint64_t len = 0;
+        if (!read(len)) return false;
+        const char* ptr = take<char>(len);
+        if (!ptr) return false;
+        str.assign(ptr, len);
+        return true;
+    }
+    void align() {
+        size_t off = (_ptr - _begin) % 8;
+        if (off) take<char>(8 - off);
+    }
+};
+
+/**
+ * a read-only, shared mapping of a whole file
+ * */
+class MappedFile {
+private:
+    void* _data;
+    size_t _size;
+public:
+    MappedFile() : _data(nullptr), _size(0) {}
+    ~MappedFile() {
+        if (_data) munmap(_data, _size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "can not open '%s'\n", filename.c_str());
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            fprintf(stderr, "can not stat '%s'\n", filename.c_str());
+            close(fd);
+            return false;
+        }
+        _size = st.st_size;
+        _data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (_data == MAP_FAILED) {
+            fprintf(stderr, "can not map '%s'\n", filename.c_str());
+            _data = nullptr;
+            return false;
+        }
+        return true;
+    }
+    const char* data() const { return (const char*)_data; }
+    size_t size() const { return _size; }
+};
+
+class BundleWriter {
+private:
+    vector<std::pair<string, string>> _sections;
+public:
+    /// the section body to fill, sections are written in insertion order
+    string& add(const string& name) {
+        _sections.push_back(std::make_pair(name, string()));
+        return _sections.back().second;
+    }
+    bool write(const string& filename) const {
+        string header;
+        header.append(BUNDLE_MAGIC, 8);
+        binary_append(header, BUNDLE_VERSION);
+        binary_append(header, (uint32_t)_sections.size());
+
+        std::FILE* pf = fopen(filename.c_str(), "wb");
+        if (!pf) {
+            fprintf(stderr, "can not write '%s'\n", filename.c_str());
+            return false;
+        }
+        fwrite(header.data(), 1, header.size(), pf);
+        for (auto& section : _sections) {
+            string head;
+            binary_append(head, section.first);
+            binary_align(head);
+            binary_append(head, (uint64_t)section.second.size());
+            fwrite(head.data(), 1, head.size(), pf);
+            fwrite(section.second.data(), 1, section.second.size(), pf);
+            const char zeros[8] = {0};
+            fwrite(zeros, 1, (8 - section.second.size() % 8) % 8, pf);
+        }
+        bool ok = (ferror(pf) == 0);
+        fclose(pf);
+        return ok;
+    }
+};
+
+/**
+ * a mapped bundle, sections point into the shared pages
+ * */
+class Bundle {
+private:
+    std::shared_ptr<MappedFile> _file;
+    map<string, std::pair<const char*, size_t>> _sections;
+public:
+    static bool is_bundle(const string& filename) {
+        char magic[8] = {0};
+        std::FILE* pf = fopen(filename.c_str(), "rb");
+        if (!pf) return false;
+        size_t n = fread(magic, 1, 8, pf);
+        fclose(pf);
+        return n == 8 && memcmp(magic, BUNDLE_MAGIC, 8) == 0;
+    }
+
+    bool open(const string& filename) {
+        _file = std::make_shared<MappedFile>();
+        _sections.clear();
+        if (!_file->open(filename)) return false;
+
+        BinaryReader reader(_file->data(), _file->size());
+        const char* magic = reader.take<char>(8);
+        uint32_t version = 0;
+        uint32_t n = 0;
+        if (!magic || memcmp(magic, BUNDLE_MAGIC, 8) != 0) {
+            fprintf(stderr, "'%s' is not a tenseg model\n", filename.c_str());
+            return false;
+        }
+        reader.read(version);
+        reader.read(n);
+        if (version != BUNDLE_VERSION) {
+            fprintf(stderr, "'%s' has version %u, expect %u\n",
+                    filename.c_str(), version, BUNDLE_VERSION);
+            return false;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            string name;
+            uint64_t size = 0;
+            reader.read(name);
+            reader.align();
+            reader.read(size);
+            const char* data = reader.take<char>(size);
+            reader.align();
+            if (!reader.ok()) {
+                fprintf(stderr, "'%s' is truncated\n", filename.c_str());
+                return false;
+            }
+            _sections[name] = std::make_pair(data, (size_t)size);
+        }
+        return true;
+    }
+    bool get(const string& name, const char*& data, size_t& size) const {
+        auto result = _sections.find(name);
+        if (result == _sections.end()) return false;
+        data = result->second.first;
+        size = result->second.second;
+        return true;
+    }
+    /// the mapping, for objects that keep pointing into it
+    const std::shared_ptr<MappedFile>& file() const {
+        return _file;
+    }
+};
+
+}
@@ -7,7 +7,12 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <chrono>
 #include <ctime>
+#include <cstring>
+
+#include "binary.h"
+#include "utf8.h"
 
 
 #ifdef Debug
@@ -35,6 +40,7 @@ private:
     size_t _label_cor;
     time_t _start_time;
     time_t _end_time;
+    std::chrono::steady_clock::time_point _start_wall;
 public:
     void reset() {
         _std = 0;
@@ -42,6 +48,7 @@ public:
         _cor = 0;
         _label_cor = 0;
         _start_time = std::clock();
+        _start_wall = std::chrono::steady_clock::now();
     }
     Eval() {
         reset();
@@ -82,6 +89,27 @@ public:
         }
 
     }
+    /// adds the counts of `other`, e.g. of another thread
+    void merge(const Eval& other) {
+        _std += other._std;
+        _rst += other._rst;
+        _cor += other._cor;
+        _label_cor += other._label_cor;
+    }
+    /// the counts, for `merge` in another process
+    void serialize(string& out) const {
+        uint64_t counts[] = {_std, _rst, _cor, _label_cor};
+        binary_append(out, counts, 4);
+    }
+    bool deserialize(BinaryReader& reader) {
+        const uint64_t* counts = reader.take<uint64_t>(4);
+        if (!counts) return false;
+        _std = counts[0];
+        _rst = counts[1];
+        _cor = counts[2];
+        _label_cor = counts[3];
+        return true;
+    }
 
 
     void report() {
@@ -90,13 +118,24 @@ public:
         double f = 2 * p * r / (p + r);
         double lf = _get_f(_std, _rst, _label_cor);
         _end_time = std::clock();
+        double wall = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - _start_wall).count();
         //std::cout << _end_time << " ";
-        printf("%lu %lu %lu \033[40;32m%.5g %.5g\033[0m %.3g(sec.)\n", _std, _rst, _cor,
-                lf, f, ((double)(_end_time - _start_time) / CLOCKS_PER_SEC)
+        /// wall-clock and CPU time since `reset`, the CPU time is that of all threads
+        printf("%lu %lu %lu \033[40;32m%.5g %.5g\033[0m %.3g(sec.) %.3g(cpu sec.)\n",
+                _std, _rst, _cor, lf, f, wall,
+                ((double)(_end_time - _start_time) / CLOCKS_PER_SEC)
                 );
     }
+    /// labelled and unlabelled F1
+    double label_f1() const {
+        return _get_f(_std, _rst, _label_cor);
+    }
+    double f1() const {
+        return _get_f(_std, _rst, _cor);
+    }
 private:
-    double _get_f(double std, double rst, double cor) {
+    double _get_f(double std, double rst, double cor) const {
         double p = 1.0 * cor / rst;
         double r = 1.0 * cor / std;
         double f = 2 * p * r / (p + r);
@@ -121,9 +160,19 @@ public:
         }
         return ret->second;
     }
+    /// the index of `ref` if it is known, nothing is added
+    bool find(const T& ref, size_t& ind) const {
+        auto ret = index_.find(ref);
+        if (ret == index_.end()) return false;
+        ind = ret->second;
+        return true;
+    }
     string& operator[](size_t ind) {
         return list_[ind];
     }
+    const string& operator[](size_t ind) const {
+        return list_[ind];
+    }
     size_t size() const {
         return index_.size();
     }
@@ -146,13 +195,33 @@ public:
         //fprintf(stderr, "load %lu tags\n", list_.size());
         input.close();
     }
+
+    void serialize(string& out) const {
+        binary_append(out, (uint64_t)list_.size());
+        for (auto& item : list_) {
+            binary_append(out, item);
+        }
+    }
+    bool deserialize(const char* data, size_t size) {
+        BinaryReader reader(data, size);
+        index_.clear();
+        list_.clear();
+        uint64_t n = 0;
+        reader.read(n);
+        T item;
+        for (uint64_t i = 0; i < n && reader.read(item); i++) {
+            index_[item] = list_.size();
+            list_.push_back(item);
+        }
+        return reader.ok();
+    }
 private:
     map<T, size_t> index_;
     vector<T> list_;
 };
 
 
-void utf8(const size_t unicode, vector<char>& buffer) {
+inline void utf8(const size_t unicode, vector<char>& buffer) {
     if (unicode <= 0x7F) {
         buffer.push_back((char)unicode);
         return;
@@ -168,7 +237,7 @@ void utf8(const size_t unicode, vector<char>& buffer) {
     }
 }
 
-size_t unicode(const char* p, const size_t len) {
+inline size_t unicode(const char* p, const size_t len) {
    size_t code = 0;
     switch (len) {
         case 0:
@@ -188,7 +257,7 @@ size_t unicode(const char* p, const size_t len) {
     return 0;
 }
 
-void to_half(const string& src_raw,
+inline void to_half(const string& src_raw,
         const vector<size_t>& src_off,
         string& tgt_raw,
         vector<size_t>& tgt_off) {
@@ -221,46 +290,138 @@ void to_half(const string& src_raw,
     tgt_raw = string(buffer.data());
 }
 
+/**
+ * 全角转半角, 以及少数字的替换
+ *
+ * the replacements of the BMP are kept in a flat table. with SSE2, the
+ * bytes of a block of 16 up to the first byte of a possibly replaced char
+ * are copied as they are, so runs of ASCII or CJK are never decoded. the output
+ * goes to buffers owned by the caller, which are reused as they are.
+ * */
 class Normalizer {
 public:
-    Normalizer() {
+    Normalizer() : _table(0x10000, 0), _growth(1) {
         for (size_t code = 0xff01; code <= 0xff5e; code++) {
-            _map[code] = code - 65248;
+            _set(code, code - 65248);
         }
-        _map[9675] = 38646; //○ : 零
+        _set(9675, 38646); //○ : 零
     }
+    /// the chars of `src_raw` are given by `src_off`
     void operator()(const string& src_raw,
         const vector<size_t>& src_off,
         string& tgt_raw,
         vector<size_t>& tgt_off) {
-    vector<char> buffer;
-    buffer.reserve(src_raw.size());
-    tgt_off.clear();
-    tgt_off.push_back(0);
-
-    for (size_t i = 0; i < src_off.size() - 1; i++) {
-        size_t begin = src_off[i];
-        size_t end = src_off[i+1];
-        size_t code = unicode(src_raw.data() + src_off[i], src_off[i+1] - src_off[i]);
-        auto res = _map.find(code);
-        if (res == _map.end()) {
-            for (size_t j = begin; j < end; j++) {
-                buffer.push_back(src_raw[j]);
+        tgt_raw.resize(src_raw.size() * _growth);
+        tgt_off.resize(src_off.size());
+        char* out = &tgt_raw[0];
+        size_t o = 0;
+        tgt_off[0] = 0;
+        for (size_t i = 0; i + 1 < src_off.size(); i++) {
+            o = _char(src_raw.data() + src_off[i], src_off[i + 1] - src_off[i], out, o);
+            tgt_off[i + 1] = o;
+        }
+        tgt_raw.resize(o);
+    }
+    /// normalizes `p` and finds its chars in one pass, as `utf8_off` would
+    void operator()(const char* p, size_t len,
+        string& tgt_raw,
+        vector<size_t>& tgt_off) {
+        tgt_raw.resize(len * _growth);
+        tgt_off.resize(len + 1);
+        char* out = &tgt_raw[0];
+        size_t* off = tgt_off.data();
+        size_t n = 0;
+        size_t o = 0;
+        size_t i = 0;
+        while (i < len && !utf8_first(p[i])) i++;
+        while (i < len) {
+#ifdef __SSE2__
+            if (i + 16 <= len) {
+                __m128i block = _mm_loadu_si128((const __m128i*)(p + i));
+                __m128i hit = _mm_setzero_si128();
+                for (auto lead : _leads) {
+                    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, _mm_set1_epi8(lead)));
+                }
+                /// the bytes before the first possibly replaced char are copied
+                uint32_t hits = _mm_movemask_epi8(hit);
+                size_t k = hits ? __builtin_ctz(hits) : 16;
+                if (k) {
+                    _mm_storeu_si128((__m128i*)(out + o), block);
+                    uint32_t mask = utf8_first_mask(block) & ((1u << k) - 1);
+                    while (mask) {
+                        off[n++] = o + __builtin_ctz(mask);
+                        mask &= mask - 1;
+                    }
+                    i += k;
+                    o += k;
+                    continue;
+                }
             }
-        } else {
-            utf8(res->second, buffer);
+#endif
+            if (!utf8_first(p[i])) {
+                /// the rest of a char begun in a copied block
+                out[o++] = p[i++];
+                continue;
+            }
+            size_t end = i + 1;
+            while (end < len && !utf8_first(p[end])) end++;
+            off[n++] = o;
+            o = _char(p + i, end - i, out, o);
+            i = end;
         }
-        tgt_off.push_back(buffer.size());
+        off[n++] = o;
+        tgt_raw.resize(o);
+        tgt_off.resize(n);
     }
-
-    buffer.push_back(0);
-    tgt_raw = string(buffer.data());
+    void operator()(const string& src_raw,
+        string& tgt_raw,
+        vector<size_t>& tgt_off) {
+        (*this)(src_raw.data(), src_raw.size(), tgt_raw, tgt_off);
     }
 private:
-    map<size_t, size_t> _map;
+    void _set(size_t code, size_t target) {
+        _table[code] = target;
+        vector<char> from, to;
+        utf8(code, from);
+        utf8(target, to);
+        _growth = std::max(_growth, (to.size() + from.size() - 1) / from.size());
+        if (std::find(_leads.begin(), _leads.end(), from[0]) == _leads.end()) {
+            _leads.push_back(from[0]);
+        }
+    }
+    /**
+     * writes the char `p` of `len` bytes at `out + o`, returns the new end.
+     * only well-formed chars are replaced, the first byte of a replaced
+     * char is then always one of `_leads`
+     * */
+    inline size_t _char(const char* p, size_t len, char* out, size_t o) const {
+        unsigned char first = *p;
+        size_t expect = (first < 0x80) ? 1 : (first >= 0xE0 ? 3 : 2);
+        size_t code = unicode(p, len);
+        uint16_t target = (len == expect && code < _table.size()) ? _table[code] : 0;
+        if (!target) {
+            memcpy(out + o, p, len);
+            return o + len;
+        }
+        if (target <= 0x7F) {
+            out[o++] = (char)target;
+        } else if (target <= 0x7FF) {
+            out[o++] = (target >> 6) | 0xC0;
+            out[o++] = (target & 0x3F) | 0x80;
+        } else {
+            out[o++] = ((target >> 12) & 0x0F) | 0xE0;
+            out[o++] = ((target >> 6) & 0x3F) | 0x80;
+            out[o++] = ((target >> 0) & 0x3F) | 0x80;
+        }
+        return o;
+    }
+
+    vector<uint16_t> _table; ///< the replacement of each BMP code, 0 for none
+    vector<char> _leads;     ///< first bytes of the replaced chars
+    size_t _growth;          ///< at most this many output bytes per input byte
 };
 
-std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems) {
+inline std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems) {
     std::stringstream ss(s);
     std::string item;
     while (std::getline(ss, item, delim)) {
@@ -268,7 +429,7 @@ std::vector<std::string> &split(const std::string &s, char delim, std::vector<st
     }
     return elems;
 }
-std::vector<std::string> split(const std::string &s, char delim) {
+inline std::vector<std::string> split(const std::string &s, char delim) {
     std::vector<std::string> elems;
     split(s, delim, elems);
     return elems;
@@ -1,40 +1,490 @@
 #pragma once
+#include <cstdint>
+#include <cstring>
 #include <map>
 //#include <unordered_map>
+#include <memory>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <fstream>
+
+#include "binary.h"
 
 namespace tenseg {
 using namespace std;
 
+/**
+ * how the values of a dictionary are kept in its value pool
+ * */
+template<typename V>
+struct dict_value {
+    static void append(string& pool, const V& value) {
+        binary_append(pool, value);
+    }
+    static V read(const char* ptr, size_t) {
+        V value;
+        memcpy(&value, ptr, sizeof(V));
+        return value;
+    }
+    /// a value of `len` bytes can be read
+    static bool fits(size_t len) {
+        return len == sizeof(V);
+    }
+};
+template<>
+struct dict_value<string> {
+    static void append(string& pool, const string& value) {
+        pool.append(value);
+    }
+    static string read(const char* ptr, size_t len) {
+        return string(ptr, len);
+    }
+    static bool fits(size_t) {
+        return true;
+    }
+};
+
+/**
+ * a dictionary compiled into a double-array trie over the bytes of its keys
+ *
+ * the child of node `s` by byte `c` is `t = base[s] + c + 1` if
+ * `check[t] == s`. entries are numbered in key order, their values are
+ * kept one after another in a pool. the nodes and the values can be used
+ * straight from a mapped file, see `save` and `map`.
+ * */
 template<typename V = string>
 class Dictionary {
+public:
+    enum : size_t { npos = ~(size_t)0 };
 private:
-    map<string, V> _dict;
+    struct node_t {
+        uint32_t base;
+        uint32_t check;
+        uint32_t entry;
+    };
+    enum : uint32_t { FREE = ~(uint32_t)0 };
+
+    vector<node_t> _node_data;
+    string _pool_data;
+    vector<uint64_t> _value_off_data;
+
+    /// views on the vectors above, or on a mapped file
+    const node_t* _nodes;
+    size_t _n_nodes;
+    const char* _pool;
+    const uint64_t* _value_offs;
+    size_t _size;
+    std::shared_ptr<MappedFile> _mapped;
+
+    void _sync() {
+        _nodes = _node_data.data();
+        _n_nodes = _node_data.size();
+        _pool = _pool_data.data();
+        _value_offs = _value_off_data.data();
+        _size = _value_off_data.size() ? _value_off_data.size() - 1 : 0;
+    }
+
+    /**
+     * a base whose slots for all `codes` are free. the search starts at the
+     * first free slot, which is moved on once the slots before the found
+     * base are nearly all taken.
+     * */
+    size_t _find_base(const vector<uint32_t>& codes, size_t& next_free) {
+        size_t pos = std::max(next_free, (size_t)codes[0]) - 1;
+        size_t taken = 0;
+        bool first = true;
+        while (true) {
+            pos++;
+            if (pos < _node_data.size() && _node_data[pos].check != FREE) {
+                taken++;
+                continue;
+            }
+            if (first) {
+                next_free = pos;
+                first = false;
+            }
+            size_t base = pos - codes[0];
+            if (base + codes.back() >= _node_data.size()) {
+                node_t free_node = {0, FREE, FREE};
+                _node_data.resize(base + codes.back() + 1, free_node);
+            }
+            bool ok = true;
+            for (auto code : codes) {
+                if (_node_data[base + code].check != FREE) {
+                    ok = false;
+                    break;
+                }
+            }
+            if (!ok) continue;
+            if (taken * 20 >= (pos - next_free + 1) * 19) {
+                next_free = pos;
+            }
+            return base;
+        }
+    }
+    /// the subtree of `node` holding the sorted keys [lo, hi), which share `depth` bytes
+    void _build(const vector<const string*>& keys, size_t node,
+            size_t lo, size_t hi, size_t depth, size_t& next_free) {
+        if (lo < hi && keys[lo]->size() == depth) {
+            _node_data[node].entry = lo;
+            lo++;
+        }
+        if (lo == hi) return;
+
+        vector<uint32_t> codes;
+        vector<size_t> starts;
+        for (size_t i = lo; i < hi; i++) {
+            uint32_t code = (unsigned char)(*keys[i])[depth] + 1;
+            if (codes.empty() || codes.back() != code) {
+                codes.push_back(code);
+                starts.push_back(i);
+            }
+        }
+        starts.push_back(hi);
+
+        size_t base = _find_base(codes, next_free);
+        _node_data[node].base = base;
+        for (auto code : codes) {
+            _node_data[base + code].check = node;
+        }
+        for (size_t c = 0; c < codes.size(); c++) {
+            _build(keys, base + codes[c], starts[c], starts[c + 1], depth + 1, next_free);
+        }
+    }
 public:
+    Dictionary() {
+        _sync();
+    }
+    Dictionary(const Dictionary&) = delete;
+    Dictionary& operator=(const Dictionary&) = delete;
+
+    /// number of entries
+    size_t size() const {
+        return _size;
+    }
+
+    /// builds the trie from sorted, unique keys
+    void build(const std::map<string, V>& dict) {
+        _mapped.reset();
+        vector<const string*> keys;
+        _pool_data.clear();
+        _value_off_data.assign(1, 0);
+        for (auto& item : dict) {
+            keys.push_back(&item.first);
+            dict_value<V>::append(_pool_data, item.second);
+            _value_off_data.push_back(_pool_data.size());
+        }
+        node_t root = {0, 0, FREE};
+        _node_data.assign(1, root);
+        size_t next_free = 1;
+        _build(keys, 0, 0, keys.size(), 0, next_free);
+        _sync();
+    }
+
+    /**
+     * lines of `key value`, or a dictionary written by `save`
+     * */
     void load(const char* filename) {
+        if (Bundle::is_bundle(filename)) {
+            Bundle bundle;
+            const char* data;
+            size_t size;
+            if (!bundle.open(filename) || !bundle.get("dictionary", data, size)
+                    || !map(data, size, bundle.file())) {
+                fprintf(stderr, "can not load dictionary '%s'\n", filename);
+            }
+            return;
+        }
+        std::map<string, V> dict;
         std::ifstream input(filename);
         string key;
         V value;
         for (std::string line; std::getline(input, line); ) {
             std::istringstream iss(line);
             iss >> key >> value;
-            _dict[key] = value;
+            dict[key] = value;
         }
+        build(dict);
     }
-    bool get(const string& key, V& value) const{
-        auto result = _dict.find(key);
-        if (result == _dict.end()) {
-            return false;
+    bool save(const string& filename) const {
+        BundleWriter bundle;
+        serialize(bundle.add("dictionary"));
+        return bundle.write(filename);
+    }
+
+    inline size_t root() const {
+        return 0;
+    }
+    /// number of trie slots, some of them free
+    size_t nodes() const {
+        return _n_nodes;
+    }
+    /// the parent of the node in slot `t`, `npos` for free slots and the root
+    inline size_t parent(size_t t) const {
+        return (t == root() || _nodes[t].check == FREE) ? (size_t)npos : _nodes[t].check;
+    }
+    /// the byte leading from its parent to node `t`
+    inline unsigned char label(size_t t) const {
+        return t - _nodes[_nodes[t].check].base - 1;
+    }
+    /// follows `len` bytes from `node`, false if they lead out of the trie
+    inline bool walk(size_t& node, const char* ptr, size_t len) const {
+        for (size_t i = 0; i < len; i++) {
+            size_t next = (size_t)_nodes[node].base + (unsigned char)ptr[i] + 1;
+            if (next >= _n_nodes || _nodes[next].check != node) return false;
+            node = next;
         }
-        value = result->second;
         return true;
+    }
+    /// the entry of the key ending at `node`, or `npos`
+    inline size_t entry(size_t node) const {
+        uint32_t e = _nodes[node].entry;
+        return (e == FREE) ? (size_t)npos : e;
+    }
+    inline size_t find(const char* key, size_t len) const {
+        if (!_n_nodes) return npos;
+        size_t node = root();
+        if (!walk(node, key, len)) return npos;
+        return entry(node);
+    }
+    /// the bytes of the value of `entry`, as kept in the pool
+    inline const char* value_data(size_t entry, size_t& len) const {
+        len = _value_offs[entry + 1] - _value_offs[entry];
+        return _pool + _value_offs[entry];
+    }
+    V value(size_t entry) const {
+        return dict_value<V>::read(_pool + _value_offs[entry],
+                _value_offs[entry + 1] - _value_offs[entry]);
+    }
 
+    bool get(const char* key, size_t len, V& value) const {
+        size_t e = find(key, len);
+        if (e == npos) return false;
+        value = this->value(e);
+        return true;
+    }
+    bool get(const string& key, V& value) const{
+        return get(key.data(), key.size(), value);
     }
     bool exists(const string& key) const{
-        auto result = _dict.find(key);
-        return (result != _dict.end());
+        return find(key.data(), key.size()) != npos;
+    }
+
+    void serialize(string& out) const {
+        binary_append(out, (uint64_t)_n_nodes);
+        binary_append(out, _nodes, _n_nodes);
+        binary_align(out);
+        binary_append(out, (uint64_t)_size);
+        binary_append(out, _value_offs, _size + 1);
+        binary_append(out, _pool, _size ? _value_offs[_size] : 0);
+    }
+    /**
+     * use the trie in place, `file` is kept alive as long as it is used
+     * */
+    bool map(const char* data, size_t size, std::shared_ptr<MappedFile> file) {
+        BinaryReader reader(data, size);
+        uint64_t n_nodes = 0;
+        uint64_t n = 0;
+        reader.read(n_nodes);
+        const node_t* nodes = reader.take<node_t>(n_nodes);
+        reader.align();
+        reader.read(n);
+        if (!reader.ok() || n >= size) return false;
+        const uint64_t* value_offs = reader.take<uint64_t>(n + 1);
+        if (!reader.ok()) return false;
+        const char* pool = reader.take<char>(value_offs[n]);
+        if (!reader.ok()) return false;
+
+        /// all a lookup or a walk trusts: parents and entries which exist,
+        /// and values in order within the pool
+        if (n && !n_nodes) return false;
+        for (size_t t = 0; t < n_nodes; t++) {
+            if (nodes[t].check != FREE && nodes[t].check >= n_nodes) return false;
+            if (nodes[t].entry != FREE && nodes[t].entry >= n) return false;
+        }
+        if (value_offs[0] != 0) return false;
+        for (size_t e = 0; e < n; e++) {
+            if (value_offs[e] > value_offs[e + 1]) return false;
+            if (!dict_value<V>::fits(value_offs[e + 1] - value_offs[e])) return false;
+        }
+
+        _node_data.clear();
+        _pool_data.clear();
+        _value_off_data.clear();
+        _nodes = nodes;
+        _n_nodes = n_nodes;
+        _pool = pool;
+        _value_offs = value_offs;
+        _size = n;
+        _mapped = file;
+        return true;
+    }
+};
+
+/**
+ * the entries of a dictionary found in a sentence, by the char they
+ * start at. one walk down the trie from each char finds all of them,
+ * the buffers are reused from sentence to sentence.
+ * */
+class DictMatches {
+public:
+    enum : size_t { npos = ~(size_t)0 };
+    struct match_t {
+        uint32_t end;   ///< the char after the entry
+        uint32_t entry;
+    };
+private:
+    vector<uint32_t> _begins;
+    vector<match_t> _matches;
+public:
+    /// entries of at most `max_len` chars, in order of (begin, end)
+    template<class DICT>
+    void find(const DICT& dict, const string& raw, const vector<size_t>& off,
+            size_t max_len = npos) {
+        _begins.clear();
+        _matches.clear();
+        size_t n = off.size() ? off.size() - 1 : 0;
+        for (size_t i = 0; i < n; i++) {
+            _begins.push_back(_matches.size());
+            if (!dict.size()) continue;
+            size_t node = dict.root();
+            for (size_t j = i + 1; j <= n && j - i <= max_len; j++) {
+                if (!dict.walk(node, raw.data() + off[j - 1], off[j] - off[j - 1])) break;
+                size_t e = dict.entry(node);
+                if (e != DICT::npos) {
+                    match_t m;
+                    m.end = j;
+                    m.entry = e;
+                    _matches.push_back(m);
+                }
+            }
+        }
+        _begins.push_back(_matches.size());
+    }
+    /// number of matches, they are numbered in order of (begin, end)
+    size_t size() const {
+        return _matches.size();
+    }
+    inline const match_t& match(size_t k) const {
+        return _matches[k];
+    }
+    /// the number of the match spanning chars [i, j), or `npos`
+    inline size_t index(size_t i, size_t j) const {
+        for (size_t k = _begins[i]; k < _begins[i + 1]; k++) {
+            if (_matches[k].end == j) return k;
+        }
+        return npos;
+    }
+    inline const match_t* begin(size_t i) const {
+        return _matches.data() + _begins[i];
+    }
+    inline const match_t* end(size_t i) const {
+        return _matches.data() + _begins[i + 1];
+    }
+    /// the entry spanning chars [i, j), or `npos`
+    inline size_t entry(size_t i, size_t j) const {
+        size_t k = index(i, j);
+        return (k == npos) ? (size_t)npos : _matches[k].entry;
+    }
+};
+
+/**
+ * an Aho-Corasick automaton over the trie of a dictionary
+ *
+ * the goto function is the trie itself, `fail` and `out` are built once per
+ * dictionary. `scan` reports every occurrence of every entry in one pass
+ * over the text.
+ * */
+template<class DICT>
+class AhoCorasick {
+private:
+    enum : uint32_t { NONE = ~(uint32_t)0 };
+    struct state_t {
+        uint32_t fail;
+        uint32_t out;   ///< the nearest node on the fail chain that ends an entry
+        uint32_t depth;
+    };
+    const DICT* _dict;
+    vector<state_t> _states;
+
+    inline bool _goto(size_t& node, unsigned char c) const {
+        char ch = c;
+        return _dict->walk(node, &ch, 1);
+    }
+public:
+    AhoCorasick() : _dict(nullptr) {}
+
+    void build(const DICT& dict) {
+        _dict = &dict;
+        state_t none = {0, NONE, 0};
+        _states.assign(dict.nodes(), none);
+        if (!dict.nodes()) return;
+
+        /// the children of each node, from the parent every slot points to
+        size_t n = dict.nodes();
+        vector<uint32_t> first(n + 1, 0);
+        for (size_t t = 1; t < n; t++) {
+            if (dict.parent(t) != DICT::npos) first[dict.parent(t) + 1]++;
+        }
+        for (size_t s = 0; s < n; s++) first[s + 1] += first[s];
+        vector<uint32_t> children(first[n]);
+        vector<uint32_t> filled(first.begin(), first.end() - 1);
+        for (size_t t = 1; t < n; t++) {
+            if (dict.parent(t) != DICT::npos) children[filled[dict.parent(t)]++] = t;
+        }
+
+        /// breadth first, so the fail state of a node is done before it
+        vector<size_t> queue(1, dict.root());
+        for (size_t q = 0; q < queue.size(); q++) {
+            size_t node = queue[q];
+            for (size_t k = first[node]; k < first[node + 1]; k++) {
+                size_t child = children[k];
+                unsigned char c = dict.label(child);
+                size_t fail = dict.root();
+                if (node != dict.root()) {
+                    for (size_t f = _states[node].fail; ; f = _states[f].fail) {
+                        size_t next = f;
+                        if (_goto(next, c)) {
+                            fail = next;
+                            break;
+                        }
+                        if (f == dict.root()) break;
+                    }
+                }
+                state_t& state = _states[child];
+                state.fail = fail;
+                state.depth = _states[node].depth + 1;
+                state.out = (dict.entry(child) != DICT::npos) ? child : _states[fail].out;
+                queue.push_back(child);
+            }
+        }
+    }
+    /**
+     * calls `emit(end, entry, len)` for every entry found in `text`, `end`
+     * being the byte after it and `len` its length in bytes. occurrences
+     * come in order of their end, longest first.
+     * */
+    template<class F>
+    void scan(const char* text, size_t len, F emit) const {
+        if (_states.empty()) return;
+        size_t node = _dict->root();
+        for (size_t i = 0; i < len; i++) {
+            unsigned char c = text[i];
+            while (true) {
+                size_t next = node;
+                if (_goto(next, c)) {
+                    node = next;
+                    break;
+                }
+                if (node == _dict->root()) break;
+                node = _states[node].fail;
+            }
+            for (uint32_t o = _states[node].out; o != NONE;
+                    o = _states[_states[o].fail].out) {
+                emit(i + 1, _dict->entry(o), _states[o].depth);
+            }
+        }
     }
 };
 
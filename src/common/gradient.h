@@ -0,0 +1,166 @@
+#pragma once
+#include "weight.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace tenseg {
+using std::string;
+using std::vector;
+
+/**
+ * the gradient of one sentence
+ *
+ * a row is a feature id with the length of its values and its key, the
+ * deltas are (row, offset, delta) triples. nothing is freed by `clear`, so
+ * after the first few sentences filling a gradient does not allocate.
+ * `seal` sums up the deltas of the same value and drops the zeros, the
+ * learners then walk the deltas of each row with `begin` and `end`.
+ * */
+class SparseGradient {
+public:
+    struct delta_t {
+        uint32_t row;
+        uint32_t off;
+        double delta;
+    };
+private:
+    struct entry_t {
+        uint64_t id;
+        uint32_t len;
+        uint32_t slot;
+        uint32_t name_off;
+        uint32_t name_len;
+        uint32_t begin;
+        uint32_t end;
+    };
+    enum : uint32_t { EMPTY = 0 };
+
+    vector<entry_t> _rows;
+    vector<delta_t> _deltas;
+    string _names;
+    vector<uint32_t> _table; ///< row index + 1, EMPTY for free slots
+
+    static inline size_t _mix(uint64_t id) {
+        id ^= id >> 33;
+        id *= 0xff51afd7ed558ccdULL;
+        id ^= id >> 33;
+        return (size_t)id;
+    }
+    inline size_t _probe(uint64_t id) const {
+        size_t mask = _table.size() - 1;
+        size_t i = _mix(id) & mask;
+        while (_table[i] != EMPTY && _rows[_table[i] - 1].id != id) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+    void _rehash(size_t capacity) {
+        _table.assign(capacity, EMPTY);
+        for (size_t r = 0; r < _rows.size(); r++) {
+            size_t slot = _probe(_rows[r].id);
+            _table[slot] = r + 1;
+            _rows[r].slot = slot;
+        }
+    }
+public:
+    SparseGradient() : _table(256, EMPTY) {}
+
+    void clear() {
+        for (auto& row : _rows) _table[row.slot] = EMPTY;
+        _rows.clear();
+        _deltas.clear();
+        _names.clear();
+    }
+    /// the row of the feature `id`, added if it is new, named `prefix + name`
+    size_t row(uint64_t id, size_t len, const char* name, size_t name_len,
+            const string& prefix = string()) {
+        size_t slot = _probe(id);
+        if (_table[slot] != EMPTY) return _table[slot] - 1;
+        entry_t row;
+        row.id = id;
+        row.len = len;
+        row.slot = slot;
+        row.name_off = _names.size();
+        row.name_len = prefix.size() + name_len;
+        row.begin = row.end = 0;
+        _names.append(prefix);
+        _names.append(name, name_len);
+        _rows.push_back(row);
+        _table[slot] = _rows.size();
+        if (_rows.size() * 2 > _table.size()) {
+            _rehash(_table.size() * 2);
+        }
+        return _rows.size() - 1;
+    }
+    size_t row(const string& key, size_t len) {
+        return row(feature_id(key), len, key.data(), key.size());
+    }
+    inline void add(size_t row, size_t off, double delta) {
+        if (delta == 0) return;
+        delta_t d;
+        d.row = row;
+        d.off = off;
+        d.delta = delta;
+        _deltas.push_back(d);
+    }
+    /// a feature with a single value
+    void add(const char* name, size_t name_len, double delta) {
+        add(row(feature_id(name, name_len), 1, name, name_len), 0, delta);
+    }
+    void add(const string& key, double delta) {
+        add(key.data(), key.size(), delta);
+    }
+    void add(const FeatureTemplate& feature, const char* value, size_t len, double delta) {
+        add(row(feature.id(value, len), 1, value, len, feature.prefix()), 0, delta);
+    }
+
+    /// sums up the deltas of each value, to be called once all are added
+    void seal() {
+        std::sort(_deltas.begin(), _deltas.end(),
+                [](const delta_t& a, const delta_t& b) {
+                    return a.row < b.row || (a.row == b.row && a.off < b.off);
+                });
+        size_t n = 0;
+        for (size_t i = 0; i < _deltas.size(); ) {
+            delta_t d = _deltas[i];
+            for (i++; i < _deltas.size() && _deltas[i].row == d.row
+                    && _deltas[i].off == d.off; i++) {
+                d.delta += _deltas[i].delta;
+            }
+            if (d.delta != 0) _deltas[n++] = d;
+        }
+        _deltas.resize(n);
+        for (auto& row : _rows) row.begin = row.end = 0;
+        for (size_t i = 0; i < n; i++) {
+            entry_t& row = _rows[_deltas[i].row];
+            if (row.begin == row.end) row.begin = i;
+            row.end = i + 1;
+        }
+    }
+
+    size_t size() const {
+        return _rows.size();
+    }
+    inline uint64_t id(size_t r) const {
+        return _rows[r].id;
+    }
+    inline size_t length(size_t r) const {
+        return _rows[r].len;
+    }
+    const char* name(size_t r, size_t& len) const {
+        len = _rows[r].name_len;
+        return _names.data() + _rows[r].name_off;
+    }
+    /// the non-zero deltas of row `r`, after `seal`
+    inline const delta_t* begin(size_t r) const {
+        return _deltas.data() + _rows[r].begin;
+    }
+    inline const delta_t* end(size_t r) const {
+        return _deltas.data() + _rows[r].end;
+    }
+};
+
+}
@@ -0,0 +1,306 @@
+#pragma once
+#include "binary.h"
+#include "weight.h"
+#include "gradient.h"
+
+#include <cstring>
+#include <vector>
+
+/**
+ * iterative parameter mixing of perceptrons trained on shards of a corpus
+ *
+ * every epoch starts from the same mixed weights in each shard. a shard
+ * sends back only the values its epoch updated: their deltas, and the
+ * sums of their values over the steps, for the average. the `Mixer` adds
+ * the deltas weighted by the updates of the shards, and sends the values
+ * this changed back to the shards.
+ *
+ * a row of a message is its id, its name, its length and the offsets of
+ * the values in it, followed by the values.
+ * */
+namespace tenseg {
+
+/**
+ * 平均感知器 of one shard, see `Learner`: lane 0 sums each delta times
+ * the step of the epoch it is made at, lane 1 keeps the value a row had
+ * when the epoch began
+ * */
+template<class Weight>
+class ShardLearner {
+private:
+    enum { ACC = 0, START = 1 };
+    Weight _weight;
+    vector<uint32_t> _touched;      ///< entries updated in this epoch
+    vector<uint8_t> _is_touched;
+    size_t _step;
+    size_t _updates;                ///< steps with a non-empty gradient
+public:
+    ShardLearner() : _step(0), _updates(0) {
+        _weight.set_lanes(2);
+    }
+    Weight& weight() {
+        return _weight;
+    }
+    /// the values of a message of `Mixer::mix`
+    bool apply(BinaryReader& reader) {
+        uint64_t rows = 0;
+        reader.read(rows);
+        string name;
+        for (uint64_t k = 0; k < rows; k++) {
+            uint64_t id = 0;
+            uint64_t len = 0;
+            uint64_t n = 0;
+            reader.read(id);
+            reader.read(name);
+            reader.read(len);
+            reader.read(n);
+            const uint32_t* offs = reader.take<uint32_t>(n);
+            reader.align();
+            const double* values = reader.take<double>(n);
+            if (!values || n > len) return false;
+            size_t ind = _weight.insert(id, len, name.data(), name.size());
+            if (ind == Weight::npos) return false;
+            double* w = _weight.values(ind);
+            for (size_t i = 0; i < n; i++) {
+                if (offs[i] >= len) return false;
+                w[offs[i]] = values[i];
+            }
+        }
+        return reader.ok();
+    }
+    void begin_epoch() {
+        for (auto ind : _touched) _is_touched[ind] = 0;
+        _touched.clear();
+        _step = 0;
+        _updates = 0;
+    }
+    void update(const SparseGradient& gradient) {
+        _step++;
+        bool updated = false;
+        size_t name_len;
+        for (size_t g = 0; g < gradient.size(); g++) {
+            if (gradient.begin(g) == gradient.end(g)) continue;
+            updated = true;
+            const char* name = gradient.name(g, name_len);
+            size_t ind = _weight.insert(gradient.id(g), gradient.length(g),
+                    name, name_len);
+            if (ind == Weight::npos) continue;
+            double* w = _weight.values(ind);
+            double* acc = _weight.lane(ind, ACC);
+            if (ind >= _is_touched.size()) _is_touched.resize(ind + 1, 0);
+            if (!_is_touched[ind]) {
+                _is_touched[ind] = 1;
+                _touched.push_back(ind);
+                memcpy(_weight.lane(ind, START), w, gradient.length(g) * sizeof(double));
+                std::fill(acc, acc + gradient.length(g), 0.0);
+            }
+            for (auto d = gradient.begin(g); d != gradient.end(g); d++) {
+                w[d->off] += d->delta;
+                acc[d->off] += d->delta * _step;
+            }
+        }
+        if (updated) _updates++;
+    }
+    /**
+     * the epoch for `Mixer::mix`: its steps, its updates, and for each value
+     * it updated the delta and the sum over the steps of the value minus
+     * its value at the beginning
+     * */
+    void serialize(string& out) {
+        binary_append(out, (uint64_t)_step);
+        binary_append(out, (uint64_t)_updates);
+        binary_append(out, (uint64_t)_touched.size());
+        vector<uint32_t> offs;
+        vector<double> deltas;
+        vector<double> sums;
+        size_t name_len;
+        for (auto ind : _touched) {
+            size_t len = _weight.length(ind);
+            const double* w = _weight.values(ind);
+            const double* acc = _weight.lane(ind, ACC);
+            const double* start = _weight.lane(ind, START);
+            offs.clear();
+            deltas.clear();
+            sums.clear();
+            for (size_t i = 0; i < len; i++) {
+                double delta = w[i] - start[i];
+                double sum = delta * _step - acc[i];
+                if (delta == 0 && sum == 0) continue;
+                offs.push_back(i);
+                deltas.push_back(delta);
+                sums.push_back(sum);
+            }
+            const char* name = _weight.name(ind, name_len);
+            binary_append(out, (uint64_t)_weight.id(ind));
+            binary_append(out, string(name, name_len));
+            binary_append(out, (uint64_t)len);
+            binary_append(out, (uint64_t)offs.size());
+            binary_append(out, offs.data(), offs.size());
+            binary_align(out);
+            binary_append(out, deltas.data(), deltas.size());
+            binary_append(out, sums.data(), sums.size());
+        }
+    }
+    size_t memory_bytes() const {
+        return _weight.memory_bytes();
+    }
+};
+
+/**
+ * the mixed weights, lane 0 sums them over the steps of all the shards.
+ * the number of the last mix in which a shard changed a value is kept
+ * aside, the values of entry `ind` from `_mix_offs[ind]` on.
+ * with one shard it is the averaged perceptron of `Learner`
+ * */
+template<class Weight>
+class Mixer {
+private:
+    enum { TOTAL = 0 };
+    Weight _weight;
+    size_t _step;
+    size_t _mixes;
+    vector<uint32_t> _changed;      ///< entries with values changed by the last mix
+    vector<size_t> _row_mix;        ///< the last mix which changed a value of an entry
+    vector<size_t> _mix_offs;       ///< where the values of an entry begin in `_value_mix`
+    vector<uint32_t> _value_mix;    ///< the last mix which changed a value
+    size_t _values;                 ///< values changed by the last mix
+
+    /// the mix numbers of the values of entry `ind`
+    uint32_t* _mix_of(size_t ind) {
+        while (_mix_offs.size() <= ind) {
+            _mix_offs.push_back(_value_mix.size());
+            _value_mix.resize(_value_mix.size() + _weight.length(_mix_offs.size() - 1), 0);
+        }
+        return _value_mix.data() + _mix_offs[ind];
+    }
+public:
+    Mixer() : _step(0), _mixes(0), _values(0) {
+        _weight.set_lanes(1);
+    }
+    Weight& weight() {
+        return _weight;
+    }
+    /**
+     * the epochs of the shards, as `ShardLearner::serialize` wrote them.
+     * the values any shard changed go to `out` as they are mixed, for
+     * `ShardLearner::apply`
+     * */
+    bool mix(vector<BinaryReader>& shards, string& out) {
+        vector<uint64_t> steps(shards.size(), 0);
+        vector<uint64_t> updates(shards.size(), 0);
+        uint64_t all_steps = 0;
+        uint64_t all_updates = 0;
+        for (size_t s = 0; s < shards.size(); s++) {
+            shards[s].read(steps[s]);
+            shards[s].read(updates[s]);
+            all_steps += steps[s];
+            all_updates += updates[s];
+        }
+        /// the shards saw the mixed weights at every step, up to their own deltas
+        for (size_t ind = 0; ind < _weight.size(); ind++) {
+            double* w = _weight.values(ind);
+            double* total = _weight.lane(ind, TOTAL);
+            for (size_t i = 0; i < _weight.length(ind); i++) {
+                total[i] += w[i] * all_steps;
+            }
+        }
+        _mixes++;
+        _changed.clear();
+        _values = 0;
+        string name;
+        for (size_t s = 0; s < shards.size(); s++) {
+            BinaryReader& reader = shards[s];
+            double mu = all_updates ? (double)updates[s] / all_updates : 0;
+            uint64_t rows = 0;
+            reader.read(rows);
+            for (uint64_t k = 0; k < rows; k++) {
+                uint64_t id = 0;
+                uint64_t len = 0;
+                uint64_t n = 0;
+                reader.read(id);
+                reader.read(name);
+                reader.read(len);
+                reader.read(n);
+                const uint32_t* offs = reader.take<uint32_t>(n);
+                reader.align();
+                const double* deltas = reader.take<double>(n);
+                const double* sums = reader.take<double>(n);
+                if (!sums || n > len) return false;
+                size_t ind = _weight.insert(id, len, name.data(), name.size());
+                if (ind == Weight::npos) return false;
+                double* w = _weight.values(ind);
+                double* total = _weight.lane(ind, TOTAL);
+                uint32_t* mix = _mix_of(ind);
+                if (ind >= _row_mix.size()) _row_mix.resize(ind + 1, 0);
+                for (size_t i = 0; i < n; i++) {
+                    size_t o = offs[i];
+                    if (o >= len) return false;
+                    w[o] += mu * deltas[i];
+                    total[o] += sums[i];
+                    if (deltas[i] == 0 || mix[o] == _mixes) continue;
+                    mix[o] = (uint32_t)_mixes;
+                    _values++;
+                    if (_row_mix[ind] != _mixes) {
+                        _row_mix[ind] = _mixes;
+                        _changed.push_back(ind);
+                    }
+                }
+            }
+            if (!reader.ok()) return false;
+        }
+        _step += all_steps;
+
+        out.clear();
+        binary_append(out, (uint64_t)_changed.size());
+        vector<uint32_t> offs;
+        vector<double> values;
+        size_t name_len;
+        for (auto ind : _changed) {
+            size_t len = _weight.length(ind);
+            const double* w = _weight.values(ind);
+            const uint32_t* mix = _mix_of(ind);
+            offs.clear();
+            values.clear();
+            for (size_t i = 0; i < len; i++) {
+                if (mix[i] != _mixes) continue;
+                offs.push_back(i);
+                values.push_back(w[i]);
+            }
+            const char* name = _weight.name(ind, name_len);
+            binary_append(out, (uint64_t)_weight.id(ind));
+            binary_append(out, string(name, name_len));
+            binary_append(out, (uint64_t)len);
+            binary_append(out, (uint64_t)offs.size());
+            binary_append(out, offs.data(), offs.size());
+            binary_align(out);
+            binary_append(out, values.data(), values.size());
+        }
+        return true;
+    }
+    /// values changed by the last `mix`
+    size_t changed() const {
+        return _values;
+    }
+    void average(Weight& ave) {
+        ave.clear();
+        vector<double> values;
+        size_t name_len;
+        for (size_t ind = 0; ind < _weight.size(); ind++) {
+            double* w = _weight.values(ind);
+            double* total = _weight.lane(ind, TOTAL);
+            values.resize(_weight.length(ind));
+            for (size_t i = 0; i < values.size(); i++) {
+                values[i] = _step ? total[i] / _step : w[i];
+            }
+            const char* name = _weight.name(ind, name_len);
+            ave.add_from(_weight.id(ind), values.data(), values.size(), 1.0,
+                    name, name_len);
+        }
+    }
+    size_t memory_bytes() const {
+        return _weight.memory_bytes() + _row_mix.capacity() * sizeof(size_t)
+            + _mix_offs.capacity() * sizeof(size_t) + _value_mix.capacity() * sizeof(uint32_t);
+    }
+};
+
+}
@@ -1,8 +1,33 @@
 #pragma once
 #include "weight.h"
+#include "gradient.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
 
 namespace tenseg {
 
+/**
+ * the learners `SegTag::fit` can use
+ * */
+enum learner_type_t {
+    PERCEPTRON = 0,
+    ADAGRAD = 1,
+    AVG_ADAGRAD = 2
+};
+inline bool parse_learner_type(const string& name, learner_type_t& type) {
+    static const char* names[] = {"perceptron", "adagrad", "avg_adagrad"};
+    for (int t = PERCEPTRON; t <= AVG_ADAGRAD; t++) {
+        if (name == names[t]) {
+            type = (learner_type_t)t;
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * 一个平均感知器的学习类
  * */
@@ -20,50 +45,347 @@ public:
     Weight& weight() {
         return _weight;
     }
-    void update(Weight& gradient) {
+    void update(const SparseGradient& gradient) {
         _step++;
-        _weight.update(gradient, 1.0);
-        _acc.update(gradient, _step);
+        size_t name_len;
+        for (size_t g = 0; g < gradient.size(); g++) {
+            if (gradient.begin(g) == gradient.end(g)) continue;
+            const char* name = gradient.name(g, name_len);
+            size_t ind = _weight.insert(gradient.id(g), gradient.length(g),
+                    name, name_len);
+            if (ind == Weight::npos) continue;
+            double* w = _weight.values(ind);
+            double* acc = _acc.values(_acc.insert(
+                        gradient.id(g), gradient.length(g), name, name_len));
+            for (auto d = gradient.begin(g); d != gradient.end(g); d++) {
+                w[d->off] += d->delta;
+                acc[d->off] += d->delta * _step;
+            }
+        }
     }
     void average(Weight& ave) {
         ave.clear();
         ave.update(_weight, 1.0);
         ave.update(_acc, - 1.0 / _step);
     }
+    size_t memory_bytes() const {
+        return _weight.memory_bytes() + _acc.memory_bytes();
+    }
 };
 
-template<class Weight>
-class AvgAdaGrad {
+/**
+ * 平均感知器, 每个权重记录上次更新的时间
+ *
+ * lane 0 of the weights sums every weight over the steps before its last
+ * update, lane 1 holds the step of that update. the average after step
+ * c is that of the weights seen by steps 1..c, as with `Learner`. an update only touches
+ * the non-zero coordinates of the gradient, and `average` turns the
+ * weights into their average in place, until `resume`.
+ *
+ * with `ADAGRAD`, lane 2 sums the squared gradients and each delta is
+ * divided by the square root of that sum first.
+ * */
+template<class Weight, bool ADAGRAD = false>
+class LazyLearner {
 private:
+    enum { TOTAL = 0, STAMP = 1, SS = 2 };
     Weight _weight;
-    Weight _acc;
-    Weight _ss;
     size_t _step;
+    bool _averaged;
+
+    /// the total up to now, assuming the weight kept its value since its stamp
+    inline void _catch_up(size_t ind, size_t i) {
+        double* w = _weight.values(ind);
+        double* total = _weight.lane(ind, TOTAL);
+        double* stamp = _weight.lane(ind, STAMP);
+        total[i] += w[i] * (_step - stamp[i]);
+        stamp[i] = _step;
+    }
 public:
-    AvgAdaGrad() {
-        _step = 0;
+    LazyLearner() : _step(0), _averaged(false) {
+        _weight.set_lanes(ADAGRAD ? 3 : 2);
     }
     Weight& weight() {
         return _weight;
     }
-    void update(Weight& gradient) {
+    void update(const SparseGradient& gradient) {
+        resume();
         _step++;
-        Weight tmp;
-        Weight tmp2;
-        tmp.update(gradient, 1.0);
-        tmp.power();
-        _ss.update(tmp, 1.0);
-
-
-        tmp2.update(gradient, 1.0);
-        tmp2.ada_update(_ss);
-        _weight.update(tmp2, 1.0);
-        _acc.update(tmp2, _step);
+        size_t name_len;
+        for (size_t g = 0; g < gradient.size(); g++) {
+            if (gradient.begin(g) == gradient.end(g)) continue;
+            const char* name = gradient.name(g, name_len);
+            size_t ind = _weight.insert(gradient.id(g), gradient.length(g),
+                    name, name_len);
+            if (ind == Weight::npos) continue;
+            double* w = _weight.values(ind);
+            double* ss = ADAGRAD ? _weight.lane(ind, SS) : nullptr;
+            for (auto d = gradient.begin(g); d != gradient.end(g); d++) {
+                double delta = d->delta;
+                if (ADAGRAD) {
+                    ss[d->off] += delta * delta;
+                    delta /= sqrt(ss[d->off]);
+                }
+                _catch_up(ind, d->off);
+                w[d->off] += delta;
+            }
+        }
+    }
+    /**
+     * replace the weights with their average, the raw weights are parked in
+     * the stamp lane, which is `_step` everywhere by then
+     * */
+    void average() {
+        if (_averaged || _step == 0) return;
+        for (size_t ind = 0; ind < _weight.size(); ind++) {
+            double* w = _weight.values(ind);
+            double* total = _weight.lane(ind, TOTAL);
+            double* stamp = _weight.lane(ind, STAMP);
+            for (size_t i = 0; i < _weight.length(ind); i++) {
+                _catch_up(ind, i);
+                stamp[i] = w[i];
+                w[i] = total[i] / _step;
+            }
+        }
+        _averaged = true;
+    }
+    /// back to the raw weights after `average`
+    void resume() {
+        if (!_averaged) return;
+        for (size_t ind = 0; ind < _weight.size(); ind++) {
+            double* w = _weight.values(ind);
+            double* stamp = _weight.lane(ind, STAMP);
+            for (size_t i = 0; i < _weight.length(ind); i++) {
+                w[i] = stamp[i];
+                stamp[i] = _step;
+            }
+        }
+        _averaged = false;
     }
     void average(Weight& ave) {
+        average();
         ave.clear();
         ave.update(_weight, 1.0);
-        ave.update(_acc, - 1.0 / _step);
+        resume();
+    }
+    /// hand the averaged weights over, the learner is empty afterwards
+    void take_average(Weight& ave) {
+        average();
+        ave.swap(_weight);
+        ave.set_lanes(0);
+        _weight.clear();
+        _step = 0;
+        _averaged = false;
+    }
+    size_t memory_bytes() const {
+        return _weight.memory_bytes();
+    }
+};
+
+template<class Weight>
+using AvgAdaGrad = LazyLearner<Weight, true>;
+
+/**
+ * AdaGrad without averaging, the squared gradients are summed in lane 0
+ * */
+template<class Weight>
+class AdaGrad {
+private:
+    Weight _weight;
+public:
+    AdaGrad() {
+        _weight.set_lanes(1);
+    }
+    Weight& weight() {
+        return _weight;
+    }
+    void update(const SparseGradient& gradient) {
+        size_t name_len;
+        for (size_t g = 0; g < gradient.size(); g++) {
+            if (gradient.begin(g) == gradient.end(g)) continue;
+            const char* name = gradient.name(g, name_len);
+            size_t ind = _weight.insert(gradient.id(g), gradient.length(g),
+                    name, name_len);
+            if (ind == Weight::npos) continue;
+            double* w = _weight.values(ind);
+            double* ss = _weight.lane(ind, 0);
+            for (auto d = gradient.begin(g); d != gradient.end(g); d++) {
+                ss[d->off] += d->delta * d->delta;
+                w[d->off] += d->delta / sqrt(ss[d->off]);
+            }
+        }
+    }
+    /// the weights are used as they are
+    void average() {}
+    void resume() {}
+    void take_average(Weight& ave) {
+        ave.swap(_weight);
+        ave.set_lanes(0);
+        _weight.clear();
+    }
+    size_t memory_bytes() const {
+        return _weight.memory_bytes();
+    }
+};
+
+
+/// `*p += delta` in one step, for values other threads add to as well
+inline void atomic_add(double* p, double delta) {
+    double old;
+    __atomic_load(p, &old, __ATOMIC_RELAXED);
+    double sum;
+    do {
+        sum = old + delta;
+    } while (!__atomic_compare_exchange(p, &old, &sum, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * 平均感知器 for Hogwild training: threads decode with the same weights
+ * and add their updates to them without locks
+ *
+ * as with `Learner`, each delta is also added to lane 0 times the step it
+ * is made at, so the average is `w - acc / step` in whatever order the
+ * updates land. a thread adds a row new to the weights itself, one thread
+ * at a time, into the room `make_room` kept for it, the others go on
+ * reading. once the room runs out, deltas of rows not there yet wait in
+ * the `Buffer` of their thread. a row kept waiting for many sentences gets
+ * the deltas of all of them at once, so the threads should stop for a
+ * `sync` as soon as one waits.
+ *
+ * `average` turns the weights into their average in place, the raw
+ * weights are parked in lane 1 until `resume`, see `LazyLearner`.
+ * */
+template<class Weight>
+class HogwildLearner {
+public:
+    /// the deltas of a thread waiting for their rows
+    class Buffer {
+    private:
+        friend class HogwildLearner;
+        struct delta_t {
+            uint64_t id;
+            uint32_t len;
+            uint32_t off;
+            uint32_t name_off;
+            uint32_t name_len;
+            double delta;
+            double acc;
+        };
+        vector<delta_t> _deltas;
+        string _names;
+    public:
+        size_t size() const {
+            return _deltas.size();
+        }
+    };
+private:
+    enum { ACC = 0, RAW = 1 };
+    Weight _weight;
+    std::atomic<size_t> _step;
+    bool _averaged;
+    std::mutex _insert;
+
+    /// the row `g` of `gradient` added, or npos if there is no room for it
+    size_t _add(const SparseGradient& gradient, size_t g) {
+        size_t name_len;
+        const char* name = gradient.name(g, name_len);
+        std::lock_guard<std::mutex> lock(_insert);
+        if (!_weight.has_room(gradient.length(g), name_len)) {
+            return _weight.find(gradient.id(g));
+        }
+        return _weight.insert(gradient.id(g), gradient.length(g), name, name_len);
+    }
+public:
+    HogwildLearner() : _step(0), _averaged(false) {
+        _weight.set_lanes(2);
+    }
+    Weight& weight() {
+        return _weight;
+    }
+    /// the update of one sentence, from any thread after `resume`. true if deltas wait for `sync`
+    bool update(const SparseGradient& gradient, Buffer& buffer) {
+        size_t step = ++_step;
+        size_t waiting = buffer.size();
+        size_t name_len;
+        for (size_t g = 0; g < gradient.size(); g++) {
+            if (gradient.begin(g) == gradient.end(g)) continue;
+            size_t ind = _weight.find(gradient.id(g));
+            if (ind == Weight::npos) ind = _add(gradient, g);
+            if (ind == Weight::npos) {
+                const char* name = gradient.name(g, name_len);
+                uint32_t name_off = buffer._names.size();
+                buffer._names.append(name, name_len);
+                for (auto d = gradient.begin(g); d != gradient.end(g); d++) {
+                    buffer._deltas.push_back({gradient.id(g), (uint32_t)gradient.length(g),
+                            d->off, name_off, (uint32_t)name_len,
+                            d->delta, d->delta * step});
+                }
+                continue;
+            }
+            double* w = _weight.values(ind);
+            double* acc = _weight.lane(ind, ACC);
+            for (auto d = gradient.begin(g); d != gradient.end(g); d++) {
+                atomic_add(w + d->off, d->delta);
+                atomic_add(acc + d->off, d->delta * step);
+            }
+        }
+        return buffer.size() > waiting;
+    }
+    /// room for a quarter as many new rows as there are rows, while no thread decodes
+    void make_room() {
+        _weight.reserve(_weight.size() / 4);
+    }
+    /// adds the rows of `buffer` and its deltas, while no thread decodes
+    void sync(Buffer& buffer) {
+        for (auto& d : buffer._deltas) {
+            size_t ind = _weight.insert(d.id, d.len,
+                    buffer._names.data() + d.name_off, d.name_len);
+            if (ind == Weight::npos) continue;
+            _weight.values(ind)[d.off] += d.delta;
+            _weight.lane(ind, ACC)[d.off] += d.acc;
+        }
+        buffer._deltas.clear();
+        buffer._names.clear();
+    }
+    size_t step() const {
+        return _step;
+    }
+    /// replace the weights with their average, while no thread decodes
+    void average() {
+        if (_averaged || _step == 0) return;
+        for (size_t ind = 0; ind < _weight.size(); ind++) {
+            double* w = _weight.values(ind);
+            double* acc = _weight.lane(ind, ACC);
+            double* raw = _weight.lane(ind, RAW);
+            for (size_t i = 0; i < _weight.length(ind); i++) {
+                raw[i] = w[i];
+                w[i] -= acc[i] / _step;
+            }
+        }
+        _averaged = true;
+    }
+    /// back to the raw weights after `average`
+    void resume() {
+        if (!_averaged) return;
+        for (size_t ind = 0; ind < _weight.size(); ind++) {
+            double* w = _weight.values(ind);
+            double* raw = _weight.lane(ind, RAW);
+            std::copy(raw, raw + _weight.length(ind), w);
+        }
+        _averaged = false;
+    }
+    /// hand the averaged weights over, the learner is empty afterwards
+    void take_average(Weight& ave) {
+        average();
+        ave.swap(_weight);
+        ave.set_lanes(0);
+        _weight.clear();
+        _step = 0;
+        _averaged = false;
+    }
+    size_t memory_bytes() const {
+        return _weight.memory_bytes();
     }
 };
 
@@ -0,0 +1,203 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+/**
+ * the vector kernels of the emission, chosen at run time
+ *
+ * the build targets the baseline x86-64, each kernel is also compiled for
+ * AVX2 and AVX-512 and the widest one the cpu has is used. the loops are
+ * plain C++ and are vectorized by the compiler in each target, without
+ * fused multiply-adds, so every level gives the same sums.
+ * */
+namespace tenseg {
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TENSEG_SIMD_DISPATCH 1
+#define TENSEG_TARGET(t) __attribute__((target(t)))
+#define TENSEG_INLINE inline __attribute__((always_inline))
+#else
+#define TENSEG_SIMD_DISPATCH 0
+#define TENSEG_TARGET(t)
+#define TENSEG_INLINE inline
+#endif
+
+enum simd_level_t {
+    SIMD_SCALAR = 0,
+    SIMD_AVX2 = 1,
+    SIMD_AVX512 = 2
+};
+
+inline const char* simd_name(simd_level_t level) {
+    static const char* names[] = {"scalar", "avx2", "avx512"};
+    return names[level];
+}
+
+/// the widest level of this cpu
+inline simd_level_t simd_detect() {
+#if TENSEG_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+inline simd_level_t& _simd_level() {
+    static simd_level_t level = simd_detect();
+    return level;
+}
+inline simd_level_t simd_level() {
+    return _simd_level();
+}
+/// use narrower kernels than the cpu has, e.g. to compare them
+inline void set_simd_level(simd_level_t level) {
+    if (level > simd_detect()) level = simd_detect();
+    _simd_level() = level;
+}
+
+/**
+ * out[i] += scale * m[i] for i in [0, n)
+ * */
+template<class T, class O>
+TENSEG_INLINE void _add_row(const T* m, double scale, O* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] += scale * m[i];
+    }
+}
+/// without the scale, as no value needs one
+template<class O>
+TENSEG_INLINE void _add_row(const O* m, O* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] += m[i];
+    }
+}
+
+/**
+ * prefix[(i + 1) * tags + l] = prefix[i * tags + l] + emission[(i * tags + l) * N + lane]
+ * for the `chars` chars of an emission of N lanes per tag
+ * */
+template<size_t N, class O>
+TENSEG_INLINE void _lane_prefix_sum(const O* emission, size_t lane, size_t tags,
+        size_t chars, O* prefix) {
+    for (size_t l = 0; l < tags; l++) prefix[l] = 0;
+    for (size_t i = 0; i < chars; i++) {
+        const O* e = emission + i * tags * N + lane;
+        const O* p = prefix + i * tags;
+        O* q = prefix + (i + 1) * tags;
+        for (size_t l = 0; l < tags; l++) {
+            q[l] = p[l] + e[l * N];
+        }
+    }
+}
+
+#if TENSEG_SIMD_DISPATCH
+template<class T, class O>
+TENSEG_TARGET("avx2") void _add_row_avx2(const T* m, double scale, O* out, size_t n) {
+    _add_row(m, scale, out, n);
+}
+template<class T, class O>
+TENSEG_TARGET("avx512f") void _add_row_avx512(const T* m, double scale, O* out, size_t n) {
+    _add_row(m, scale, out, n);
+}
+template<class O>
+TENSEG_TARGET("avx2") void _add_row_avx2(const O* m, O* out, size_t n) {
+    _add_row(m, out, n);
+}
+template<class O>
+TENSEG_TARGET("avx512f") void _add_row_avx512(const O* m, O* out, size_t n) {
+    _add_row(m, out, n);
+}
+template<size_t N, class O>
+TENSEG_TARGET("avx2") void _lane_prefix_sum_avx2(const O* emission, size_t lane,
+        size_t tags, size_t chars, O* prefix) {
+    _lane_prefix_sum<N>(emission, lane, tags, chars, prefix);
+}
+template<size_t N, class O>
+TENSEG_TARGET("avx512f") void _lane_prefix_sum_avx512(const O* emission, size_t lane,
+        size_t tags, size_t chars, O* prefix) {
+    _lane_prefix_sum<N>(emission, lane, tags, chars, prefix);
+}
+#endif
+
+template<class T, class O>
+inline void add_row(const T* m, double scale, O* out, size_t n) {
+#if TENSEG_SIMD_DISPATCH
+    switch (simd_level()) {
+        case SIMD_AVX512: _add_row_avx512(m, scale, out, n); return;
+        case SIMD_AVX2: _add_row_avx2(m, scale, out, n); return;
+        default: break;
+    }
+#endif
+    _add_row(m, scale, out, n);
+}
+template<class O>
+inline void add_row(const O* m, O* out, size_t n) {
+#if TENSEG_SIMD_DISPATCH
+    switch (simd_level()) {
+        case SIMD_AVX512: _add_row_avx512(m, out, n); return;
+        case SIMD_AVX2: _add_row_avx2(m, out, n); return;
+        default: break;
+    }
+#endif
+    _add_row(m, out, n);
+}
+template<size_t N, class O>
+inline void lane_prefix_sum(const O* emission, size_t lane, size_t tags,
+        size_t chars, O* prefix) {
+#if TENSEG_SIMD_DISPATCH
+    switch (simd_level()) {
+        case SIMD_AVX512:
+            _lane_prefix_sum_avx512<N>(emission, lane, tags, chars, prefix);
+            return;
+        case SIMD_AVX2:
+            _lane_prefix_sum_avx2<N>(emission, lane, tags, chars, prefix);
+            return;
+        default: break;
+    }
+#endif
+    _lane_prefix_sum<N>(emission, lane, tags, chars, prefix);
+}
+
+/**
+ * an allocator of ALIGN-byte aligned blocks, so that vectors of scores
+ * begin at a cache line
+ * */
+template<class T, size_t ALIGN = 64>
+struct aligned_allocator {
+    typedef T value_type;
+    template<class U> struct rebind {
+        typedef aligned_allocator<U, ALIGN> other;
+    };
+    aligned_allocator() {}
+    template<class U>
+    aligned_allocator(const aligned_allocator<U, ALIGN>&) {}
+
+    T* allocate(size_t n) {
+        void* p = nullptr;
+        size_t bytes = n * sizeof(T);
+        if (posix_memalign(&p, ALIGN, bytes ? bytes : ALIGN) != 0) {
+            throw std::bad_alloc();
+        }
+        return (T*)p;
+    }
+    void deallocate(T* p, size_t) {
+        free(p);
+    }
+};
+template<class T, class U, size_t ALIGN>
+inline bool operator==(const aligned_allocator<T, ALIGN>&, const aligned_allocator<U, ALIGN>&) {
+    return true;
+}
+template<class T, class U, size_t ALIGN>
+inline bool operator!=(const aligned_allocator<T, ALIGN>&, const aligned_allocator<U, ALIGN>&) {
+    return false;
+}
+
+template<class T>
+using aligned_vector = std::vector<T, aligned_allocator<T>>;
+
+}
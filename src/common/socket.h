@@ -0,0 +1,50 @@
+#pragma once
+#include <cerrno>
+#include <cstdint>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/**
+ * messages over a stream socket: the length of each in 8 bytes, then its
+ * bytes. a peer which is gone fails the call instead of raising SIGPIPE
+ * */
+namespace tenseg {
+using std::string;
+
+inline bool send_all(int fd, const char* data, size_t size) {
+    while (size) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+inline bool recv_all(int fd, char* data, size_t size) {
+    while (size) {
+        ssize_t n = recv(fd, data, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool send_message(int fd, const string& message) {
+    uint64_t size = message.size();
+    return send_all(fd, (const char*)&size, sizeof(size))
+        && send_all(fd, message.data(), message.size());
+}
+/// false at the end of the stream as well
+inline bool recv_message(int fd, string& message) {
+    uint64_t size = 0;
+    if (!recv_all(fd, (char*)&size, sizeof(size))) return false;
+    message.resize(size);
+    return recv_all(fd, &message[0], size);
+}
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * scanning UTF-8 text for the first bytes of chars
+ *
+ * a char begins at every byte that is not a continuation byte (10xxxxxx).
+ * with SSE2, 16 bytes are classified at once and pure ASCII blocks are
+ * taken without looking at the bytes one by one.
+ * */
+namespace tenseg {
+
+inline bool utf8_first(char c) {
+    return (c & 0xc0) != 0x80;
+}
+
+#ifdef __SSE2__
+/// bit k is set if byte k of the block begins a char
+inline uint32_t utf8_first_mask(__m128i block) {
+    /// continuation bytes are the signed bytes in [-128, -65]
+    return _mm_movemask_epi8(_mm_cmpgt_epi8(block, _mm_set1_epi8(-65)));
+}
+#endif
+
+/**
+ * offsets of the chars of `p`, followed by `len`. bytes before the first
+ * char are left out, as they always were
+ * */
+inline void utf8_off(const char* p, size_t len, std::vector<size_t>& off) {
+    off.resize(len + 1);
+    size_t* out = off.data();
+    size_t n = 0;
+    size_t i = 0;
+    while (i < len && !utf8_first(p[i])) i++;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(p + i));
+        uint32_t mask = utf8_first_mask(block);
+        if (mask == 0xffff) {
+            for (size_t k = 0; k < 16; k++) out[n++] = i + k;
+            continue;
+        }
+        while (mask) {
+            out[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (utf8_first(p[i])) out[n++] = i;
+    }
+    out[n++] = len;
+    off.resize(n);
+}
+
+template<class C>
+inline void utf8_off(const C& raw, std::vector<size_t>& off) {
+    utf8_off(raw.data(), raw.size(), off);
+}
+
+}
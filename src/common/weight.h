@@ -1,10 +1,20 @@
 #pragma once
 #include <map>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
 #include <vector>
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <memory>
+
+#include "binary.h"
+#include "simd.h"
 /**
  * a dict of {string : [double]}
  * */
@@ -15,17 +25,17 @@ using std::vector;
 
 
 
-class Weight {
+class MapWeight {
 private:
     map<string, vector<double>> _map;
 public:
     void clear() {
         _map.clear();
     }
-    Weight() {
+    MapWeight() {
     }
     /**create a dict associate with a file*/
-    Weight(const char* filename) {
+    MapWeight(const char* filename) {
     }
 
     void load(const string& filename) {
@@ -187,7 +197,7 @@ public:
             }
         }
     }
-    void ada_update(Weight& other) {
+    void ada_update(MapWeight& other) {
         double* ptr;
         size_t len;
         double* o_ptr;
@@ -214,7 +224,7 @@ public:
         }
     }
 
-    void multiply(Weight& other) {
+    void multiply(MapWeight& other) {
         double* ptr;
         size_t len;
         double* o_ptr;
@@ -237,7 +247,7 @@ public:
             }
         }
     }
-    void update(Weight& other, double eta) {
+    void update(MapWeight& other, double eta) {
         for (auto it = other._map.begin();
                 it != other._map.end();
                 ++ it) {
@@ -254,6 +264,845 @@ public:
     }
 };
 
+/**
+ * 64-bit FNV-1a hash of a feature key, used as its integer id
+ * */
+inline uint64_t feature_id(const char* p, size_t len,
+        uint64_t h = 14695981039346656037ULL) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+inline uint64_t feature_id(const string& key) {
+    return feature_id(key.data(), key.size());
+}
+
+/**
+ * a feature template, i.e. the prefix of its keys. the id of a key is
+ * resolved from the hash of the prefix and the value, the key itself is
+ * only built for the names kept with the weights.
+ * */
+class FeatureTemplate {
+private:
+    string _prefix;
+    uint64_t _prefix_id;
+public:
+    FeatureTemplate(const string& prefix = "")
+        : _prefix(prefix), _prefix_id(feature_id(prefix)) {}
+    const string& prefix() const {
+        return _prefix;
+    }
+    /// the id of `prefix + value`
+    inline uint64_t id(const char* value, size_t len) const {
+        return feature_id(value, len, _prefix_id);
+    }
+    inline uint64_t id(const string& value) const {
+        return id(value.data(), value.size());
+    }
+    string key(const string& value) const {
+        return _prefix + value;
+    }
+};
+
+/**
+ * storage types of weight values, training always uses `F64`
+ * */
+enum value_type_t : uint32_t {
+    F64 = 0,
+    F32 = 1,
+    I16 = 2,
+    I8 = 3
+};
+inline size_t value_size(uint32_t type) {
+    static const size_t sizes[] = {8, 4, 2, 1};
+    return sizes[type];
+}
+inline bool parse_value_type(const string& name, value_type_t& type) {
+    static const char* names[] = {"float64", "float32", "int16", "int8"};
+    for (uint32_t t = F64; t <= I8; t++) {
+        if (name == names[t]) {
+            type = (value_type_t)t;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * a read-only row of weights in whatever type they are stored,
+ * integer types are scaled back to double on the fly
+ * */
+struct row_t {
+    const char* ptr;
+    uint32_t type;
+    size_t len;
+    double scale;
+
+    row_t() : ptr(nullptr), type(F64), len(0), scale(1) {}
+    explicit operator bool() const {
+        return ptr != nullptr;
+    }
+    inline double at(size_t i) const {
+        switch (type) {
+            case F32: return ((const float*)ptr)[i];
+            case I16: return scale * ((const int16_t*)ptr)[i];
+            case I8: return scale * ((const int8_t*)ptr)[i];
+        }
+        return ((const double*)ptr)[i];
+    }
+    /// out[i] += row[i] for i in [begin, end)
+    template<class O>
+    inline void add_to(O* out, size_t begin, size_t end) const {
+        if (begin >= end) return;
+        switch (type) {
+            case F64: _add_to((const double*)ptr, out, begin, end); return;
+            case F32: add_row((const float*)ptr + begin, 1.0, out + begin, end - begin); return;
+            case I16: add_row((const int16_t*)ptr + begin, scale, out + begin, end - begin); return;
+            case I8: add_row((const int8_t*)ptr + begin, scale, out + begin, end - begin); return;
+        }
+    }
+private:
+    static inline void _add_to(const double* m, double* out, size_t begin, size_t end) {
+        add_row(m + begin, out + begin, end - begin);
+    }
+    static inline void _add_to(const double* m, float* out, size_t begin, size_t end) {
+        add_row(m + begin, 1.0, out + begin, end - begin);
+    }
+};
+
+/**
+ * a dict of {feature id : [double]} with open addressing
+ *
+ * keys are identified by their 64-bit `feature_id` only, the key strings
+ * are kept aside for `dump`. values live in one arena per value length, so
+ * e.g. all char unigram rows are contiguous and an entry costs 16 bytes
+ * plus its values.
+ *
+ * the table can also be served from a mapped binary model (`map`), the
+ * first modification then copies it into private memory. `quantize` turns
+ * it into a read-only model of float/int16/int8 values, which are read
+ * through `row` and `value`.
+ * */
+class HashWeight {
+private:
+    struct entry_t {
+        uint64_t id;
+        uint32_t arena;
+        uint32_t row;
+    };
+    struct arena_t {
+        uint64_t len;
+        uint32_t type;  ///< value_type_t
+        double scale;   ///< of the integer types
+        char* base;     ///< `data`, or the mapped values
+        vector<char> data;
+        vector<vector<double>> lanes; ///< see `set_lanes`
+
+        arena_t() : len(0), type(F64), scale(1), base(nullptr) {}
+        size_t row_bytes() const {
+            return len * value_size(type);
+        }
+    };
+    enum : uint32_t { EMPTY = 0 };
+
+    vector<uint32_t> _table; ///< entry index + 1, EMPTY for free slots
+    vector<entry_t> _entries;
+    vector<arena_t> _arenas;
+    vector<char> _names;
+    vector<uint64_t> _name_offs;
+
+    /// views on the vectors above, or on a mapped model
+    const uint32_t* _tab;
+    size_t _mask;
+    const entry_t* _ents;
+    size_t _size;
+    const char* _nms;
+    const uint64_t* _nm_offs;
+    std::shared_ptr<MappedFile> _mapped;
+    size_t _n_lanes;
+
+    static inline size_t _mix(uint64_t id) {
+        id ^= id >> 33;
+        id *= 0xff51afd7ed558ccdULL;
+        id ^= id >> 33;
+        return (size_t)id;
+    }
+    /// slot holding `id`, or the empty slot where it would go
+    inline size_t _probe(uint64_t id) const {
+        size_t i = _mix(id) & _mask;
+        while (true) {
+            /// slots are filled last, see `has_room`
+            uint32_t e = __atomic_load_n(_tab + i, __ATOMIC_ACQUIRE);
+            if (e == EMPTY || _ents[e - 1].id == id) return i;
+            i = (i + 1) & _mask;
+        }
+    }
+    void _sync() {
+        _tab = _table.data();
+        _mask = _table.size() - 1;
+        _ents = _entries.data();
+        _size = _entries.size();
+        _nms = _names.data();
+        _nm_offs = _name_offs.data();
+        for (auto& arena : _arenas) {
+            arena.base = arena.data.data();
+        }
+    }
+    /// the vectors were reallocated since `_sync`
+    bool _moved() const {
+        if (_ents != _entries.data() || _nms != _names.data()
+                || _nm_offs != _name_offs.data()) {
+            return true;
+        }
+        for (auto& arena : _arenas) {
+            if (arena.base != arena.data.data()) return true;
+        }
+        return false;
+    }
+    /// copy a mapped model into private memory before modifying it
+    /**
+     * the values in private memory, before any write. false if they are
+     * quantized, those are read-only
+     * */
+    bool _own() {
+        for (auto& arena : _arenas) {
+            if (arena.type != F64) {
+                fprintf(stderr, "quantized weights are read-only\n");
+                return false;
+            }
+        }
+        if (!_mapped) return true;
+        vector<size_t> rows(_arenas.size(), 0);
+        for (size_t i = 0; i < _size; i++) {
+            rows[_ents[i].arena] = std::max(rows[_ents[i].arena], (size_t)_ents[i].row + 1);
+        }
+        _table.assign(_tab, _tab + _mask + 1);
+        _entries.assign(_ents, _ents + _size);
+        _names.assign(_nms, _nms + _nm_offs[_size]);
+        _name_offs.assign(_nm_offs, _nm_offs + _size + 1);
+        for (size_t a = 0; a < _arenas.size(); a++) {
+            auto& arena = _arenas[a];
+            arena.data.assign(arena.base, arena.base + rows[a] * arena.row_bytes());
+            arena.lanes.assign(_n_lanes, vector<double>(rows[a] * arena.len, 0));
+        }
+        _mapped.reset();
+        _sync();
+        return true;
+    }
+    void _rehash(size_t capacity) {
+        _table.assign(capacity, EMPTY);
+        _sync();
+        for (size_t ind = 0; ind < _entries.size(); ind++) {
+            _table[_probe(_entries[ind].id)] = ind + 1;
+        }
+    }
+    size_t _arena(size_t len) {
+        for (size_t a = 0; a < _arenas.size(); a++) {
+            if (_arenas[a].len == len && _arenas[a].type == F64) return a;
+        }
+        _arenas.push_back(arena_t());
+        _arenas.back().len = len;
+        _arenas.back().lanes.resize(_n_lanes);
+        return _arenas.size() - 1;
+    }
+    inline const char* _bytes(const entry_t& e) const {
+        return _arenas[e.arena].base + (size_t)e.row * _arenas[e.arena].row_bytes();
+    }
+    /// values of an F64 entry
+    inline double* _ptr(const entry_t& e) const {
+        return (double*)_bytes(e);
+    }
+    inline size_t _len(const entry_t& e) const {
+        return _arenas[e.arena].len;
+    }
+    inline bool _is_f64(const entry_t& e) const {
+        return _arenas[e.arena].type == F64;
+    }
+    /**
+     * everything `row` and `find` will trust of a mapped model: the types of
+     * the arenas, the rows of the entries within them, the slots of the
+     * table pointing at entries with a free slot left, and the names in
+     * order within their section, which is `nm_offs[n]` bytes long
+     * */
+    bool _check_mapped(const uint32_t* tab, size_t capacity, const entry_t* ents,
+            size_t n, const vector<uint64_t>& arena_bytes,
+            const uint64_t* nm_offs) const {
+        for (auto& arena : _arenas) {
+            if (arena.type > I8) return false;
+            if (arena.len > std::numeric_limits<uint32_t>::max()) return false;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (ents[i].arena >= _arenas.size()) return false;
+            size_t row_bytes = _arenas[ents[i].arena].row_bytes();
+            if (row_bytes && ents[i].row >= arena_bytes[ents[i].arena] / row_bytes) {
+                return false;
+            }
+        }
+        size_t used = 0;
+        for (size_t i = 0; i < capacity; i++) {
+            if (tab[i] == EMPTY) continue;
+            if (tab[i] > n) return false;
+            used++;
+        }
+        if (used >= capacity) return false;
+        /// an entry not found at its own slot has the id of another one
+        size_t mask = capacity - 1;
+        for (size_t i = 0; i < n; i++) {
+            size_t slot = _mix(ents[i].id) & mask;
+            while (tab[slot] != EMPTY && ents[tab[slot] - 1].id != ents[i].id) {
+                slot = (slot + 1) & mask;
+            }
+            if (tab[slot] != i + 1) return false;
+        }
+        if (nm_offs[0] != 0) return false;
+        for (size_t i = 0; i < n; i++) {
+            if (nm_offs[i] > nm_offs[i + 1]) return false;
+        }
+        return true;
+    }
+    /**
+     * keys of the same 64-bit id would share the row of the first one,
+     * which may be too short for the other: the other is refused
+     * */
+    bool _check_key(size_t ind, size_t length, const char* name, size_t name_len) const {
+        size_t len = _nm_offs[ind + 1] - _nm_offs[ind];
+        const char* nm = _nms + _nm_offs[ind];
+        if (_len(_ents[ind]) == length && len == name_len
+                && memcmp(nm, name, len) == 0) {
+            return true;
+        }
+        fprintf(stderr, "feature '%.*s' of length %lu has the id of '%.*s' of length %lu\n",
+                (int)name_len, name, length, (int)len, nm, _len(_ents[ind]));
+        return false;
+    }
+    /// `transition`, or the prefix of keys like `d:dict.txt:...`
+    string _namespace(size_t ind) const {
+        string name(_nms + _nm_offs[ind], _nm_offs[ind + 1] - _nm_offs[ind]);
+        if (name == "transition") return name;
+        size_t colon = name.find(':');
+        if (colon == string::npos || colon == 0) return "";
+        return name.substr(0, name.find(':', colon + 1) + 1);
+    }
+public:
+    enum : size_t { npos = ~(size_t)0 };
+
+    void clear() {
+        _mapped.reset();
+        _entries.clear();
+        _arenas.clear();
+        _names.clear();
+        _name_offs.assign(1, 0);
+        _rehash(16);
+    }
+    HashWeight() : _n_lanes(0) {
+        clear();
+    }
+    HashWeight(const HashWeight& other) = delete;
+    HashWeight& operator=(const HashWeight& other) = delete;
+
+    size_t size() const {
+        return __atomic_load_n(&_size, __ATOMIC_ACQUIRE);
+    }
+    /// bytes held by the table, the entries, the values and the key strings
+    size_t memory_bytes() const {
+        size_t bytes = _table.capacity() * sizeof(uint32_t)
+            + _entries.capacity() * sizeof(entry_t)
+            + _names.capacity() + _name_offs.capacity() * sizeof(uint64_t);
+        for (auto& arena : _arenas) {
+            bytes += arena.data.capacity();
+            for (auto& lane : arena.lanes) {
+                bytes += lane.capacity() * sizeof(double);
+            }
+        }
+        return bytes;
+    }
+
+    void swap(HashWeight& other) {
+        _table.swap(other._table);
+        _entries.swap(other._entries);
+        _arenas.swap(other._arenas);
+        _names.swap(other._names);
+        _name_offs.swap(other._name_offs);
+        std::swap(_tab, other._tab);
+        std::swap(_mask, other._mask);
+        std::swap(_ents, other._ents);
+        std::swap(_size, other._size);
+        std::swap(_nms, other._nms);
+        std::swap(_nm_offs, other._nm_offs);
+        std::swap(_mapped, other._mapped);
+        std::swap(_n_lanes, other._n_lanes);
+    }
+
+    /**
+     * `n` extra planes of doubles shaped like the values, for the state
+     * an optimizer keeps per weight. they are zero for new entries and
+     * are neither saved nor quantized.
+     * */
+    void set_lanes(size_t n) {
+        if (!_own()) return;
+        _n_lanes = n;
+        for (auto& arena : _arenas) {
+            arena.lanes.resize(n);
+            for (auto& lane : arena.lanes) {
+                lane.resize(arena.data.size() / sizeof(double), 0);
+            }
+        }
+    }
+    /// lane `k` of the entry with index `ind`
+    inline double* lane(size_t ind, size_t k) {
+        const entry_t& e = _ents[ind];
+        return _arenas[e.arena].lanes[k].data() + (size_t)e.row * _len(e);
+    }
+
+    /**
+     * access by entry index, in [0, size())
+     * */
+    inline uint64_t id(size_t ind) const {
+        return _ents[ind].id;
+    }
+    inline size_t length(size_t ind) const {
+        return _len(_ents[ind]);
+    }
+    /// values of an `F64` entry
+    inline double* values(size_t ind) const {
+        return _ptr(_ents[ind]);
+    }
+    const char* name(size_t ind, size_t& len) const {
+        len = _nm_offs[ind + 1] - _nm_offs[ind];
+        return _nms + _nm_offs[ind];
+    }
+    /// bytes of the values only, mapped or not
+    size_t value_bytes() const {
+        size_t bytes = 0;
+        for (size_t i = 0; i < _size; i++) {
+            bytes += _arenas[_ents[i].arena].row_bytes();
+        }
+        return bytes;
+    }
+
+    bool load(const string& filename) {
+        clear();
+        std::ifstream input(filename);
+        string str;
+        vector<double> vec;
+        double v;
+        for (std::string line; std::getline(input, line); ) {
+            std::istringstream iss(line);
+            vec.clear();
+            iss >> str;
+            while (!iss.eof()) {
+                iss >> v;
+                vec.push_back(v);
+            }
+            if (!this->add_from(str, &(vec[0]), vec.size())) {
+                fprintf(stderr, "can not load weights from '%s'\n", filename.c_str());
+                clear();
+                return false;
+            }
+        }
+        fprintf(stderr, "load %lu weights\n", _size);
+        return true;
+    }
+    void dump(const string& filename) {
+        std::FILE* pf = fopen(filename.c_str(), "w");
+        fprintf(stderr, "dump %lu weights\n", _size);
+
+        /// keep the text model sorted by key, as the map-based one was
+        vector<size_t> order(_size);
+        for (size_t i = 0; i < order.size(); i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+                size_t la = _nm_offs[a + 1] - _nm_offs[a];
+                size_t lb = _nm_offs[b + 1] - _nm_offs[b];
+                int c = memcmp(_nms + _nm_offs[a], _nms + _nm_offs[b],
+                    std::min(la, lb));
+                return c < 0 || (c == 0 && la < lb);
+                });
+        for (auto ind : order) {
+            fwrite(_nms + _nm_offs[ind], 1, _nm_offs[ind + 1] - _nm_offs[ind], pf);
+            row_t r = row(_ents[ind].id);
+            for (size_t i = 0; i < r.len; i++) {
+                fprintf(pf, "\t%g", r.at(i));
+            }fprintf(pf, "\n");
+        }
+        fclose(pf);
+    }
+
+    /**
+     * binary form, see `map`
+     * */
+    void serialize(string& out) const {
+        binary_append(out, (uint64_t)(_mask + 1));
+        binary_append(out, (uint64_t)_size);
+        binary_append(out, (uint64_t)_arenas.size());
+        binary_append(out, _tab, _mask + 1);
+        binary_align(out);
+        binary_append(out, _ents, _size);
+        for (size_t a = 0; a < _arenas.size(); a++) {
+            const arena_t& arena = _arenas[a];
+            uint64_t rows = 0;
+            for (size_t i = 0; i < _size; i++) {
+                rows = std::max(rows, (_ents[i].arena == a) ? (uint64_t)_ents[i].row + 1 : 0);
+            }
+            binary_append(out, arena.len);
+            binary_append(out, (uint64_t)(rows * arena.row_bytes()));
+            binary_append(out, arena.type);
+            binary_append(out, (uint32_t)0);
+            binary_append(out, arena.scale);
+            binary_append(out, arena.base, rows * arena.row_bytes());
+            binary_align(out);
+        }
+        binary_append(out, _nm_offs, _size + 1);
+        binary_append(out, _nms, _nm_offs[_size]);
+    }
+    /**
+     * serve the weights from `data` in place, `file` keeps it mapped
+     * */
+    bool map(const char* data, size_t size, std::shared_ptr<MappedFile> file) {
+        clear();
+        BinaryReader reader(data, size);
+        uint64_t capacity = 0, n = 0, n_arenas = 0;
+        reader.read(capacity);
+        reader.read(n);
+        reader.read(n_arenas);
+        const uint32_t* tab = reader.take<uint32_t>(capacity);
+        reader.align();
+        const entry_t* ents = reader.take<entry_t>(n);
+        /// the header of an arena alone takes 32 bytes
+        if (!reader.ok() || n_arenas > size / 32) {
+            fprintf(stderr, "broken weights in binary model\n");
+            clear();
+            return false;
+        }
+        _arenas.resize(n_arenas);
+        vector<uint64_t> arena_bytes(n_arenas, 0);
+        for (size_t a = 0; a < n_arenas; a++) {
+            arena_t& arena = _arenas[a];
+            uint32_t pad = 0;
+            reader.read(arena.len);
+            reader.read(arena_bytes[a]);
+            reader.read(arena.type);
+            reader.read(pad);
+            reader.read(arena.scale);
+            arena.base = const_cast<char*>(reader.take<char>(arena_bytes[a]));
+            reader.align();
+        }
+        const uint64_t* nm_offs = reader.take<uint64_t>(n + 1);
+        const char* nms = reader.take<char>(nm_offs ? nm_offs[n] : 0);
+        if (!reader.ok() || capacity == 0 || (capacity & (capacity - 1))
+                || !_check_mapped(tab, capacity, ents, n, arena_bytes, nm_offs)) {
+            fprintf(stderr, "broken weights in binary model\n");
+            clear();
+            return false;
+        }
+        _tab = tab;
+        _mask = capacity - 1;
+        _ents = ents;
+        _size = n;
+        _nm_offs = nm_offs;
+        _nms = nms;
+        _mapped = file;
+        return true;
+    }
+
+    /**
+     * store values as `type`, with one scale per namespace of keys
+     * (transition, char n-grams, each dictionary or phrase feature) and
+     * value length. the weights are read-only afterwards.
+     * */
+    bool quantize(value_type_t type) {
+        if (!_own()) return false;
+        vector<arena_t> arenas;
+        std::map<std::pair<string, size_t>, uint32_t> groups;
+        vector<entry_t> entries(_entries);
+        for (size_t ind = 0; ind < _size; ind++) {
+            entry_t& e = entries[ind];
+            auto key = std::make_pair(_namespace(ind), _len(e));
+            if (groups.find(key) == groups.end()) {
+                groups[key] = arenas.size();
+                arenas.push_back(arena_t());
+                arenas.back().len = key.second;
+                arenas.back().type = type;
+                arenas.back().scale = 0;
+            }
+            arena_t& arena = arenas[groups[key]];
+            double* ptr = _ptr(e);
+            for (size_t i = 0; i < arena.len; i++) {
+                arena.scale = std::max(arena.scale, std::fabs(ptr[i]));
+            }
+            e.arena = groups[key];
+            e.row = arena.data.size() / arena.row_bytes();
+            arena.data.resize(arena.data.size() + arena.row_bytes());
+        }
+        for (auto& arena : arenas) {
+            /// `scale` holds the largest magnitude here, which is mapped to
+            /// the largest integer
+            double top = (type == I16) ? 32767 : ((type == I8) ? 127 : 0);
+            arena.scale = (top && arena.scale > 0) ? arena.scale / top : 1;
+        }
+        for (size_t ind = 0; ind < _size; ind++) {
+            const double* src = _ptr(_ents[ind]);
+            arena_t& arena = arenas[entries[ind].arena];
+            char* dst = arena.data.data() + (size_t)entries[ind].row * arena.row_bytes();
+            for (size_t i = 0; i < arena.len; i++) {
+                double q = src[i] / arena.scale;
+                switch (type) {
+                    case F64: ((double*)dst)[i] = src[i]; break;
+                    case F32: ((float*)dst)[i] = (float)src[i]; break;
+                    case I16: ((int16_t*)dst)[i] = (int16_t)std::lround(q); break;
+                    case I8: ((int8_t*)dst)[i] = (int8_t)std::lround(q); break;
+                }
+            }
+        }
+        _arenas.swap(arenas);
+        _entries.swap(entries);
+        _n_lanes = 0;
+        _sync();
+        return true;
+    }
+
+    void dbg(const string& key) {
+        row_t r = row(key);
+        printf("[%s]", key.c_str());
+        for (size_t i = 0; i < r.len; i++) {
+            printf(" %g", r.at(i));
+        }
+        printf("\n");
+    }
+
+    /// index of the entry of `id`, or `npos`
+    inline size_t find(uint64_t id) const {
+        uint32_t e = _tab[_probe(id)];
+        return (e == EMPTY) ? (size_t)npos : (e - 1);
+    }
+
+    /**
+     * read access for any value type
+     * */
+    inline row_t row(uint64_t id) const {
+        size_t ind = find(id);
+        if (ind == npos) return row_t();
+        return row_at(ind);
+    }
+    /// the values of the entry `ind`, as returned by `find`
+    inline row_t row_at(size_t ind) const {
+        row_t r;
+        const arena_t& arena = _arenas[_ents[ind].arena];
+        r.ptr = _bytes(_ents[ind]);
+        r.type = arena.type;
+        r.len = arena.len;
+        r.scale = arena.scale;
+        return r;
+    }
+    row_t row(const string& key) const {
+        return row(feature_id(key));
+    }
+    /// the first value of `id`, 0 if missing
+    inline double value(uint64_t id) const {
+        row_t r = row(id);
+        return r ? r.at(0) : 0;
+    }
+    double value(const string& key) const {
+        return value(feature_id(key));
+    }
+
+    /// index of the entry of `id`, added with `length` zeros if missing,
+    /// `npos` if another key has the id or the weights are quantized
+    size_t insert(uint64_t id, const size_t length,
+            const char* name, const size_t name_len) {
+        if (!_own()) return npos;
+        size_t slot = _probe(id);
+        if (_table[slot] != EMPTY) {
+            /// exists, do not insert
+            size_t ind = _table[slot] - 1;
+            return _check_key(ind, length, name, name_len) ? ind : npos;
+        }
+        entry_t e;
+        e.id = id;
+        e.arena = _arena(length);
+        vector<char>& data = _arenas[e.arena].data;
+        e.row = data.size() / (length * sizeof(double));
+        data.insert(data.end(), length * sizeof(double), 0);
+        for (auto& lane : _arenas[e.arena].lanes) {
+            lane.insert(lane.end(), length, 0);
+        }
+        _entries.push_back(e);
+        _names.insert(_names.end(), name, name + name_len);
+        _name_offs.push_back(_names.size());
+
+        if (_moved()) _sync();
+        __atomic_store_n(&_table[slot], (uint32_t)_entries.size(), __ATOMIC_RELEASE);
+        __atomic_store_n(&_size, _entries.size(), __ATOMIC_RELEASE);
+        if (_entries.size() * 10 > _table.size() * 7) {
+            _rehash(_table.size() * 2);
+        }
+        return _entries.size() - 1;
+    }
+    size_t insert(const string& key, const size_t length){
+        return insert(feature_id(key), length, key.data(), key.size());
+    };
+
+    /**
+     * room for `rows` more entries, shared out among the value lengths
+     * already there as the entries are. while there is room, `insert`
+     * moves nothing: the entry, its name and its values are written, and
+     * only then its slot and the size, so other threads may `find` and
+     * read the rows as one thread inserts
+     * */
+    void reserve(size_t rows) {
+        if (!_own()) return;
+        size_t capacity = _table.size();
+        while ((_entries.size() + rows) * 10 > capacity * 7) capacity *= 2;
+        if (capacity != _table.size()) _rehash(capacity);
+        size_t names = _size ? _names.size() / _size + 1 : 16;
+        _entries.reserve(_entries.size() + rows);
+        _name_offs.reserve(_name_offs.size() + rows);
+        _names.reserve(_names.size() + rows * names * 2);
+        vector<size_t> counts(_arenas.size(), 0);
+        for (auto& e : _entries) counts[e.arena]++;
+        for (size_t a = 0; a < _arenas.size(); a++) {
+            auto& arena = _arenas[a];
+            size_t more = (counts[a] * rows / std::max(_size, (size_t)1) + 16) * arena.len;
+            arena.data.reserve(arena.data.size() + more * sizeof(double));
+            for (auto& lane : arena.lanes) lane.reserve(lane.size() + more);
+        }
+        _sync();
+    }
+    /// `insert` of a new row of `length` values would move nothing, see `reserve`
+    bool has_room(size_t length, size_t name_len) const {
+        if (_mapped || (_entries.size() + 1) * 10 > _table.size() * 7) return false;
+        if (_entries.size() == _entries.capacity()
+                || _name_offs.size() == _name_offs.capacity()
+                || _names.size() + name_len > _names.capacity()) {
+            return false;
+        }
+        for (auto& arena : _arenas) {
+            if (arena.len != length || arena.type != F64) continue;
+            if (arena.data.size() + length * sizeof(double) > arena.data.capacity()) {
+                return false;
+            }
+            for (auto& lane : arena.lanes) {
+                if (lane.size() + length > lane.capacity()) return false;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * write access, for `F64` weights only
+     * */
+    void get(uint64_t id, double*& ptr, size_t& len) const {
+        ptr = nullptr;
+        len = 0;
+        size_t ind = find(id);
+        if (ind == npos || !_is_f64(_ents[ind])) return;
+        ptr = _ptr(_ents[ind]);
+        len = _len(_ents[ind]);
+    }
+    void get(const string& key, double*& ptr, size_t& len) const {
+        get(feature_id(key), ptr, len);
+    }
+    inline double* get(uint64_t id) const {
+        size_t ind = find(id);
+        if (ind == npos || !_is_f64(_ents[ind])) return nullptr;
+        return _ptr(_ents[ind]);
+    }
+    double* get(const string& key) const {
+        return get(feature_id(key));
+    }
+
+    /// false if another key has the id or the weights are quantized
+    bool add_from(uint64_t id, const double* ptr, const size_t len,
+            double eta, const char* name, const size_t name_len) {
+        if (std::all_of(ptr, ptr + len, [](double x){return x == 0;})) return true;
+        if (insert(id, len, name, name_len) == npos) return false;
+        double* m = get(id);
+        for (size_t i = 0; i < len; i++) {
+            m[i] += ptr[i] * eta;
+        }
+        return true;
+    }
+    bool add_from(const string& key, const double* ptr, 
+            const size_t len, double eta = 1.0) {
+        return add_from(feature_id(key), ptr, len, eta, key.data(), key.size());
+    }
+    void add_to(uint64_t id, double* ptr) const {
+        row_t r = row(id);
+        if (r) r.add_to(ptr, 0, r.len);
+    }
+    void add_to(const string& key, double* ptr) const {
+        add_to(feature_id(key), ptr);
+    }
+
+    void inverse() {
+        if (!_own()) return;
+        for (auto& e : _entries) {
+            double* ptr = _ptr(e);
+            for (size_t i = 0; i < _len(e); i++) ptr[i] = 1.0 / ptr[i];
+        }
+    }
+    void power() {
+        if (!_own()) return;
+        for (auto& e : _entries) {
+            double* ptr = _ptr(e);
+            for (size_t i = 0; i < _len(e); i++) ptr[i] = ptr[i] * ptr[i];
+        }
+    }
+    void safe_sqrt(double de) {
+        if (!_own()) return;
+        for (auto& e : _entries) {
+            double* ptr = _ptr(e);
+            for (size_t i = 0; i < _len(e); i++) ptr[i] = (ptr[i] > 0) ? sqrt(ptr[i]) : de;
+        }
+    }
+    void ada_update(HashWeight& other) {
+        if (!_own()) return;
+        double* o_ptr;
+        size_t o_len;
+        for (auto& e : _entries) {
+            double* ptr = _ptr(e);
+            size_t len = _len(e);
+            other.get(e.id, o_ptr, o_len);
+            if (!o_ptr || o_len != len) continue;
+            for (size_t i = 0; i < len; i++) {
+                if (o_ptr[i] > 0) {
+                    ptr[i] /= sqrt(o_ptr[i]);
+                }
+            }
+        }
+    }
+    void multiply(HashWeight& other) {
+        if (!_own()) return;
+        double* o_ptr;
+        size_t o_len;
+        for (auto& e : _entries) {
+            double* ptr = _ptr(e);
+            size_t len = _len(e);
+            other.get(e.id, o_ptr, o_len);
+            for (size_t i = 0; i < len; i++) {
+                ptr[i] = (o_ptr && o_len == len) ? ptr[i] * o_ptr[i] : 0;
+            }
+        }
+    }
+    /// adds `F64` weights, false if a key of `other` has the id of another one here
+    bool update(const HashWeight& other, double eta) {
+        bool ok = true;
+        for (size_t ind = 0; ind < other._size; ind++) {
+            const entry_t& e = other._ents[ind];
+            /// if all zero, do nothing
+            /// this is especially helpful for memory-saving
+            ok = add_from(e.id, other._ptr(e), other._len(e), eta,
+                    other._nms + other._nm_offs[ind],
+                    other._nm_offs[ind + 1] - other._nm_offs[ind]) && ok;
+        }
+        return ok;
+    }
+};
+
+typedef HashWeight Weight;
+
 class IWeight {
 public:
     /// access
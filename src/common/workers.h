@@ -0,0 +1,92 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tenseg {
+using std::vector;
+
+/**
+ * threads kept for a whole run, `run` returns once they have done
+ * `work(t, i)` for each i in [begin, end), t being the thread. with one
+ * thread the work is done in the calling thread
+ * */
+class Workers {
+private:
+    typedef std::function<void(size_t, size_t)> work_t;
+    vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _start;
+    std::condition_variable _done;
+    work_t _work;
+    std::atomic<size_t> _next;
+    std::atomic<bool> _stop;
+    size_t _end;
+    size_t _round;
+    size_t _running;
+    bool _quit;
+
+    void _loop(size_t t) {
+        size_t round = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _start.wait(lock, [&]() {return _quit || _round != round;});
+                if (_quit) return;
+                round = _round;
+            }
+            for (size_t i; !_stop && (i = _next++) < _end; ) _work(t, i);
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (--_running == 0) _done.notify_one();
+        }
+    }
+public:
+    explicit Workers(size_t threads)
+        : _next(0), _stop(false), _end(0), _round(0), _running(0), _quit(false) {
+        for (size_t t = 0; threads > 1 && t < threads; t++) {
+            _threads.emplace_back(&Workers::_loop, this, t);
+        }
+    }
+    ~Workers() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _quit = true;
+        }
+        _start.notify_all();
+        for (auto& thread : _threads) thread.join();
+    }
+    size_t size() const {
+        return _threads.size() ? _threads.size() : 1;
+    }
+    /// the first i not done, `end` unless the work was `stop`ped
+    size_t run(size_t begin, size_t end, const work_t& work) {
+        _stop = false;
+        if (_threads.empty()) {
+            for (size_t i = begin; i < end; i++) {
+                if (_stop) return i;
+                work(0, i);
+            }
+            return end;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _work = work;
+        _next = begin;
+        _end = end;
+        _running = _threads.size();
+        _round++;
+        _start.notify_all();
+        _done.wait(lock, [&]() {return _running == 0;});
+        return std::min((size_t)_next, end);
+    }
+    /// from any work: the threads take no more of it
+    void stop() {
+        _stop = true;
+    }
+};
+
+}
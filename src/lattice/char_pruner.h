@@ -0,0 +1,156 @@
+#pragma once
+#include "common/weight.h"
+#include "lattice/feature.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace tenseg {
+using namespace std;
+
+/**
+ * the word boundaries of a sentence, as a char_segger model sees them
+ *
+ * the model tags chars with B, M, E and S, with the unigram and bigram
+ * emissions and the transitions of `char_segger`. the max-marginals of the
+ * tags give the best score of the sentence with and without a boundary
+ * before each char: a boundary is impossible if the best path with it is
+ * more than `margin` worse than the best one, and sure if the best path
+ * without it is. spans of a lattice then only begin and end at possible
+ * boundaries and never cross a sure one.
+ *
+ * copies share the weights, each thread prunes with a copy of its own.
+ * */
+class CharPruner {
+private:
+    enum : size_t { N = 4 }; ///< B, M, E and S
+    enum { B = 0, M = 1, E = 2, S = 3 };
+    shared_ptr<Weight> _weight;
+    CharEmission _char_emission;
+    row_t _transition;
+    double _margin;
+
+    vector<uint32_t> _chars;
+    vector<double> _emission;
+    vector<double> _alpha;
+    vector<double> _beta;
+    vector<uint8_t> _can;
+    vector<uint8_t> _must;
+
+    void _calc_emission(size_t chars) {
+        _emission.assign(N * chars, 0);
+        for (size_t n = 1; n <= 2; n++) {
+            for (size_t i = 0; i + n <= chars; i++) {
+                int b = ((int)i - 1) * (int)N;
+                int e = min((int)(2 + n), (int)chars + 1 - (int)i) * (int)N;
+                int j = max(0, -b);
+                row_t m = (n == 1) ? _char_emission.unigram(_chars[i])
+                    : _char_emission.bigram(_chars[i], _chars[i + 1]);
+                if (!m) continue;
+                m.add_to(_emission.data() + b, j, e);
+            }
+        }
+    }
+    inline double _trans(size_t a, size_t b) const {
+        return _transition ? _transition.at(a * N + b) : 0;
+    }
+    /// max-product forward and backward passes over the tags
+    void _calc_marginals(size_t chars) {
+        _alpha.resize(N * chars);
+        _beta.resize(N * chars);
+        for (size_t s = 0; s < N; s++) {
+            _alpha[s] = _emission[s];
+            _beta[(chars - 1) * N + s] = 0;
+        }
+        for (size_t i = 1; i < chars; i++) {
+            for (size_t s = 0; s < N; s++) {
+                double best = _alpha[(i - 1) * N] + _trans(0, s);
+                for (size_t k = 1; k < N; k++) {
+                    best = max(best, _alpha[(i - 1) * N + k] + _trans(k, s));
+                }
+                _alpha[i * N + s] = best + _emission[i * N + s];
+            }
+        }
+        for (size_t i = chars - 1; i-- > 0; ) {
+            for (size_t s = 0; s < N; s++) {
+                double best = _trans(s, 0) + _emission[(i + 1) * N] + _beta[(i + 1) * N];
+                for (size_t k = 1; k < N; k++) {
+                    best = max(best, _trans(s, k) + _emission[(i + 1) * N + k]
+                            + _beta[(i + 1) * N + k]);
+                }
+                _beta[i * N + s] = best;
+            }
+        }
+    }
+    inline double _marginal(size_t i, size_t s) const {
+        return _alpha[i * N + s] + _beta[i * N + s];
+    }
+public:
+    CharPruner() : _margin(0) {}
+
+    /// a text model of char_segger
+    bool load(const string& filename) {
+        _weight = make_shared<Weight>();
+        if (!_weight->load(filename)) return false;
+        _char_emission.set_weight(*_weight);
+        _transition = _weight->row("transition");
+        return true;
+    }
+    void set_margin(double margin) {
+        _margin = margin;
+    }
+
+    /// the boundaries of the sentence, see `can` and `must`
+    void prune(const string& raw, const vector<size_t>& off) {
+        size_t chars = off.size() ? off.size() - 1 : 0;
+        _can.assign(chars + 1, 1);
+        _must.assign(chars + 1, 1);
+        if (chars < 2) return;
+        _char_emission.encode(raw, off, _chars);
+        _calc_emission(chars);
+        _calc_marginals(chars);
+
+        double best = _alpha[(chars - 1) * N];
+        for (size_t s = 1; s < N; s++) best = max(best, _alpha[(chars - 1) * N + s]);
+        for (size_t i = 1; i < chars; i++) {
+            /// a boundary before char i iff it is tagged B or S
+            double with = max(_marginal(i, B), _marginal(i, S));
+            double without = max(_marginal(i, M), _marginal(i, E));
+            _can[i] = (best - with <= _margin);
+            _must[i] = (best - without > _margin);
+        }
+        /// the best path itself is kept whatever the rounding of the sums
+        size_t s = 0;
+        for (size_t k = 1; k < N; k++) {
+            if (_alpha[(chars - 1) * N + k] > _alpha[(chars - 1) * N + s]) s = k;
+        }
+        for (size_t i = chars - 1; i > 0; i--) {
+            if (s == B || s == S) {
+                _can[i] = 1;
+            } else {
+                _must[i] = 0;
+            }
+            size_t prev = 0;
+            for (size_t k = 1; k < N; k++) {
+                if (_alpha[(i - 1) * N + k] + _trans(k, s)
+                        > _alpha[(i - 1) * N + prev] + _trans(prev, s)) {
+                    prev = k;
+                }
+            }
+            s = prev;
+        }
+    }
+    /// a word may begin or end before char `i`, for i in [0, chars]
+    inline bool can(size_t i) const {
+        return _can[i];
+    }
+    /// no word crosses the boundary before char `i`
+    inline bool must(size_t i) const {
+        return _must[i];
+    }
+};
+
+}
@@ -1,14 +1,18 @@
 #pragma once
 #include "common/common.h"
 #include "common/weight.h"
+#include "common/gradient.h"
 #include "common/dictionary.h"
+#include "lattice/lattice.h"
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <algorithm>
 #include <string>
 #include <vector>
 #include <memory>
+#include <tuple>
 
 namespace tenseg {
 
@@ -19,39 +23,80 @@ using namespace std;
 template<class SPAN>
 class ILatticeFeature {
 public:
-    ILatticeFeature(){};
-    virtual void prepare(shared_ptr<string>& raw, shared_ptr<vector<size_t>>& off, vector<SPAN>& lattice) {}
+    ILatticeFeature() : _weight(nullptr) {};
+    virtual void prepare(shared_ptr<string>& raw, shared_ptr<vector<size_t>>& off, const Lattice& lattice) {}
     virtual double unigram(size_t uni) {return 0;}
+    /// adds the `unigram` of each of the `n` spans of the lattice to `scores`
+    virtual void unigrams(size_t n, double* scores) {
+        for (size_t k = 0; k < n; k++) scores[k] += unigram(k);
+    }
     virtual double bigram(size_t first, size_t second) {return 0;}
-    virtual void calc_gradient(vector<SPAN>& gold, vector<SPAN>& output, Weight& gradient) {}
+    /// features overriding `bigram` say so, the decoder then scores every pair of spans
+    virtual bool has_bigram() const { return false; }
+    virtual void calc_gradient(vector<SPAN>& gold, vector<SPAN>& output, SparseGradient& gradient) {}
     void set_weight(Weight& weight) { _weight = &weight; }
+
+    /// binary models record the kind and the name of each feature,
+    /// and let it keep its data in sections of its own
+    virtual string kind() const { return ""; }
+    virtual string name() const { return ""; }
+    virtual void save(BundleWriter& bundle) const {}
+    /// a feature for another thread, sharing the data but not the state of a sentence
+    virtual shared_ptr<ILatticeFeature<SPAN>> clone() const = 0;
 protected:
     Weight* _weight;
 };
 
 
 template<class SPAN>
-class DictFeature : public ILatticeFeature<SPAN> {
+class DictFeature final : public ILatticeFeature<SPAN> {
 public:
+    DictFeature() {}
     DictFeature(const string& filename) {
         auto dictionary = make_shared<Dictionary<string>>();
         dictionary->load(filename.c_str());
-        _dict = dictionary;
-        _weight_prefix = "d:" + filename + ":";
-        _bigram_weight_prefix = "d:" + filename + ":b:";
+        _init(filename, dictionary);
+    }
+    DictFeature(const string& filename, const Bundle& bundle) {
+        const char* data;
+        size_t size;
+        auto dictionary = make_shared<Dictionary<string>>();
+        if (!bundle.get("dict:" + filename, data, size)
+                || !dictionary->map(data, size, bundle.file())) {
+            fprintf(stderr, "no dictionary '%s' in binary model\n", filename.c_str());
+        }
+        _init(filename, dictionary);
+    }
+    const shared_ptr<Dictionary<string>>& dictionary() const { return _dict; }
+    virtual string kind() const { return "dict"; }
+    virtual string name() const { return _filename; }
+    virtual shared_ptr<ILatticeFeature<SPAN>> clone() const {
+        return make_shared<DictFeature<SPAN>>(*this);
+    }
+    virtual void save(BundleWriter& bundle) const {
+        _dict->serialize(bundle.add("dict:" + _filename));
     }
-    virtual void prepare(shared_ptr<string>& raw, shared_ptr<vector<size_t>>& off, vector<SPAN>& lattice) {
+    virtual void prepare(shared_ptr<string>& raw, shared_ptr<vector<size_t>>& off, const Lattice& lattice) {
         _lattice = &lattice;
         _raw = raw;
         _off = off;
+        if (!_dict) return;
+        /// one weight per entry found, whatever the tag of the span
+        _matches.find(*_dict, *_raw, *_off);
+        _scores.resize(_matches.size());
+        for (size_t k = 0; k < _matches.size(); k++) {
+            size_t len;
+            const char* value = _dict->value_data(_matches.match(k).entry, len);
+            _scores[k] = this->_weight->value(_unigram.id(value, len));
+        }
     }
     virtual double unigram(size_t ind) {
         if (!_dict) return 0;
-        string key;
-        if (!_uni_key((*_lattice)[ind], key)) return 0;
-        double* value = this->_weight->get(key);
-        if (!value) return 0;
-        return *value;
+        return _unigram_score(ind);
+    }
+    virtual void unigrams(size_t n, double* scores) {
+        if (!_dict) return;
+        for (size_t k = 0; k < n; k++) scores[k] += _unigram_score(k);
     }
     //virtual double bigram(size_t ind1, size_t ind2) {
     //    if (!_dict) return 0;
@@ -61,7 +106,7 @@ public:
     //    if (!value) return 0;
     //    return *value;
     //}
-    virtual void calc_gradient( vector<SPAN>& gold, vector<SPAN>& output, Weight& gradient) {
+    virtual void calc_gradient( vector<SPAN>& gold, vector<SPAN>& output, SparseGradient& gradient) {
         for (size_t i = 0; i < gold.size(); i++) {
             if (i + 1 < gold.size()) {
                 _bigram_gradient(gold[i], gold[i + 1], gradient, 1);
@@ -77,58 +122,82 @@ public:
     }
 
 private:
-    bool _bi_key(const SPAN& first, const SPAN& second, string& key) {
-        key = _raw->substr((*_off)[first.begin], (*_off)[second.end] - (*_off)[first.begin]);
-        if (!_dict->get(key, key)) {
-            return false;
-        } else {
-            key = _bigram_weight_prefix + key;
-        }
-        return true;
+    inline double _unigram_score(size_t ind) const {
+        size_t k = _matches.index(_lattice->begin(ind), _lattice->end(ind));
+        return (k == DictMatches::npos) ? 0 : _scores[k];
     }
-    bool _uni_key(const SPAN& span, string& key) {
-        key = _raw->substr((*_off)[span.begin], (*_off)[span.end] - (*_off)[span.begin]);
-        if (!_dict->get(key, key)) {
-            return false;
-            key = _weight_prefix + "MISS" + (char)('0' + (char)(span.end - span.begin));
-        } else {
-            key = _weight_prefix + key;
-        }
-        return true;
+    void _init(const string& filename, shared_ptr<Dictionary<string>> dictionary) {
+        _filename = filename;
+        _dict = dictionary;
+        _unigram = FeatureTemplate("d:" + filename + ":");
+        _bigram = FeatureTemplate("d:" + filename + ":b:");
+    }
+    /// the value of the entry spanning [begin, end), nullptr if none
+    const char* _value(size_t begin, size_t end, size_t& len) {
+        size_t entry = _matches.entry(begin, end);
+        if (entry == DictMatches::npos) return nullptr;
+        return _dict->value_data(entry, len);
     }
 
-    double _unigram_gradient(const SPAN& span, Weight& gradient, double delta) {
+    double _unigram_gradient(const SPAN& span, SparseGradient& gradient, double delta) {
         if (!_dict) return 0;
-        string key;
-        if (!_uni_key(span, key)) return 0;
-        gradient.add_from(key, &delta, 1);
+        size_t len;
+        const char* value = _value(span.begin, span.end, len);
+        if (!value) return 0;
+        gradient.add(_unigram, value, len, delta);
+        return 0;
     }
-    double _bigram_gradient(const SPAN& first, const SPAN& second, Weight& gradient, double delta) {
+    double _bigram_gradient(const SPAN& first, const SPAN& second, SparseGradient& gradient, double delta) {
         if (!_dict) return 0;
-        string key;
-        if (!_bi_key(first, second, key)) return 0;
-        gradient.add_from(key, &delta, 1);
+        size_t len;
+        const char* value = _value(first.begin, second.end, len);
+        if (!value) return 0;
+        gradient.add(_bigram, value, len, delta);
+        return 0;
     }
 private:
-    string _weight_prefix;
-    string _bigram_weight_prefix;
+    string _filename;
+    FeatureTemplate _unigram;
+    FeatureTemplate _bigram;
     shared_ptr<Dictionary<string>> _dict;
+    DictMatches _matches;
+    vector<double> _scores;
 
-    vector<SPAN>* _lattice;
+    const Lattice* _lattice;
     shared_ptr<string> _raw;
     shared_ptr<vector<size_t>> _off;
 };
 
 template<class SPAN>
-class PhraseFeature : public ILatticeFeature<SPAN> {
+class PhraseFeature final : public ILatticeFeature<SPAN> {
 public:
+    PhraseFeature() {}
     PhraseFeature(const string& filename) {
         auto dictionary = make_shared<Dictionary<string>>();
         dictionary->load(filename.c_str());
-        _phrase = dictionary;
-        _weight_prefix = "p:" + filename + ":";
+        _init(filename, dictionary);
+    }
+    PhraseFeature(const string& filename, const Bundle& bundle) {
+        const char* data;
+        size_t size;
+        auto dictionary = make_shared<Dictionary<string>>();
+        if (!bundle.get("phrase:" + filename, data, size)
+                || !dictionary->map(data, size, bundle.file())) {
+            fprintf(stderr, "no phrases '%s' in binary model\n", filename.c_str());
+        }
+        _init(filename, dictionary);
+    }
+    /// drop phrases crossing another one, off by default
+    void drop_crossing(bool drop) { _drop_crossing = drop; }
+    virtual string kind() const { return "phrase"; }
+    virtual string name() const { return _filename; }
+    virtual shared_ptr<ILatticeFeature<SPAN>> clone() const {
+        return make_shared<PhraseFeature<SPAN>>(*this);
     }
-    virtual void prepare(shared_ptr<string>& raw, shared_ptr<vector<size_t>>& off, vector<SPAN>& lattice) {
+    virtual void save(BundleWriter& bundle) const {
+        _phrase->serialize(bundle.add("phrase:" + _filename));
+    }
+    virtual void prepare(shared_ptr<string>& raw, shared_ptr<vector<size_t>>& off, const Lattice& lattice) {
         _lattice = &lattice;
         _raw = raw;
         _off = off;
@@ -138,11 +207,38 @@ public:
 
     double unigram(size_t ind) {
         if (!_phrase) return 0;
+        return _unigram_score(ind);
+    }
+    virtual void unigrams(size_t n, double* scores) {
+        if (!_phrase) return;
+        for (size_t k = 0; k < n; k++) scores[k] += _unigram_score(k);
+    }
+    virtual void calc_gradient( vector<SPAN>& gold, vector<SPAN>& output, SparseGradient& gradient) {
+        for (size_t i = 0; i < gold.size(); i++) {
+            _unigram_phrase_gradient(&gold[i], gradient, 1);
+        }
+        for (size_t i = 0; i < output.size(); i++) {
+            _unigram_phrase_gradient(&output[i], gradient, -1);
+        }
+    }
+
+
+private:
+    /// chars [begin, end) of the sentence match the phrase `entry`
+    struct phrase_t {
+        size_t begin;
+        size_t end;
+        size_t entry;
+    };
+
+    /// the phrases crossing the span
+    double _unigram_score(size_t ind) const {
         double score = 0;
 
-        SPAN* span = &(*_lattice)[ind];
+        size_t begin = _lattice->begin(ind);
+        size_t end = _lattice->end(ind);
 
-        for (size_t j = span->begin + 1; j < span->end; j++) {
+        for (size_t j = begin + 1; j < end; j++) {
             //printf("span inner index %lu\n", j);
             for (auto phrase_ind : _phrase_ends[j]) {
                 auto phrase_begin = _phrase_list[phrase_ind].begin;
@@ -150,11 +246,9 @@ public:
                 //        _phrase_list[phrase_ind].begin,
                 //        _phrase_list[phrase_ind].end
                 //        );
-                if (phrase_begin < span->begin) {
-                    string key = _weight_prefix + _phrase_list[phrase_ind].label();
+                if (phrase_begin < begin) {
                     //printf("conflict!\n");
-                    double* value = this->_weight->get(key);
-                    if (value) score += *value;
+                    score += _phrase_scores[phrase_ind];
                 }
             }
             for (auto phrase_ind : _phrase_begins[j]) {
@@ -164,31 +258,25 @@ public:
                 //        );
 
                 auto phrase_end = _phrase_list[phrase_ind].end;
-                if (phrase_end > span->end) {
-                    string key = _weight_prefix + _phrase_list[phrase_ind].label();
+                if (phrase_end > end) {
                     //printf("conflict!\n");
-                    double* value = this->_weight->get(key);
-                    if (value) score += *value;
+                    score += _phrase_scores[phrase_ind];
                 }
             }
         }
         return score;
     }
-    virtual void calc_gradient( vector<SPAN>& gold, vector<SPAN>& output, Weight& gradient) {
-        for (size_t i = 0; i < gold.size(); i++) {
-            _unigram_phrase_gradient(&gold[i], gradient, 1);
-        }
-        for (size_t i = 0; i < output.size(); i++) {
-            _unigram_phrase_gradient(&output[i], gradient, -1);
-        }
+    void _init(const string& filename, shared_ptr<Dictionary<string>> dictionary) {
+        _filename = filename;
+        _phrase = dictionary;
+        auto automaton = make_shared<AhoCorasick<Dictionary<string>>>();
+        automaton->build(*_phrase);
+        _automaton = automaton;
+        _template = FeatureTemplate("p:" + filename + ":");
     }
-
-
-private:
     void _prepare_phrase() {
         if (!_phrase) return;
         _phrase_list.clear();
-        vector<SPAN> _tmp_phrase_list;
 
         const size_t MAX_PHRASE = 12;
         while (_phrase_begins.size() < _off->size()) {
@@ -203,41 +291,32 @@ private:
         }
 
         /// 找到所有phrase
-        for (size_t i = 0; i < _off->size() - 1; i ++) {
-            size_t begin = (*_off)[i];
-            for (size_t j = i + 1; j < i + MAX_PHRASE; j ++) {
-                if (j >= _off->size()) break;
-                size_t end = (*_off)[j];
-                string value;
-                if (_phrase->get(_raw->substr(begin, end - begin), value)) {
-                    _tmp_phrase_list.push_back(SPAN(i, j, value));
-                    //printf("phrase %s %lu %lu\n",_raw->substr(begin, end - begin).c_str(), i, j);
-                    //_phrase_begins[i].push_back(j);
-                    //_phrase_ends[j].push_back(i);
-                }
-            }
+        _char_at.assign(_raw->size() + 1, DictMatches::npos);
+        for (size_t i = 0; i < _off->size(); i++) {
+            _char_at[(*_off)[i]] = i;
         }
+        _found.clear();
+        _automaton->scan(_raw->data(), _raw->size(),
+                [this, MAX_PHRASE](size_t end, size_t entry, size_t len) {
+                    size_t i = _char_at[end - len];
+                    size_t j = _char_at[end];
+                    if (i == DictMatches::npos || j == DictMatches::npos || j - i >= MAX_PHRASE) return;
+                    _found.push_back(phrase_t{i, j, entry});
+                });
+        std::sort(_found.begin(), _found.end(), [](const phrase_t& a, const phrase_t& b) {
+                return std::tie(a.begin, a.end, a.entry) < std::tie(b.begin, b.end, b.entry);
+                });
         /// 过滤掉overlap的phrase
-        for (auto& pa : _tmp_phrase_list) {
-            bool ok = true;
-            size_t a = pa.begin;
-            size_t b = pa.end;
-            for (auto& pb : _tmp_phrase_list) {
-                if (!ok) break;
-                size_t c = pb.begin;
-                size_t d = pb.end;
-                if ((a < c && c < b && b < d) ||
-                        (c< a && a < d && d < b)) {
-                    ok = false;
-                    break;
-                }
-            }
-            ok = true;
-            if (ok) {
+        if (_drop_crossing) {
+            _mark_crossing(_found, _crossing);
+        }
+        for (size_t k = 0; k < _found.size(); k++) {
+            auto& pa = _found[k];
+            if (!_drop_crossing || !_crossing[k]) {
 #ifdef Debug
-                printf("phrase %lu %lu %s %s\n", a, b, 
-                        _raw->substr((*_off)[a], (*_off)[b] - (*_off)[a]).c_str(),
-                        pa.label().c_str()
+                printf("phrase %lu %lu %s %s\n", pa.begin, pa.end, 
+                        _raw->substr((*_off)[pa.begin], (*_off)[pa.end] - (*_off)[pa.begin]).c_str(),
+                        _phrase->value(pa.entry).c_str()
                         );
 #endif
                 _phrase_list.push_back(pa);
@@ -245,23 +324,101 @@ private:
         }
 
         /// 填写begin end
+        _phrase_scores.clear();
+        size_t len;
         for (size_t ind = 0; ind < _phrase_list.size(); ind++) {
             auto& span = _phrase_list[ind];
             size_t i = span.begin;
             size_t j = span.end;
             _phrase_begins[i].push_back(ind);
             _phrase_ends[j].push_back(ind);
+            const char* label = _phrase->value_data(span.entry, len);
+            _phrase_scores.push_back(this->_weight->value(_template.id(label, len)));
         }
 
     }
-    double _unigram_phrase_gradient(const SPAN* span, Weight& gradient, double delta) {
+    /**
+     * phrases that cross another one, i.e. a < c < b < d for phrases [a, b)
+     * and [c, d). `phrases` are sorted by begin, the ends of those beginning
+     * in (a, b) and the begins of those ending in (a, b) are checked with
+     * range max / min tables, kept from sentence to sentence.
+     * */
+    void _mark_crossing(const vector<phrase_t>& phrases, vector<char>& crossing) {
+        size_t n = phrases.size();
+        crossing.assign(n, 0);
+        if (n < 2) return;
+        vector<size_t>& by_end = _by_end;
+        by_end.resize(n);
+        for (size_t k = 0; k < n; k++) by_end[k] = k;
+        std::sort(by_end.begin(), by_end.end(), [&phrases](size_t x, size_t y) {
+                return phrases[x].end < phrases[y].end;
+                });
+        /// levels of the tables, level l covers 2^l items
+        vector<vector<size_t>>& max_end = _max_end;
+        vector<vector<size_t>>& min_begin = _min_begin;
+        size_t levels = 1;
+        while (((size_t)1 << levels) <= n) levels++;
+        if (max_end.size() < levels) {
+            max_end.resize(levels);
+            min_begin.resize(levels);
+        }
+        max_end[0].resize(n);
+        min_begin[0].resize(n);
+        for (size_t k = 0; k < n; k++) {
+            max_end[0][k] = phrases[k].end;
+            min_begin[0][k] = phrases[by_end[k]].begin;
+        }
+        for (size_t l = 1; l < levels; l++) {
+            size_t half = (size_t)1 << (l - 1);
+            max_end[l].resize(n - 2 * half + 1);
+            min_begin[l].resize(n - 2 * half + 1);
+            for (size_t k = 0; k + 2 * half <= n; k++) {
+                max_end[l][k] = max(max_end[l - 1][k], max_end[l - 1][k + half]);
+                min_begin[l][k] = min(min_begin[l - 1][k], min_begin[l - 1][k + half]);
+            }
+        }
+        auto level = [](size_t len) {
+            size_t l = 0;
+            while (((size_t)2 << l) <= len) l++;
+            return l;
+        };
+        for (size_t k = 0; k < n; k++) {
+            size_t a = phrases[k].begin;
+            size_t b = phrases[k].end;
+            /// phrases beginning in (a, b)
+            size_t lo = std::upper_bound(phrases.begin(), phrases.end(), a,
+                    [](size_t v, const phrase_t& p) { return v < p.begin; }) - phrases.begin();
+            size_t hi = std::lower_bound(phrases.begin(), phrases.end(), b,
+                    [](const phrase_t& p, size_t v) { return p.begin < v; }) - phrases.begin();
+            if (lo < hi) {
+                size_t l = level(hi - lo);
+                if (max(max_end[l][lo], max_end[l][hi - ((size_t)1 << l)]) > b) {
+                    crossing[k] = 1;
+                    continue;
+                }
+            }
+            /// phrases ending in (a, b)
+            lo = std::upper_bound(by_end.begin(), by_end.end(), a,
+                    [&phrases](size_t v, size_t p) { return v < phrases[p].end; }) - by_end.begin();
+            hi = std::lower_bound(by_end.begin(), by_end.end(), b,
+                    [&phrases](size_t p, size_t v) { return phrases[p].end < v; }) - by_end.begin();
+            if (lo < hi) {
+                size_t l = level(hi - lo);
+                if (min(min_begin[l][lo], min_begin[l][hi - ((size_t)1 << l)]) < a) {
+                    crossing[k] = 1;
+                }
+            }
+        }
+    }
+    double _unigram_phrase_gradient(const SPAN* span, SparseGradient& gradient, double delta) {
         if (!_phrase) return 0;
 
         for (size_t j = span->begin + 1; j < span->end; j++) {
             for (auto phrase_ind : _phrase_ends[j]) {
                 auto phrase_begin = _phrase_list[phrase_ind].begin;
                 if (phrase_begin < span->begin) {
-                    string key = _weight_prefix + _phrase_list[phrase_ind].label();
+                    size_t len;
+                    const char* label = _phrase->value_data(_phrase_list[phrase_ind].entry, len);
 
                     //if (delta == 1) {
                     //    auto& phrase = _phrase_list[phrase_ind];
@@ -270,64 +427,403 @@ private:
                     //    printf("phrase update\n");
                     //}
 
-                    gradient.add_from(key, &delta, 1);
+                    gradient.add(_template, label, len, delta);
                 }
             }
             for (auto phrase_ind : _phrase_begins[j]) {
                 auto phrase_end = _phrase_list[phrase_ind].end;
 
                 if (phrase_end > span->end) {
-                    string key = _weight_prefix + _phrase_list[phrase_ind].label();
+                    size_t len;
+                    const char* label = _phrase->value_data(_phrase_list[phrase_ind].entry, len);
                     //if (delta == 1) {
                     //    auto& phrase = _phrase_list[phrase_ind];
                     //    printf("%s\n", _raw->data());
                     //    printf("%s\n", _raw->substr((*_off)[phrase.begin], (*_off)[phrase.end] - (*_off)[phrase.begin]).c_str());
                     //    printf("phrase update\n");
                     //}
-                    gradient.add_from(key, &delta, 1);
+                    gradient.add(_template, label, len, delta);
                 }
             }
         }
+        return 0;
     }
 
 
-    string _weight_prefix;
+    string _filename;
+    FeatureTemplate _template;
     shared_ptr<Dictionary<string>> _phrase;
-
-    vector<SPAN> _phrase_list;
+    shared_ptr<const AhoCorasick<Dictionary<string>>> _automaton;
+    bool _drop_crossing = false;
+    vector<char> _crossing;
+    vector<size_t> _by_end;         ///< the tables of `_mark_crossing`
+    vector<vector<size_t>> _max_end;
+    vector<vector<size_t>> _min_begin;
+    vector<size_t> _char_at;
+    vector<phrase_t> _found;        ///< every phrase in the sentence, sorted
+
+    vector<phrase_t> _phrase_list;  ///< those kept
+    vector<double> _phrase_scores;
     vector<vector<size_t>> _phrase_begins;
     vector<vector<size_t>> _phrase_ends;
 
-    vector<SPAN>* _lattice;
+    const Lattice* _lattice;
     shared_ptr<string> _raw;
     shared_ptr<vector<size_t>> _off;
 };
 
 
+/**
+ * the char unigram and bigram rows of the emission, by char id
+ *
+ * the chars are those of the rows named by one or two chars in the weight,
+ * every other char is read as `UNK`, which has no rows. a sentence is read
+ * into ids once, and the rows of a char or of a pair are then found by
+ * their entry index. nothing grows while decoding: the chars and the pairs
+ * are only added as the weight grows in training. `set_weight` has to be
+ * called again whenever the weight is reloaded.
+ * */
+class CharEmission {
+private:
+    enum : uint32_t { EMPTY = 0, MISSING = ~(uint32_t)0 };
+    struct char_t {
+        uint64_t id;        ///< of the char as a key
+        uint64_t uni_id;    ///< of its unigram, '|' is read as '，'
+        uint32_t uni;       ///< entry of the unigram, MISSING if none
+    };
+    struct pair_t {
+        uint64_t key;       ///< first << 32 | second, EMPTY if free
+        uint32_t ind;
+    };
+
+    const Weight* _weight;
+    size_t _synced;             ///< entries of the weight already read
+    vector<char_t> _chars;      ///< `UNK` first
+    vector<uint32_t> _table;    ///< char id by the id of the char, EMPTY if free
+    vector<pair_t> _pairs;
+    size_t _n_pairs;
+
+    static inline size_t _mix(uint64_t id) {
+        id ^= id >> 33;
+        id *= 0xff51afd7ed558ccdULL;
+        id ^= id >> 33;
+        return (size_t)id;
+    }
+    inline size_t _char_slot(uint64_t id) const {
+        size_t mask = _table.size() - 1;
+        size_t i = _mix(id) & mask;
+        while (_table[i] != EMPTY && _chars[_table[i]].id != id) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+    inline size_t _pair_slot(uint64_t key) const {
+        size_t mask = _pairs.size() - 1;
+        size_t i = _mix(key) & mask;
+        while (_pairs[i].key != EMPTY && _pairs[i].key != key) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+    uint32_t _char(const char* p, size_t len) {
+        uint64_t id = feature_id(p, len);
+        size_t slot = _char_slot(id);
+        if (_table[slot] != EMPTY) return _table[slot];
+        char_t c;
+        c.id = id;
+        c.uni_id = (len == 1 && *p == '|') ? feature_id("，") : id;
+        size_t found = _weight->find(c.uni_id);
+        c.uni = (found == Weight::npos) ? (uint32_t)MISSING : (uint32_t)found;
+        _chars.push_back(c);
+        if (_chars.size() * 2 > _table.size()) {
+            _table.assign(_table.size() * 2, EMPTY);
+            for (size_t k = UNK + 1; k < _chars.size(); k++) {
+                _table[_char_slot(_chars[k].id)] = k;
+            }
+        } else {
+            _table[slot] = _chars.size() - 1;
+        }
+        return _chars.size() - 1;
+    }
+    void _add_pair(uint64_t key, uint32_t ind) {
+        _pairs[_pair_slot(key)] = pair_t{key, ind};
+        if (++_n_pairs * 2 <= _pairs.size()) return;
+        vector<pair_t> pairs(_pairs.size() * 2, pair_t{EMPTY, MISSING});
+        pairs.swap(_pairs);
+        for (auto& pair : pairs) {
+            if (pair.key != EMPTY) _pairs[_pair_slot(pair.key)] = pair;
+        }
+    }
+    /// the chars and pairs of the entries added to the weight since the last call
+    void _sync() {
+        size_t len;
+        for (; _synced < _weight->size(); _synced++) {
+            const char* name = _weight->name(_synced, len);
+            if (!len || !utf8_first(name[0])) continue;
+            size_t second = 1;
+            while (second < len && !utf8_first(name[second])) second++;
+            size_t end = second;
+            if (end < len) {
+                end++;
+                while (end < len && !utf8_first(name[end])) end++;
+            }
+            if (end < len || _weight->id(_synced) != feature_id(name, len)) continue;
+            if (second == len) {
+                uint32_t c = _char(name, len);
+                if (_chars[c].uni_id == _weight->id(_synced)) _chars[c].uni = _synced;
+                if (len == strlen("，") && !memcmp(name, "，", len)) {
+                    _chars[_char("|", 1)].uni = _synced;
+                }
+                continue;
+            }
+            uint32_t a = _char(name, second);
+            uint32_t b = _char(name + second, len - second);
+            _add_pair(((uint64_t)a << 32) | b, _synced);
+        }
+    }
+public:
+    enum : uint32_t { UNK = 0 };
+
+    CharEmission() : _weight(nullptr), _synced(0) {}
+
+    /// reads the chars and the pairs of `weight`
+    void set_weight(const Weight& weight) {
+        _weight = &weight;
+        _synced = 0;
+        _chars.assign(1, char_t{0, 0, MISSING});
+        _table.assign(256, EMPTY);
+        _pairs.assign(256, pair_t{EMPTY, MISSING});
+        _n_pairs = 0;
+        _sync();
+    }
+    /// the ids of the chars of `raw`, which begin at `off`
+    void encode(const string& raw, const vector<size_t>& off,
+            vector<uint32_t>& ids) {
+        if (_synced != _weight->size()) _sync();
+        ids.resize(off.size() - 1);
+        for (size_t i = 0; i + 1 < off.size(); i++) {
+            uint64_t id = feature_id(raw.data() + off[i], off[i + 1] - off[i]);
+            ids[i] = _table[_char_slot(id)];
+        }
+    }
+    /// chars known to the weight, with `UNK`
+    size_t size() const {
+        return _chars.size();
+    }
+
+    inline row_t unigram(uint32_t c) const {
+        uint32_t ind = _chars[c].uni;
+        return (ind == MISSING) ? row_t() : _weight->row_at(ind);
+    }
+    inline row_t bigram(uint32_t a, uint32_t b) const {
+        if (a == UNK || b == UNK) return row_t();
+        const pair_t& pair = _pairs[_pair_slot(((uint64_t)a << 32) | b)];
+        return (pair.key == EMPTY) ? row_t() : _weight->row_at(pair.ind);
+    }
+};
+
+
+/**
+ * the features of a LabelledFeature chosen at run time, one virtual call
+ * per feature and lattice. only the features with bigram terms are asked
+ * for the bigrams of span pairs
+ * */
 template<class SPAN>
+class DynamicFeatures : public vector<shared_ptr<ILatticeFeature<SPAN>>> {
+public:
+    void set_weight(Weight& weight) {
+        for (auto& f : *this) f->set_weight(weight);
+    }
+    void prepare(shared_ptr<string>& raw, shared_ptr<vector<size_t>>& off,
+            const Lattice& lattice) {
+        _bigram.clear();
+        for (auto& f : *this) {
+            f->prepare(raw, off, lattice);
+            if (f->has_bigram()) _bigram.push_back(f.get());
+        }
+    }
+    bool has_bigram() const {
+        return !_bigram.empty();
+    }
+    /// features of their own, for another thread
+    DynamicFeatures clone() const {
+        DynamicFeatures features;
+        for (auto& f : *this) features.push_back(f->clone());
+        return features;
+    }
+    void unigrams(size_t n, double* scores) {
+        for (auto& f : *this) f->unigrams(n, scores);
+    }
+    void add_unigram(size_t uni, double& score) {
+        for (auto& f : *this) {
+            double s = f->unigram(uni);
+#ifdef Debug
+            printf("features: %g\n", s);
+#endif
+            score += s;
+        }
+    }
+    double bigram(size_t first, size_t second) {
+        double score = 0;
+        for (auto f : _bigram) {
+            double b_score = f->bigram(first, second);
+            score += b_score;
+#ifdef Debug
+            printf("bigram feature %g\n", b_score);
+#endif
+        }
+        return score;
+    }
+    void calc_gradient(vector<SPAN>& gold, vector<SPAN>& output, SparseGradient& gradient) {
+        for (auto& f : *this) f->calc_gradient(gold, output, gradient);
+    }
+private:
+    vector<ILatticeFeature<SPAN>*> _bigram;
+};
+
+/**
+ * a set of features fixed at compile time, e.g.
+ * `FeatureSet<SPAN, DictFeature<SPAN>, PhraseFeature<SPAN>>`. the features
+ * are held by value and called by their own type, so their calls can be
+ * inlined
+ * */
+template<class SPAN, class... FEATURES>
+class FeatureSet {
+public:
+    FeatureSet() {}
+    FeatureSet(const FEATURES&... features) : _features(features...) {}
+
+    std::tuple<FEATURES...>& features() {
+        return _features;
+    }
+    void set_weight(Weight& weight) {
+        _set_weight_t op{weight};
+        _each(op);
+    }
+    void prepare(shared_ptr<string>& raw, shared_ptr<vector<size_t>>& off,
+            const Lattice& lattice) {
+        _prepare_t op{raw, off, lattice, false};
+        _each(op);
+        _has_bigram = op.has_bigram;
+    }
+    bool has_bigram() const {
+        return _has_bigram;
+    }
+    /// the features are held by value, a copy is already their own
+    FeatureSet clone() const {
+        return *this;
+    }
+    void unigrams(size_t n, double* scores) {
+        _unigrams_t op{n, scores};
+        _each(op);
+    }
+    void add_unigram(size_t uni, double& score) {
+        _unigram_t op{uni, score};
+        _each(op);
+    }
+    double bigram(size_t first, size_t second) {
+        _bigram_t op{first, second, 0};
+        _each(op);
+        return op.score;
+    }
+    void calc_gradient(vector<SPAN>& gold, vector<SPAN>& output, SparseGradient& gradient) {
+        _gradient_t op{gold, output, gradient};
+        _each(op);
+    }
+private:
+    struct _set_weight_t {
+        Weight& weight;
+        template<class F> void operator()(F& f) { f.set_weight(weight); }
+    };
+    struct _prepare_t {
+        shared_ptr<string>& raw;
+        shared_ptr<vector<size_t>>& off;
+        const Lattice& lattice;
+        bool has_bigram;
+        template<class F> void operator()(F& f) {
+            f.prepare(raw, off, lattice);
+            has_bigram = has_bigram || f.has_bigram();
+        }
+    };
+    struct _unigrams_t {
+        size_t n;
+        double* scores;
+        template<class F> void operator()(F& f) { f.unigrams(n, scores); }
+    };
+    struct _unigram_t {
+        size_t uni;
+        double& score;
+        template<class F> void operator()(F& f) { score += f.unigram(uni); }
+    };
+    struct _bigram_t {
+        size_t first;
+        size_t second;
+        double score;
+        template<class F> void operator()(F& f) {
+            if (f.has_bigram()) score += f.bigram(first, second);
+        }
+    };
+    struct _gradient_t {
+        vector<SPAN>& gold;
+        vector<SPAN>& output;
+        SparseGradient& gradient;
+        template<class F> void operator()(F& f) { f.calc_gradient(gold, output, gradient); }
+    };
+
+    template<size_t I = 0, class OP>
+    typename std::enable_if<I == sizeof...(FEATURES)>::type _each(OP&) {}
+    template<size_t I = 0, class OP>
+    typename std::enable_if<(I < sizeof...(FEATURES))>::type _each(OP& op) {
+        op(std::get<I>(_features));
+        _each<I + 1>(op);
+    }
+
+    std::tuple<FEATURES...> _features;
+    bool _has_bigram = false;
+};
+
+
+/**
+ * the char emission, word-based and bigram features of labelled spans
+ *
+ * spans longer than MAX_LEN - 1 chars share a length class in the
+ * transitions. the emission and the span scores are kept as SCORE, float
+ * halves their memory and doubles the width of the kernels
+ * */
+template<class SPAN, class FEATURES = DynamicFeatures<SPAN>,
+        size_t MAX_LEN = 4, class SCORE = double>
 class LabelledFeature {
 public:
-    LabelledFeature() :_transition_ptr(nullptr),
-        _dict(nullptr) {};
+    typedef SCORE score_t;
+    LabelledFeature() : _dict(nullptr), _transition_f64(nullptr), _classes(0), _tags(1) {};
 
     void set_tag_indexer(shared_ptr<Indexer<string>> tag_indexer) {
         _tag_indexer = tag_indexer;
     }
     void set_weight(Weight& dict) {
         _dict = &dict;
-        for (auto& f : _features) {
-            f->set_weight(dict);
-        }
+        _char_emission.set_weight(dict);
+        _features.set_weight(dict);
     }
-    vector<shared_ptr<ILatticeFeature<SPAN>>>& features() {
+    FEATURES& features() {
         return _features;
     }
+    /**
+     * a feature for another thread. the weight, the tags and the data of
+     * the features are shared and must not change while both are used,
+     * the buffers of a sentence are its own
+     * */
+    LabelledFeature clone() const {
+        LabelledFeature feature(*this);
+        feature._features = _features.clone();
+        return feature;
+    }
     
 
     void prepare(
             shared_ptr<string>& raw,
             shared_ptr<vector<size_t>>& off,
-            vector<SPAN>& lattice) {
+            const Lattice& lattice) {
         if (_dict == nullptr) {
             fprintf(stderr, "no weight are set for feature");
             return;
@@ -336,28 +832,31 @@ public:
         printf(">>>>>>>>>>>>>>>>>");
         printf("%s\n", raw->data());
 #endif
-        for (auto& f : _features) {
-            //printf("pre\n");
-            f->prepare(raw, off, lattice);
-        }
+        _features.prepare(raw, off, lattice);
         _lattice = &lattice;
         //to_half(*raw, *off, _raw, _off);
-        _normalizer(*raw, *off, _raw, _off);
-        _transition_ptr = _dict->get("transition");
-        _calc_emission(*_dict, _raw, _emission, false);
+        _normalizer(raw->data(), raw->size(), _raw, _off);
+        if (_off.size() != off->size()) {
+            /// `off` was not found by `utf8_off`
+            _normalizer(*raw, *off, _raw, _off);
+        }
+        _char_emission.encode(_raw, _off, _chars);
+        _transition = _dict->row("transition");
+        _classes = MAX_LEN * tagset_size();
+        _transition_f64 = (_transition && _transition.type == F64)
+            ? (const double*)_transition.ptr : nullptr;
+        _tags = tagset_size();
+        _calc_emission(_emission);
+        _calc_m_prefix();
 
         _labels.clear();
         _label_index.clear();
 
         for (size_t i = 0; i < lattice.size(); i++) {
-            const SPAN& span = lattice[i];
-            _label_index.push_back(_tag_indexer->get(span.label()));
-            size_t wl = span.end - span.begin;
+            _label_index.push_back(lattice.tag(i));
+            size_t wl = lattice.length(i);
             if (wl >= MAX_LEN) wl = 0;
-            _labels.push_back(
-                        _tag_indexer->get(span.label()) * (MAX_LEN)
-                        + wl
-                    );
+            _labels.push_back(lattice.tag(i) * (MAX_LEN) + wl);
         }
 
         _calc_char_type();
@@ -368,7 +867,7 @@ public:
     void calc_gradient(
             vector<SPAN>& gold, 
             vector<SPAN>& output, 
-            Weight& gradient) {
+            SparseGradient& gradient) {
 
         /// is eaual
         if (gold.size() == output.size()) {
@@ -381,9 +880,7 @@ public:
             if (is_equal) { return; }
         }
 
-        for (auto& f : _features) {
-            f->calc_gradient(gold, output, gradient);
-        }
+        _features.calc_gradient(gold, output, gradient);
 
         /// character based
         _emission.clear();
@@ -394,7 +891,8 @@ public:
         for (size_t i = 0; i < output.size(); i++) {
             _update_span_emi(output[i], -1);
         }
-        _calc_emission(gradient, _raw, _emission, true);
+        _char_ngram_gradient(1, _raw, _off, _emission, gradient);
+        _char_ngram_gradient(2, _raw, _off, _emission, gradient);
 
         /// word-based
         vector<string> keys;
@@ -404,7 +902,7 @@ public:
             keys.clear();
             _uni_keys(gold[i], keys);
             for (auto& key : keys) {
-                gradient.add_from(key, &delta, 1);
+                gradient.add(key, delta);
             }
         }
         delta = -1;
@@ -412,15 +910,15 @@ public:
             keys.clear();
             _uni_keys(output[i], keys);
             for (auto& key : keys) {
-                gradient.add_from(key, &delta, 1);
+                gradient.add(key, delta);
             }
         }
 
         /// bigram
-        vector<double> g_trans((MAX_LEN) * _tag_indexer->size() * (MAX_LEN) * _tag_indexer->size());
-        _update_g_trans(g_trans, gold, 1);
-        _update_g_trans(g_trans, output, -1);
-        gradient.add_from("transition", &g_trans[0], g_trans.size());
+        size_t trans = gradient.row("transition",
+                (MAX_LEN) * _tag_indexer->size() * (MAX_LEN) * _tag_indexer->size());
+        _update_g_trans(gradient, trans, gold, 1);
+        _update_g_trans(gradient, trans, output, -1);
     }
 
 
@@ -428,70 +926,82 @@ public:
      * interface to calc unigram scores
      * */
     double unigram(size_t uni) {
-        const SPAN& span = (*_lattice)[uni];
+        span_t span(_lattice->begin(uni), _lattice->end(uni));
 #ifdef Debug
         printf("%s\n", _raw.substr(_off[span.begin],
                     _off[span.end] - _off[span.begin]).c_str());
 #endif
 
-        double score = 0;
-
-        size_t l = _label_index[uni];
-
         /// char-based features
-        if (span.end - span.begin == 1) { // S
-            score += _emission[span.begin * N * tagset_size() + N * l + 3];
-#ifdef Debug
-            printf("emission S %g\n", _emission[span.begin * N * tagset_size() + N * l + 3]);
-#endif
-
-        } else { // BM*E
-#ifdef Debug
-            printf("emission B %g\n", _emission[span.begin * N * tagset_size() + N * l + 0]);
-#endif
-            score += _emission[span.begin * N * tagset_size() + N * l + 0];
-            for (size_t i = span.begin + 1; i < span.end - 1; i++) {
-                score += _emission[i * N * tagset_size() + N * l + 1];
-#ifdef Debug
-                printf("emission M %g\n", _emission[i * N * tagset_size() + N * l + 1]);
-#endif
-            }
-            score += _emission[(span.end - 1) * N * tagset_size() + N * l + 2];
-#ifdef Debug
-            printf("emission E %g\n", _emission[(span.end - 1) * N * tagset_size() + N * l + 2]);
-#endif
-        }
+        double score = _char_score(span.begin, span.end, _label_index[uni]);
 
 #ifdef Debug
         printf("basic features: %g\n", score);
 #endif
 
         /// word-based
-        vector<string> keys;
-        _uni_keys(span, keys);
-        for (auto& key : keys) {
-            double* ptr = _dict->get(key);
-#ifdef Debug
-            if (ptr) {
-                printf("word-based feature %s : %g\n", key.data(), *ptr);
-            }
+        score += _word_score(span);
 
-#endif
-            if (ptr) score += *ptr;
+        _features.add_unigram(uni, score);
+        return score;
+    }
+    /**
+     * the unigram scores of all spans of the lattice at once, each feature
+     * adds its scores in one call
+     * */
+    void unigrams(SCORE* scores) {
+        for (size_t k = 0; k < _lattice->size(); k++) {
+            span_t span(_lattice->begin(k), _lattice->end(k));
+            scores[k] = _char_score(span.begin, span.end, _label_index[k])
+                + _word_score(span);
         }
+        _feature_unigrams(scores);
+    }
 
-
-        for (auto& f : _features) {
-            double s = f->unigram(uni);
+    /**
+     * B, M* and E of the label `l` over [begin, end), or S. the M part is
+     * the difference of two prefix sums
+     * */
+    inline SCORE _char_score(size_t begin, size_t end, size_t l) const {
+        const size_t NT = N * _tags;
+        if (end - begin == 1) { // S
+            return _emission[begin * NT + N * l + 3];
+        }
+        SCORE score = _emission[begin * NT + N * l + 0];
+        score += _m_prefix[(end - 1) * _tags + l] - _m_prefix[(begin + 1) * _tags + l];
+        score += _emission[(end - 1) * NT + N * l + 2];
+        return score;
+    }
+    /// _m_prefix[i * tags + l] sums the M emissions of label l before char i
+    void _calc_m_prefix() {
+        size_t chars = _emission.size() / (N * _tags);
+        _m_prefix.resize((chars + 1) * _tags);
+        lane_prefix_sum<N>(_emission.data(), 1, _tags, chars, _m_prefix.data());
+    }
+    /// the scores of the other features, which are doubles
+    void _feature_unigrams(double* scores) {
+        _features.unigrams(_lattice->size(), scores);
+    }
+    void _feature_unigrams(float* scores) {
+        _feature_scores.assign(_lattice->size(), 0);
+        _features.unigrams(_lattice->size(), _feature_scores.data());
+        for (size_t k = 0; k < _lattice->size(); k++) scores[k] += _feature_scores[k];
+    }
+    inline double _word_score(const span_t& span) {
+        double score = 0;
+        vector<string> keys;
+        _uni_keys(span, keys);
+        for (auto& key : keys) {
+            double value = _dict->value(key);
 #ifdef Debug
-            printf("features: %g\n", s);
+            printf("word-based feature %s : %g\n", key.data(), value);
 #endif
-            score += s;
+            score += value;
         }
         return score;
     }
 
-    void _uni_keys(const SPAN& span, vector<string>& keys) {
+    void _uni_keys(const span_t& span, vector<string>& keys) {
         return;
         char buffer[128];
         char* p = buffer;
@@ -546,90 +1056,101 @@ public:
      * interface to calc bigram scores
      * */
     inline double bigram(size_t first, size_t second) {
-        double score = 0;
-        for (auto& f : _features) {
-            double b_score = f->bigram(first, second);
-            score += b_score;
+        double score = _features.bigram(first, second);
+        if (_transition) {
 #ifdef Debug
-            printf("bigram feature %g\n", b_score);
-#endif
-        }
-        double* ptr = _transition_ptr;
-        if (ptr == nullptr){
-        } else {
-#ifdef Debug
-            printf("bigram transition %g\n", ptr[_trans_ind(first, second)]);
+            printf("bigram transition %g\n", _transition.at(_trans_ind(first, second)));
 #endif
-            score += ptr[_trans_ind(first, second)];
+            score += _transition.at(_trans_ind(first, second));
         };
         return score;
     }
 
+    /**
+     * without bigram features, the bigram score of two spans only depends
+     * on their classes (tag, length), see `_trans_ind`
+     * */
+    bool factorized() const {
+        return !_features.has_bigram();
+    }
+    size_t bigram_classes() const {
+        return _classes;
+    }
+    inline size_t bigram_class(size_t uni) const {
+        return _labels[uni];
+    }
+    /// `bigram` of spans of the classes `a` and `b`, when `factorized`
+    inline double class_bigram(size_t a, size_t b) const {
+        double score = 0;
+        if (_transition_f64) {
+            score += _transition_f64[a * _classes + b];
+        } else if (_transition) {
+            score += _transition.at(a * _classes + b);
+        }
+        return score;
+    }
+
     /**
      * 计算字ngram特征
      * */
     void _calc_char_ngram_emision(
+            const size_t n,
+            const vector<uint32_t>& chars,
+            aligned_vector<SCORE>& emission
+            ) {
+        for (size_t i = 0; i + n <= chars.size(); i++) {
+            int b = (((int)i - 1) * (int)N * (int)tagset_size());
+            int e = (min(((int)(2 + n)), ((int)chars.size() + 1 - (int)i))
+                    * N * tagset_size());
+            int j = max(0, - b);
+            SCORE *eo = emission.data() + b;
+
+            row_t m = (n == 1) ? _char_emission.unigram(chars[i])
+                : _char_emission.bigram(chars[i], chars[i + 1]);
+            if (!m) continue;
+            m.add_to(eo, j, e);
+        }
+    }
+
+    /**
+     * the gradient of the char ngrams, from that of the emission
+     * */
+    void _char_ngram_gradient(
             const size_t n,
             const string& raw,
             const vector<size_t>& begins,
-            Weight& model,
-            vector<double>& emission, bool update
+            const aligned_vector<SCORE>& emission,
+            SparseGradient& gradient
             ) {
         for (size_t i = 0; i < begins.size() - n; i++) {
-            string uni = raw.substr(begins[i], 
-                    begins[i + n] - begins[i]);
-
-            if (n == 1 && uni[0] == '|') {
-                uni = string("，");
+            const char* key = raw.data() + begins[i];
+            size_t key_len = begins[i + n] - begins[i];
+            if (n == 1 && key[0] == '|') {
+                key = "，";
+                key_len = strlen(key);
             }
-
-            double* m = model.get(uni);
-            if (m == nullptr) {
-                if (update == false) {
-                    continue;
-                } else {
-                    model.insert(uni, (n + 2) * N * tagset_size());
-                    m = model.get(uni);
-                }
-            };
-
-#ifdef Debug
-            printf("char_key : %s\n", uni.c_str());
-            for (size_t k = 0; k < (n + 2); k++) {
-                for (size_t j = 0; j < N * tagset_size(); j++) {
-                    printf(" %.3g ", m[k * tagset_size() * N + j]);
-                }
-                printf("\n");
-            };
-#endif
+            uint64_t id = feature_id(key, key_len);
 
             int b = (((int)i - 1) * (int)N * (int)tagset_size());
             int e = (min(((int)(2 + n)), ((int)begins.size() - (int)i))
                     * N * tagset_size());
             int j = max(0, - b);
-            double *eo = emission.data() + b;
+            const SCORE *eo = emission.data() + b;
 
-            if (update == false) {
-                for (; j < e; j++) {
-                    eo[j] += m[j];
-                }
-            } else {
-                for (; j < e; j++) {
-                    m[j] += eo[j];
-                }
+            size_t row = gradient.row(id, (n + 2) * N * tagset_size(),
+                    key, key_len);
+            for (; j < e; j++) {
+                gradient.add(row, j, eo[j]);
             }
         }
     }
 
-    void _calc_emission(Weight& model, const string& raw,
-            vector<double>& emission, bool update) {
-        if (!update) {
-            emission.clear();
-            emission.insert(emission.end(), 
-                    N * tagset_size() * (_off.size() - 1), 0);
-        }
-        _calc_char_ngram_emision(1, raw, _off, model, emission, update);
-        _calc_char_ngram_emision(2, raw, _off, model, emission, update);
+    void _calc_emission(aligned_vector<SCORE>& emission) {
+        emission.clear();
+        emission.insert(emission.end(), 
+                N * tagset_size() * _chars.size(), 0);
+        _calc_char_ngram_emision(1, _chars, emission);
+        _calc_char_ngram_emision(2, _chars, emission);
     }
 
     void _update_span_emi(SPAN& span, double delta) {
@@ -660,12 +1181,13 @@ public:
         return i_a * (MAX_LEN) * _tag_indexer->size() + i_b;
     }
 
-    void _update_g_trans(vector<double>& g_trans, vector<SPAN>& seq, double delta) {
-        for (size_t i = 0; i < seq.size() - 1; i++) {
+    void _update_g_trans(SparseGradient& gradient, size_t trans,
+            vector<SPAN>& seq, double delta) {
+        for (size_t i = 0; i + 1 < seq.size(); i++) {
             SPAN& span_a = seq[i];
             SPAN& span_b = seq[i + 1];
 
-            g_trans[_trans_ind(span_a, span_b)] += delta;
+            gradient.add(trans, _trans_ind(span_a, span_b), delta);
         }
     }
     size_t tagset_size() const {
@@ -707,12 +1229,13 @@ private:
     };
 
 
-    const size_t N = 4;
-    const size_t MAX_LEN = 4;
+    enum : size_t { N = 4 }; ///< B, M, E and S
 
     string _raw;
     vector<size_t> _off;
-    const vector<SPAN>* _lattice;
+    vector<uint32_t> _chars; ///< ids of the chars of `_raw`
+    CharEmission _char_emission;
+    const Lattice* _lattice;
     
     vector<size_t> _char_types;
 
@@ -722,14 +1245,19 @@ private:
     /// features
     Weight* _dict;
     /// char-based related
-    double* _transition_ptr;
+    row_t _transition;
+    const double* _transition_f64; ///< the values of `_transition` if not quantized
+    size_t _classes;
     vector<size_t> _labels;
     vector<size_t> _label_index;
-    vector<double> _emission;
+    aligned_vector<SCORE> _emission;
+    aligned_vector<SCORE> _m_prefix; ///< see `_calc_m_prefix`
+    vector<double> _feature_scores;
+    size_t _tags;
 
     shared_ptr<Indexer<string>> _tag_indexer;
     
-    vector<shared_ptr<ILatticeFeature<SPAN>>> _features;
+    FEATURES _features;
 
 
 };
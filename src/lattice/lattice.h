@@ -1,4 +1,7 @@
 #pragma once
+#include "common/common.h"
+
+#include<cstdint>
 #include<string>
 #include<set>
 #include<vector>
@@ -6,7 +9,6 @@
 
 namespace tenseg {
 using namespace std;
-using namespace google;
 
 struct span_t {
     size_t begin;
@@ -14,6 +16,8 @@ struct span_t {
     span_t() : begin(0), end(0) {};
     span_t(size_t b, size_t e) : begin(b), end(e) {
     }
+    span_t(size_t b, size_t e, const string& l) : begin(b), end(e) {
+    }
     template <class T>
     span_t(const T& ref) {
         begin = ref.begin;
@@ -48,7 +52,7 @@ struct labelled_span_t : public span_t {
     string label_;
 
     labelled_span_t(size_t b, size_t e) : span_t(b, e), label_(string()){};
-    labelled_span_t(size_t b, size_t e, string& l) : span_t(b, e), label_(l){};
+    labelled_span_t(size_t b, size_t e, const string& l) : span_t(b, e), label_(l){};
 
     const string& label() const{
         return label_;
@@ -102,64 +106,196 @@ ostream& operator<<(ostream & os, const lattice_t<SPAN>& lat) {
     return os;
 }
 
-class PathFinder {
+/**
+ * 词图: the spans of a sentence as (begin, length, tag id), 8 bytes each
+ *
+ * spans are added in the order of their first char. `seal` then lists
+ * them by their last char as well, CSR-style: the spans beginning at char
+ * i are the indices [begin_at(i), begin_at(i + 1)), those ending at char j
+ * are `by_end()[end_at(j) .. end_at(j + 1))`. the arrays are kept from
+ * sentence to sentence, so a lattice allocates nothing once warmed up.
+ * */
+struct packed_span_t {
+    uint32_t begin;
+    uint16_t len;
+    uint16_t tag;
+};
+
+class Lattice {
+public:
+    Lattice() : _chars(0) {}
+
+    /// starts a lattice of `chars` chars, with the tags of `tags`
+    void reset(size_t chars, shared_ptr<Indexer<string>> tags) {
+        _chars = chars;
+        _tags = tags;
+        _spans.clear();
+    }
+    /// `begin` is not less than that of the spans added before
+    inline void add(size_t begin, size_t end, size_t tag) {
+        packed_span_t span;
+        span.begin = begin;
+        span.len = end - begin;
+        span.tag = tag;
+        _spans.push_back(span);
+    }
+    void seal() {
+        _begin_at.assign(_chars + 2, 0);
+        _end_at.assign(_chars + 2, 0);
+        for (auto& span : _spans) {
+            _begin_at[span.begin + 1]++;
+            _end_at[span.begin + span.len + 1]++;
+        }
+        for (size_t i = 0; i <= _chars; i++) {
+            _begin_at[i + 1] += _begin_at[i];
+            _end_at[i + 1] += _end_at[i];
+        }
+        /// stable, spans ending at the same char keep their order
+        _by_end.resize(_spans.size());
+        _cursor.assign(_end_at.begin(), _end_at.end());
+        for (size_t k = 0; k < _spans.size(); k++) {
+            _by_end[_cursor[end(k)]++] = k;
+        }
+    }
+
+    size_t size() const { return _spans.size(); }
+    size_t chars() const { return _chars; }
+    inline size_t begin(size_t k) const { return _spans[k].begin; }
+    inline size_t end(size_t k) const { return _spans[k].begin + _spans[k].len; }
+    inline size_t length(size_t k) const { return _spans[k].len; }
+    inline size_t tag(size_t k) const { return _spans[k].tag; }
+    const string& label(size_t k) const {
+        static const string none;
+        return _tags ? (*_tags)[_spans[k].tag] : none;
+    }
+    /// a span of the sentence for the output
+    template<class SPAN>
+    SPAN span(size_t k) const {
+        return SPAN(begin(k), end(k), label(k));
+    }
+
+    inline size_t begin_at(size_t i) const { return _begin_at[i]; }
+    inline size_t end_at(size_t j) const { return _end_at[j]; }
+    inline const uint32_t* by_end() const { return _by_end.data(); }
+
+    size_t memory_bytes() const {
+        return _spans.capacity() * sizeof(packed_span_t)
+            + (_begin_at.capacity() + _end_at.capacity() + _by_end.capacity()
+                    + _cursor.capacity()) * sizeof(uint32_t);
+    }
+private:
+    size_t _chars;
+    shared_ptr<Indexer<string>> _tags;
+    vector<packed_span_t> _spans;
+    vector<uint32_t> _begin_at;
+    vector<uint32_t> _end_at;
+    vector<uint32_t> _by_end;
+    vector<uint32_t> _cursor;
+};
+
+/**
+ * viterbi over a lattice
+ *
+ * the unigram scores of all spans are asked for at once, before the search.
+ *
+ * if the bigram score of two spans only depends on their classes, as told
+ * by `FEATURE::factorized`, the spans ending at a char are reduced to the
+ * best one of each class first. each class of the spans beginning there
+ * is then scored against those, instead of every pair of spans. ties go
+ * to the first span in the lattice either way, so both searches find the
+ * same path.
+ * */
+/**
+ * the best path of a lattice, with the span scores kept as SCORE, which is
+ * the score type of the features it is used with
+ * */
+template<class SCORE = double>
+class BasicPathFinder {
 public:
-    PathFinder() {}
+    BasicPathFinder() : _pairwise(false) {}
+
+    /// always score every pair of spans
+    void pairwise(bool pairwise) { _pairwise = pairwise; }
 
     template <class SPAN, class FEATURE>
     void find_path(lattice_t<SPAN>& lat,
+            const Lattice& lattice,
             FEATURE& feature,
             lattice_t<SPAN>& out
             ) {
-        const string& raw = *lat.raw;
         const vector<size_t>& off = *lat.off;
-        vector<SPAN>& lattice = lat.spans;
         out.spans.clear();
         vector<SPAN>& output = out.spans;
-        //cout<<">>>>>"<<lattice.size()<<"<<\n";
 
         feature.prepare(lat.raw, lat.off, lattice);
+        if (lattice.size() == 0) return;
 
-        /// Step 1 prepare path
-        while (begins.size() < off.size()) { begins.push_back(vector<size_t>()); }
-        while (ends.size() < off.size()) { ends.push_back(vector<size_t>()); }
-        for (size_t i = 0; i < off.size(); i++) {
-            begins[i].clear(); ends[i].clear();
+        /// Step 1 score all spans, prepare path
+        unigrams_.assign(lattice.size(), 0);
+        feature.unigrams(unigrams_.data());
+        scores_.assign(lattice.size(), 0);
+        pointers_.assign(lattice.size(), 0);
+        const uint32_t* by_end = lattice.by_end();
+
+        /// Step 2 search
+        if (!_pairwise && feature.factorized()) {
+            _search_by_class(lattice, feature);
+        } else {
+            _search_pairs(lattice, feature);
         }
 
-        scores_.clear();
-        pointers_.clear();
-        scores_.insert(scores_.end(), lattice.size(), 0);
-        pointers_.insert(pointers_.end(), lattice.size(), 0);
+        /// Step 3 find best
+        SCORE max_score = 0;
+        size_t max_pointer = 0;
+        bool has_max = false;
+        size_t last = off.size() - 1;
+        for (size_t j = lattice.end_at(last); j < lattice.end_at(last + 1); j ++) {
+            SCORE score = 0;
+            size_t p = by_end[j];
+            score = scores_[p];
+            if (!has_max || max_score < score) {
+                has_max = true;
+                max_score = score;
+                max_pointer = p;
+            }
+        }
 
-        for (size_t i = 0; i < lattice.size(); i++) {
-            ends[lattice[i].end].push_back(i);
-            begins[lattice[i].begin].push_back(i);
+        output.clear();
+        while (true) {
+            output.push_back(lattice.span<SPAN>(max_pointer));
+            if (lattice.begin(max_pointer) == 0) break;
+            max_pointer = pointers_[max_pointer];
         }
+        reverse(output.begin(), output.end());
+    }
 
-        /// Step 2 search
-        for (size_t i = 0; i < off.size() - 1; i++) {
-            for (size_t k = 0; k < begins[i].size(); k++) {
+
+private:
+    enum : size_t { NONE = ~(size_t)0 };
+
+    template <class FEATURE>
+    void _search_pairs(const Lattice& lattice, FEATURE& feature) {
+        const uint32_t* by_end = lattice.by_end();
+        for (size_t i = 0; i < lattice.chars(); i++) {
+            for (size_t k = lattice.begin_at(i); k < lattice.begin_at(i + 1); k++) {
 #ifdef Debug
                 printf("_________________\n");
-                printf("unigram %lu\n", begins[i][k]);
+                printf("unigram %lu\n", k);
 #endif
-                double& max_score = scores_[begins[i][k]];
-                size_t& max_pointer = pointers_[begins[i][k]];
+                SCORE& max_score = scores_[k];
+                size_t& max_pointer = pointers_[k];
                 bool has_max = false;
-                for (size_t j = 0; j < ends[i].size(); j ++) {
-                    double score = 0;
-                    size_t p = ends[i][j];
+                for (size_t j = lattice.end_at(i); j < lattice.end_at(i + 1); j ++) {
+                    SCORE score = 0;
+                    size_t p = by_end[j];
                     score = scores_[p];
                     /// bigram features
-                    double bi_score = feature.bigram(ends[i][j], begins[i][k]);
+                    double bi_score = feature.bigram(p, k);
                     score += bi_score;
 #ifdef Debug
                     printf("bi score %.5g\n", bi_score);
                     printf("pre-unigram %lu 's score %.5g, after bigram %.5g\n", 
-                            ends[i][j], 
-                            scores_[p],
-                            score);
+                            p, scores_[p], score);
 #endif
                     if (!has_max || max_score < score) {
                         has_max = true;
@@ -168,48 +304,88 @@ public:
                     }
                 }
                 /// unigram features
-                double uni_score = feature.unigram(begins[i][k]);
+                SCORE uni_score = unigrams_[k];
                 max_score += uni_score;
 #ifdef Debug
-                printf("unigram %lu 's uni score : %.5g\n", begins[i][k], uni_score);
-                printf("unigram %lu 's final score : %.5g\n", begins[i][k], max_score);
+                printf("unigram %lu 's uni score : %.5g\n", k, uni_score);
+                printf("unigram %lu 's final score : %.5g\n", k, max_score);
                 printf("````````````````````\n");
 #endif
             }
         }
+    }
 
-        /// Step 3 find best
-        double max_score = 0;
-        size_t max_pointer = 0;
-        bool has_max = false;
-        for (size_t j = 0; j < ends[off.size() - 1].size(); j ++) {
-            double score = 0;
-            size_t p = ends[off.size() - 1][j];
-            score = scores_[p];
-            if (!has_max || max_score < score) {
-                has_max = true;
-                max_score = score;
-                max_pointer = p;
+    template <class FEATURE>
+    void _search_by_class(const Lattice& lattice, FEATURE& feature) {
+        const uint32_t* by_end = lattice.by_end();
+        size_t classes = feature.bigram_classes();
+        in_score_.assign(classes, 0);
+        in_pos_.assign(classes, NONE);
+        out_score_.assign(classes, 0);
+        out_pos_.assign(classes, NONE);
+        out_done_.assign(classes, 0);
+        for (size_t i = 0; i < lattice.chars(); i++) {
+            /// the first best span ending here of each class
+            in_classes_.clear();
+            for (size_t j = lattice.end_at(i); j < lattice.end_at(i + 1); j++) {
+                size_t p = by_end[j];
+                size_t c = feature.bigram_class(p);
+                if (in_pos_[c] == NONE) {
+                    in_classes_.push_back(c);
+                } else if (!(in_score_[c] < scores_[p])) {
+                    continue;
+                }
+                in_pos_[c] = j;
+                in_score_[c] = scores_[p];
             }
+            /// the classes of the spans beginning here
+            out_classes_.clear();
+            for (size_t k = lattice.begin_at(i); k < lattice.begin_at(i + 1); k++) {
+                size_t b = feature.bigram_class(k);
+                if (out_done_[b]) continue;
+                out_done_[b] = 1;
+                out_classes_.push_back(b);
+                out_score_[b] = 0;
+                out_pos_[b] = NONE;
+            }
+            /// class pairs, a row of the transitions at a time
+            for (auto c : in_classes_) {
+                SCORE in_score = in_score_[c];
+                size_t in_pos = in_pos_[c];
+                for (auto b : out_classes_) {
+                    SCORE score = in_score + feature.class_bigram(c, b);
+                    if (out_pos_[b] == NONE || out_score_[b] < score
+                            || (out_score_[b] == score && in_pos < out_pos_[b])) {
+                        out_score_[b] = score;
+                        out_pos_[b] = in_pos;
+                    }
+                }
+            }
+            for (size_t k = lattice.begin_at(i); k < lattice.begin_at(i + 1); k++) {
+                size_t b = feature.bigram_class(k);
+                scores_[k] = out_score_[b] + unigrams_[k];
+                pointers_[k] = (out_pos_[b] == NONE) ? 0 : by_end[out_pos_[b]];
+            }
+            for (auto c : in_classes_) in_pos_[c] = NONE;
+            for (auto b : out_classes_) out_done_[b] = 0;
         }
-
-        output.clear();
-        while (true) {
-            output.push_back(SPAN(lattice[max_pointer]));
-            if (lattice[max_pointer].begin == 0) break;
-            max_pointer = pointers_[max_pointer];
-        }
-        reverse(output.begin(), output.end());
     }
 
-
-private:
-    vector<vector<size_t>> begins;
-    vector<vector<size_t>> ends;
-
-    vector<double> scores_;
+    bool _pairwise;
+    vector<SCORE> unigrams_;
+    vector<SCORE> scores_;
     vector<size_t> pointers_;
+    /// per bigram class, for `_search_by_class`
+    vector<SCORE> in_score_;
+    vector<size_t> in_pos_;
+    vector<size_t> in_classes_;
+    vector<SCORE> out_score_;
+    vector<size_t> out_pos_;
+    vector<char> out_done_;
+    vector<size_t> out_classes_;
 
 };
 
+typedef BasicPathFinder<double> PathFinder;
+
 } // namespace
@@ -0,0 +1,184 @@
+#pragma once
+#include "common/common.h"
+#include "common/dictionary.h"
+#include "lattice/lattice.h"
+#include "lattice/tag_dict.h"
+#include "lattice/char_pruner.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace tenseg {
+using namespace std;
+
+/**
+ * 词图产生: the spans of a sentence, up to 10 chars long and with every
+ * tag, fewer with a tag dictionary, a span limit or a pruner
+ * */
+class LatticeGenerator {
+    enum char_type_t : uint8_t { ///< 字符类型
+        NORMAL,     ///< 普通字符
+        PUNC,       ///< 标点符号
+        DIGIT,      ///< 数字
+        LETTER      ///< 拉丁字母
+    };
+    enum : size_t { MAX_LEN = 10 };
+    vector<char_type_t> _table; ///< 字符类型表, by code point
+    vector<char_type_t> _types;
+    vector<size_t> _run_end;    ///< the end of the run of digits or letters at each char
+    vector<size_t> _max_end;    ///< the furthest end of the spans from each char
+    vector<uint8_t> _reach;     ///< some span ends before the char
+    shared_ptr<Indexer<string>> _tag_indexer;
+    shared_ptr<TagDictionary> _tag_dict; ///< all tags for every span if null
+    vector<shared_ptr<Dictionary<string>>> _dicts;
+    shared_ptr<CharPruner> _pruner; ///< no boundaries are pruned if null
+    DictMatches _matches;       ///< of the tag dictionary in the sentence
+    bool _limit;
+    size_t _unknown_len;
+
+    void _calc_type(const string& raw,
+            const vector<size_t>& off) {
+        size_t n = off.size() - 1;
+        _types.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            size_t code = unicode(raw.data() + off[i], off[i + 1] - off[i]);
+            _types[i] = (code < _table.size()) ? _table[code] : NORMAL;
+        }
+        _run_end.resize(n);
+        for (size_t i = n; i-- > 0; ) {
+            bool run = (_types[i] == DIGIT || _types[i] == LETTER);
+            _run_end[i] = (run && i + 1 < n && _types[i + 1] == _types[i])
+                ? _run_end[i + 1] : i + 1;
+        }
+    }
+    void _add(Lattice& lattice, size_t i, size_t j) {
+        _reach[j] = 1;
+        if (_tag_dict) {
+            const uint32_t* begin;
+            const uint32_t* end;
+            _tag_dict->tags(_matches, i, j, begin, end);
+            for (auto t = begin; t != end; t++) lattice.add(i, j, *t);
+        } else {
+            for (size_t k = 0; k < _tag_indexer->size(); k++) {
+                lattice.add(i, j, k);
+            }
+        }
+    }
+    /// the end of the longest word of `dict` from char `i`
+    template<class DICT>
+    size_t _longest(const DICT& dict, const string& raw, const vector<size_t>& off,
+            size_t i) const {
+        size_t longest = i;
+        if (!dict.size()) return longest;
+        size_t node = dict.root();
+        for (size_t j = i + 1; j < off.size(); j++) {
+            if (!dict.walk(node, raw.data() + off[j - 1], off[j] - off[j - 1])) break;
+            if (dict.entry(node) != DICT::npos) longest = j;
+        }
+        return longest;
+    }
+    /**
+     * spans from char `i` are as long as the longest known word from there,
+     * or `_unknown_len` chars, and never end inside a run
+     * */
+    void _calc_max_end(const string& raw, const vector<size_t>& off) {
+        size_t n = off.size() - 1;
+        _max_end.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            size_t end = std::max(i + _unknown_len, _run_end[i]);
+            for (auto& dict : _dicts) end = std::max(end, _longest(*dict, raw, off, i));
+            if (_tag_dict) end = std::max(end, _longest(_tag_dict->words(), raw, off, i));
+            if (end > n) end = n;
+            _max_end[i] = _run_end[end - 1];
+        }
+    }
+public:
+    LatticeGenerator() : _table(0x10000, NORMAL), _limit(false), _unknown_len(4) {
+        for (auto code : {0x3002, 0xff0c, 0xff1f, 0xff01, 0xff1a, 0x201c, 0x3a, 0x201d}) {
+            _table[code] = PUNC;
+        }
+        for (size_t c = '0'; c <= '9'; c++) _table[c] = DIGIT;
+        for (size_t c = 0xff10; c <= 0xff19; c++) _table[c] = DIGIT;
+        for (size_t c = 'a'; c <= 'z'; c++) _table[c] = _table[c - 'a' + 'A'] = LETTER;
+        for (size_t c = 0xff41; c <= 0xff5a; c++) _table[c] = _table[c - 0xff41 + 0xff21] = LETTER;
+    }
+
+    void set_tag_indexer(shared_ptr<Indexer<string>> ti) {
+        _tag_indexer = ti;
+    }
+    void set_tag_dict(shared_ptr<TagDictionary> tag_dict) {
+        _tag_dict = tag_dict;
+    }
+    /**
+     * limit the spans from each char by the known words from there, those
+     * of `add_words` and of the tag dictionary, and keep the runs of digits
+     * and of letters whole. otherwise spans are up to 10 chars long
+     * */
+    void limit(bool limit, size_t unknown_len) {
+        _limit = limit;
+        _unknown_len = unknown_len;
+    }
+    void add_words(shared_ptr<Dictionary<string>> dict) {
+        if (dict) _dicts.push_back(dict);
+    }
+    /// spans only begin and end at the boundaries the pruner keeps
+    void set_pruner(shared_ptr<CharPruner> pruner) {
+        _pruner = pruner;
+    }
+    /// a generator for another thread, with a pruner of its own
+    LatticeGenerator clone() const {
+        LatticeGenerator lg(*this);
+        if (_pruner) lg._pruner = make_shared<CharPruner>(*_pruner);
+        return lg;
+    }
+
+    void gen(const lattice_t<labelled_span_t>& lat, Lattice& lattice) {
+        const string& raw = *lat.raw;
+        const vector<size_t>& off = *lat.off;
+
+        if (off.size() == 0) {
+            lattice.reset(0, _tag_indexer);
+            lattice.seal();
+            return;
+        }
+
+        _calc_type(raw, off);
+        
+        size_t n = off.size() - 1;
+        if (_limit) _calc_max_end(raw, off);
+        if (_pruner) _pruner->prune(raw, off);
+
+        lattice.reset(n, _tag_indexer);
+        if (_tag_dict) _tag_dict->find(raw, off, _limit ? n : MAX_LEN, _matches);
+        /// spans only begin where others end, so that none is a dead end
+        _reach.assign(n + 1, 0);
+        _reach[0] = 1;
+        // generate all spans
+        for (size_t i = 0; i < n; i++) {
+            if (!_reach[i]) continue;
+            size_t max_end = _limit ? _max_end[i] : i + MAX_LEN;
+            bool added = false;
+            for (size_t j = i + 1; j < n + 1; j++) {
+                if (j > max_end) break;
+
+                /// not into a run
+                if (_limit && j < n && _run_end[j - 1] == _run_end[j]) continue;
+                if (_pruner && !_pruner->can(j)) continue;
+                _add(lattice, i, j);
+                added = true;
+
+                if (_types[i] == char_type_t::PUNC) break;
+                if (j < n && _types[j] == char_type_t::PUNC) break;
+                if (_pruner && _pruner->must(j)) break;
+            }
+            /// everything from here was pruned, the char alone keeps a path
+            if (!added) _add(lattice, i, i + 1);
+        }
+        lattice.seal();
+    }
+};
+
+}
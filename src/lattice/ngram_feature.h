@@ -10,27 +10,56 @@
 namespace tenseg {
 
 template<class SPAN>
-class UnigramFeature : public ILatticeFeature<SPAN> {
+class UnigramFeature final : public ILatticeFeature<SPAN> {
 public:
+    UnigramFeature() {}
     UnigramFeature(const string& filename) {
         auto dictionary = make_shared<Dictionary<double>>();
         dictionary->load(filename.c_str());
-        _dict = dictionary;
-        _weight_prefix = "d:" + filename + ":";
-        _bigram_weight_prefix = "d:" + filename + ":b:";
+        _init(filename, dictionary);
+    }
+    UnigramFeature(const string& filename, const Bundle& bundle) {
+        const char* data;
+        size_t size;
+        auto dictionary = make_shared<Dictionary<double>>();
+        if (!bundle.get("uni_freq:" + filename, data, size)
+                || !dictionary->map(data, size, bundle.file())) {
+            fprintf(stderr, "no frequencies '%s' in binary model\n", filename.c_str());
+        }
+        _init(filename, dictionary);
+    }
+    virtual string kind() const { return "uni_freq"; }
+    virtual string name() const { return _filename; }
+    virtual shared_ptr<ILatticeFeature<SPAN>> clone() const {
+        return make_shared<UnigramFeature<SPAN>>(*this);
+    }
+    virtual void save(BundleWriter& bundle) const {
+        _dict->serialize(bundle.add("uni_freq:" + _filename));
     }
-    virtual void prepare(shared_ptr<string>& raw, shared_ptr<vector<size_t>>& off, vector<SPAN>& lattice) {
+    virtual void prepare(shared_ptr<string>& raw, shared_ptr<vector<size_t>>& off, const Lattice& lattice) {
         _lattice = &lattice;
         _raw = raw;
         _off = off;
+        if (!_dict) return;
+        _matches.find(*_dict, *_raw, *_off);
+        _scores.resize(_matches.size());
+        for (size_t k = 0; k < _matches.size(); k++) {
+            _scores[k] = log10(_dict->value(_matches.match(k).entry) + 1);
+        }
     }
     virtual double unigram(size_t ind) {
         if (!_dict) return 0;
-        double score = _uni_freq((*_lattice)[ind]);
+        double score = _uni_freq(_lattice->begin(ind), _lattice->end(ind));
         return score - 8;
     }
+    virtual void unigrams(size_t n, double* scores) {
+        if (!_dict) return;
+        for (size_t k = 0; k < n; k++) {
+            scores[k] += _uni_freq(_lattice->begin(k), _lattice->end(k)) - 8;
+        }
+    }
 
-    virtual void calc_gradient(vector<SPAN>& gold, vector<SPAN>& output, Weight& gradient) {
+    virtual void calc_gradient(vector<SPAN>& gold, vector<SPAN>& output, SparseGradient& gradient) {
         //for (size_t i = 0; i < gold.size(); i++) {
         //    _unigram_gradient(gold[i], gradient, 1);
         //}
@@ -40,18 +69,19 @@ public:
     }
 
 private:
+    void _init(const string& filename, shared_ptr<Dictionary<double>> dictionary) {
+        _filename = filename;
+        _dict = dictionary;
+        _weight_prefix = "d:" + filename + ":";
+        _bigram_weight_prefix = "d:" + filename + ":b:";
+    }
     /**
      * brief : calc unigram key
      * */
-    double _uni_freq(const SPAN& span) {
-        string unigram_string = _raw->substr((*_off)[span.begin], (*_off)[span.end] - (*_off)[span.begin]);
-        double freq = 0;
-        if (!_dict->get(unigram_string, freq)) {
-            freq = 0;
-        }  else {
-        }
-        freq = log10(freq + 1);
-        return freq;
+    double _uni_freq(size_t begin, size_t end) {
+        size_t k = _matches.index(begin, end);
+        /// log10(0 + 1) if missing
+        return (k == DictMatches::npos) ? 0 : _scores[k];
     }
 
     //double _unigram_gradient(const SPAN& span, Weight& gradient, double delta) {
@@ -61,11 +91,14 @@ private:
     //    gradient.add_from(key, &delta, 1);
     //}
 private:
+    string _filename;
     string _weight_prefix;
     string _bigram_weight_prefix;
     shared_ptr<Dictionary<double>> _dict;
+    DictMatches _matches;
+    vector<double> _scores; ///< log10(freq + 1) of each match
 
-    vector<SPAN>* _lattice;
+    const Lattice* _lattice;
     shared_ptr<string> _raw;
     shared_ptr<vector<size_t>> _off;
 };
@@ -1,9 +1,60 @@
 #pragma once
 #include "lattice/lattice.h"
 #include "lattice/feature.h"
+#include "lattice/ngram_feature.h"
+#include "common/optimizer.h"
+#include "common/mixing.h"
+#include "common/socket.h"
+#include "common/workers.h"
+
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace tenseg {
 using namespace std;
+
+template<typename SPAN>
+class SegTag;
+
+/**
+ * the decoder of one thread: a lattice generator, a path finder and
+ * features of its own, over the weights and the tags of a SegTag, which
+ * must not change while it decodes
+ * */
+template<typename SPAN, class LG>
+class SegTagDecoder {
+public:
+    SegTagDecoder(const SegTag<SPAN>& segtag, const LG& lg)
+        : lg_(lg.clone()), feature_(segtag.feature().clone()) {}
+
+    void predict(lattice_t<SPAN>& x, lattice_t<SPAN>& y) {
+        lg_.gen(x, lattice_);
+        decoder_.find_path(x, lattice_, feature_, y);
+        y.raw = x.raw;
+        y.off = x.off;
+    }
+    /// the lattice of `x` and the features on it, as `predict` but without the search
+    void prepare(lattice_t<SPAN>& x) {
+        lg_.gen(x, lattice_);
+        feature_.prepare(x.raw, x.off, lattice_);
+    }
+    LabelledFeature<SPAN>& feature() {
+        return feature_;
+    }
+
+private:
+    LG lg_;
+    PathFinder decoder_;
+    Lattice lattice_;
+    LabelledFeature<SPAN> feature_;
+};
+
 template<typename SPAN>
 class SegTag {
 public:
@@ -19,9 +70,185 @@ public:
             vector<lattice_t<SPAN>>& test_Xs,
             vector<lattice_t<SPAN>>& test_Ys,
             LG& lg,
-            size_t iterations
+            size_t iterations,
+            learner_type_t learner = PERCEPTRON,
+            size_t threads = 1,
+            size_t shards = 0
             ) {
+        if (shards && learner == PERCEPTRON) {
+            if (_fit_mixing(train_Xs, train_Ys, test_Xs, test_Ys, lg, iterations, shards,
+                        threads)) {
+                return;
+            }
+            fprintf(stderr, "training in this process\n");
+        } else if (shards) {
+            fprintf(stderr, "only the perceptron is trained on shards, training with one\n");
+        }
+        if (threads > 1 && learner == PERCEPTRON) {
+            _fit_hogwild(train_Xs, train_Ys, test_Xs, test_Ys, lg, iterations, threads);
+            return;
+        }
+        if (threads > 1) {
+            fprintf(stderr, "only the perceptron is trained with threads, "
+                    "training with one and testing with %lu\n", threads);
+        }
+        if (learner == ADAGRAD) {
+            _fit<AdaGrad<Weight>>(train_Xs, train_Ys, test_Xs, test_Ys, lg, iterations,
+                    threads);
+        } else if (learner == AVG_ADAGRAD) {
+            _fit<AvgAdaGrad<Weight>>(train_Xs, train_Ys, test_Xs, test_Ys, lg, iterations,
+                    threads);
+        } else {
+            _fit<LazyLearner<Weight>>(train_Xs, train_Ys, test_Xs, test_Ys, lg, iterations,
+                    threads);
+        }
+    }
 
+    template<class LG>
+    void predict(vector<lattice_t<SPAN>>& test_Xs,
+            vector<lattice_t<SPAN>>& test_Ys,
+            LG& lg
+            ) {
+        test_Ys.clear();
+        for (size_t i = 0; i < test_Xs.size(); i++) {
+            test_Ys.emplace(test_Ys.end());
+            lg.gen(test_Xs[i], lattice_);
+            decoder_.find_path(test_Xs[i], lattice_, feature_, test_Ys.back());
+            test_Ys.back().raw = test_Xs[i].raw;
+            test_Ys.back().off = test_Xs[i].off;
+        }
+    }
+    /// with `threads` threads, each decoding with a `SegTagDecoder` of its own
+    template<class LG>
+    Eval<SPAN> test(vector<lattice_t<SPAN>>& test_Xs,
+            vector<lattice_t<SPAN>>& test_Ys,
+            LG& lg,
+            size_t threads = 1
+            ) {
+        Eval<SPAN> eval;
+        Workers workers(threads);
+        eval.reset();
+        _eval(test_Xs, test_Ys, lg, workers, eval);
+        eval.report();
+        return eval;
+    }
+    LabelledFeature<SPAN>& feature() {
+        return feature_;
+    }
+    const LabelledFeature<SPAN>& feature() const {
+        return feature_;
+    }
+    const shared_ptr<Indexer<string>>& tag_indexer() const {
+        return tag_indexer_;
+    }
+    void save(const string& txt_model) {
+        fprintf(stderr, "saving weights and tags\n");
+        ave.dump((txt_model + ".weights").c_str());
+        tag_indexer_->dump((txt_model + ".tags").c_str());
+    }
+    const Weight& weights() const {
+        return ave;
+    }
+    /// compact, read-only weights for prediction
+    bool quantize(value_type_t type) {
+        if (!ave.quantize(type)) return false;
+        feature_.set_weight(ave);
+        return true;
+    }
+    bool load(const string& txt_model) {
+        if (!ave.load(txt_model + ".weights")) return false;
+        tag_indexer_->load(txt_model + ".tags");
+        feature_.set_weight(ave);
+        return true;
+    }
+    /**
+     * one file with the weights, the tags and the data of every feature
+     * */
+    void save_binary(const string& bin_model) {
+        BundleWriter bundle;
+        save_binary(bundle);
+        bundle.write(bin_model);
+    }
+    /// the sections of the model, others can be added before writing
+    void save_binary(BundleWriter& bundle) {
+        fprintf(stderr, "saving binary model\n");
+        ave.serialize(bundle.add("weights"));
+        tag_indexer_->serialize(bundle.add("tags"));
+        string features;
+        binary_append(features, (uint64_t)feature_.features().size());
+        for (auto& f : feature_.features()) {
+            binary_append(features, f->kind());
+            binary_append(features, f->name());
+            f->save(bundle);
+        }
+        bundle.add("features") = features;
+    }
+    /**
+     * the weights are used from the mapped pages of `bundle`, the features
+     * are expected to be set up already
+     * */
+    bool load_binary(const Bundle& bundle) {
+        const char* data;
+        size_t size;
+        if (!bundle.get("weights", data, size)
+                || !ave.map(data, size, bundle.file())) {
+            return false;
+        }
+        if (!bundle.get("tags", data, size)
+                || !tag_indexer_->deserialize(data, size)) {
+            return false;
+        }
+        feature_.set_weight(ave);
+        return true;
+    }
+
+private:
+    /**
+     * the counts of the sentences added to `eval`. the weights are only
+     * read, so more threads decode with decoders of their own, and their
+     * counts are merged
+     * */
+    template<class LG>
+    void _eval(vector<lattice_t<SPAN>>& Xs,
+            vector<lattice_t<SPAN>>& Ys,
+            LG& lg,
+            Workers& workers,
+            Eval<SPAN>& eval
+            ) {
+        size_t threads = workers.size();
+        if (threads <= 1) {
+            lattice_t<SPAN> out;
+            for (size_t i = 0; i < Xs.size(); i++) {
+                lg.gen(Xs[i], lattice_);
+                decoder_.find_path(Xs[i], lattice_, feature_, out);
+                eval.eval(Ys[i].spans, out.spans);
+            }
+            return;
+        }
+        vector<shared_ptr<SegTagDecoder<SPAN, LG>>> decoders;
+        vector<Eval<SPAN>> evals(threads);
+        for (size_t t = 0; t < threads; t++) {
+            decoders.push_back(make_shared<SegTagDecoder<SPAN, LG>>(*this, lg));
+        }
+        vector<lattice_t<SPAN>> outs(threads);
+        workers.run(0, Xs.size(), [&](size_t t, size_t i) {
+            decoders[t]->predict(Xs[i], outs[t]);
+            evals[t].eval(Ys[i].spans, outs[t].spans);
+        });
+        for (auto& other : evals) eval.merge(other);
+    }
+
+    /// one thread trains, `threads` threads test
+    template<class LEARNER, class LG>
+    void _fit(
+            vector<lattice_t<SPAN>>& train_Xs,
+            vector<lattice_t<SPAN>>& train_Ys,
+            vector<lattice_t<SPAN>>& test_Xs,
+            vector<lattice_t<SPAN>>& test_Ys,
+            LG& lg,
+            size_t iterations,
+            size_t threads
+            ) {
         for (auto& lattice : train_Xs) {
             for (auto& span : lattice.spans) {
                 tag_indexer_->get(span.label());
@@ -29,101 +256,334 @@ public:
         }
 
         Eval<SPAN> eval;
-        Learner<Weight> learner;
-        //AvgAdaGrad<Weight> learner;
+        LEARNER learner;
         lattice_t<SPAN> out;
+        SparseGradient gradient;
+        Workers workers(threads);
 
         for (size_t it = 0; it < iterations; it ++) {
+            learner.resume();
             feature_.set_weight(learner.weight());
             eval.reset();
+            auto train_start = std::chrono::steady_clock::now();
             for (size_t i = 0; i < train_Xs.size(); i++) {
                 if (i % 100 == 0) {
                     fprintf(stderr, "[%lu/%lu]\r", i, train_Xs.size());
                 }
-                lg.gen(train_Xs[i]);
-                decoder_.find_path(train_Xs[i], feature_, out);
-                train_Xs[i].spans.clear();
-                train_Xs[i].spans.shrink_to_fit();
+                lg.gen(train_Xs[i], lattice_);
+                decoder_.find_path(train_Xs[i], lattice_, feature_, out);
                 /// update
-                Weight gradient;
+                gradient.clear();
                 feature_.calc_gradient(train_Ys[i].spans, out.spans, gradient);
+                gradient.seal();
                 learner.update(gradient);
 
                 eval.eval(train_Ys[i].spans, out.spans);
             }
+            double seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - train_start).count();
             eval.report();
 
+            std::clock_t start = std::clock();
+            learner.average();
+            printf("epoch %lu: %lu weights %.3gMB, average %.3g(sec.), %.0f sentences/s\n",
+                    it + 1, learner.weight().size(), learner.memory_bytes() / 1e6,
+                    (double)(std::clock() - start) / CLOCKS_PER_SEC,
+                    train_Xs.size() / seconds);
+
             if (!test_Xs.size()) continue;
 
-            learner.average(ave);
-            feature_.set_weight(ave);
             eval.reset();
-            for (size_t i = 0; i < test_Xs.size(); i++) {
-                lg.gen(test_Xs[i]);
-                decoder_.find_path(test_Xs[i], feature_, out);
-                eval.eval(test_Ys[i].spans, out.spans);
-                test_Xs[i].spans.clear();
-                test_Xs[i].spans.shrink_to_fit();
-            }
+            _eval(test_Xs, test_Ys, lg, workers, eval);
             eval.report();
         }
 
-        learner.average(ave);
+        learner.take_average(ave);
         feature_.set_weight(ave);
     }
 
+    /**
+     * Hogwild: `threads` threads decode the sentences against the same
+     * weights and update them as they go, adding the rows new to the
+     * weights themselves. they only stop when the room kept for new rows
+     * runs out, for the rows waiting to be added and for more room
+     * */
     template<class LG>
-    void predict(vector<lattice_t<SPAN>>& test_Xs,
+    void _fit_hogwild(
+            vector<lattice_t<SPAN>>& train_Xs,
+            vector<lattice_t<SPAN>>& train_Ys,
+            vector<lattice_t<SPAN>>& test_Xs,
             vector<lattice_t<SPAN>>& test_Ys,
-            LG& lg
+            LG& lg,
+            size_t iterations,
+            size_t threads
             ) {
-        test_Ys.clear();
-        for (size_t i = 0; i < test_Xs.size(); i++) {
-            test_Ys.emplace(test_Ys.end());
-            lg.gen(test_Xs[i]);
-            decoder_.find_path(test_Xs[i], feature_, test_Ys.back());
-            test_Ys.back().raw = test_Xs[i].raw;
-            test_Ys.back().off = test_Xs[i].off;
+        enum : size_t { CHUNK = 256 }; ///< sentences per thread between progress reports
+        for (auto& lattice : train_Ys) {
+            for (auto& span : lattice.spans) {
+                tag_indexer_->get(span.label());
+            }
+        }
+
+        typedef HogwildLearner<Weight> learner_t;
+        struct worker_t {
+            SegTagDecoder<SPAN, LG> decoder;
+            lattice_t<SPAN> out;
+            SparseGradient gradient;
+            typename learner_t::Buffer buffer;
+            Eval<SPAN> eval;
+            worker_t(const SegTag& segtag, const LG& lg) : decoder(segtag, lg) {}
+        };
+        learner_t learner;
+        feature_.set_weight(learner.weight());
+        Workers pool(threads);
+        vector<shared_ptr<worker_t>> workers;
+        for (size_t t = 0; t < pool.size(); t++) {
+            workers.push_back(make_shared<worker_t>(*this, lg));
+        }
+        size_t stops = 0;
+
+        Eval<SPAN> eval;
+        for (size_t it = 0; it < iterations; it ++) {
+            learner.resume();
+            for (auto& w : workers) w->eval.reset();
+            eval.reset();
+            learner.make_room();
+            auto start = std::chrono::steady_clock::now();
+            size_t begin = 0;
+            while (begin < train_Xs.size()) {
+                fprintf(stderr, "[%lu/%lu]\r", begin, train_Xs.size());
+                size_t end = std::min(train_Xs.size(), begin + CHUNK * pool.size());
+                begin = pool.run(begin, end, [&](size_t t, size_t i) {
+                    worker_t& w = *workers[t];
+                    w.decoder.predict(train_Xs[i], w.out);
+                    w.gradient.clear();
+                    w.decoder.feature().calc_gradient(train_Ys[i].spans,
+                            w.out.spans, w.gradient);
+                    w.gradient.seal();
+                    if (learner.update(w.gradient, w.buffer)) pool.stop();
+                    w.eval.eval(train_Ys[i].spans, w.out.spans);
+                });
+                bool waiting = false;
+                for (auto& w : workers) waiting = waiting || w->buffer.size();
+                if (!waiting) continue;
+                stops++;
+                for (auto& w : workers) learner.sync(w->buffer);
+                learner.make_room();
+            }
+            double seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+            for (auto& w : workers) eval.merge(w->eval);
+            eval.report();
+
+            std::clock_t clock = std::clock();
+            learner.average();
+            printf("epoch %lu: %lu weights %.3gMB, average %.3g(sec.), %.0f sentences/s "
+                    "with %lu threads, %lu stops\n", it + 1,
+                    learner.weight().size(), learner.memory_bytes() / 1e6,
+                    (double)(std::clock() - clock) / CLOCKS_PER_SEC,
+                    train_Xs.size() / seconds, threads, stops);
+
+            if (!test_Xs.size()) continue;
+
+            eval.reset();
+            _eval(test_Xs, test_Ys, lg, pool, eval);
+            eval.report();
         }
+
+        learner.take_average(ave);
+        feature_.set_weight(ave);
     }
+
+    /**
+     * iterative parameter mixing: a worker process for each of the `shards`
+     * shards of the sentences trains an epoch from the mixed weights, and
+     * sends the values it updated over a socket. they are mixed as the
+     * updates of the shards, and the values that changed are sent back
+     * for the next epoch. `threads` threads test. false if the workers can
+     * not be started
+     * */
     template<class LG>
-    void test(vector<lattice_t<SPAN>>& test_Xs,
+    bool _fit_mixing(
+            vector<lattice_t<SPAN>>& train_Xs,
+            vector<lattice_t<SPAN>>& train_Ys,
+            vector<lattice_t<SPAN>>& test_Xs,
             vector<lattice_t<SPAN>>& test_Ys,
+            LG& lg,
+            size_t iterations,
+            size_t shards,
+            size_t threads
+            ) {
+        for (auto& lattice : train_Ys) {
+            for (auto& span : lattice.spans) {
+                tag_indexer_->get(span.label());
+            }
+        }
+
+        /// the workers are forked with the corpus and the tags as they are now
+        fflush(stdout);
+        fflush(stderr);
+        vector<int> fds;
+        vector<pid_t> pids;
+        for (size_t s = 0; s < shards; s++) {
+            int sv[2];
+            pid_t pid = -1;
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+                pid = fork();
+                if (pid < 0) {
+                    close(sv[0]);
+                    close(sv[1]);
+                }
+            }
+            if (pid < 0) {
+                fprintf(stderr, "can not start the worker of shard %lu\n", s);
+                _stop_workers(fds, pids);
+                return false;
+            }
+            if (pid == 0) {
+                close(sv[0]);
+                for (auto fd : fds) close(fd);
+                _mixing_worker(sv[1], s, shards, train_Xs, train_Ys, lg);
+                _exit(0);
+            }
+            close(sv[1]);
+            fds.push_back(sv[0]);
+            pids.push_back(pid);
+        }
+
+        /// the threads are started once the workers are forked
+        Workers workers(threads);
+        Mixer<Weight> mixer;
+        string mixed;
+        binary_append(mixed, (uint64_t)0);  ///< no rows to begin with
+        vector<string> replies(shards);
+        Eval<SPAN> eval;
+        Eval<SPAN> shard_eval;
+        for (size_t it = 0; it < iterations; it ++) {
+            eval.reset();
+            auto start = std::chrono::steady_clock::now();
+            size_t bytes = mixed.size() * shards;
+            for (auto fd : fds) send_message(fd, mixed);
+            vector<BinaryReader> readers;
+            for (size_t s = 0; s < shards; s++) {
+                if (!recv_message(fds[s], replies[s])) {
+                    fprintf(stderr, "the worker of shard %lu is gone\n", s);
+                    _stop_workers(fds, pids);
+                    return false;
+                }
+                bytes += replies[s].size();
+                readers.emplace_back(replies[s].data(), replies[s].size());
+                shard_eval.deserialize(readers.back());
+                eval.merge(shard_eval);
+            }
+            std::clock_t clock = std::clock();
+            if (!mixer.mix(readers, mixed)) {
+                fprintf(stderr, "broken epoch from the workers\n");
+                _stop_workers(fds, pids);
+                return false;
+            }
+            mixer.average(ave);
+            double seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+            eval.report();
+            printf("epoch %lu: %lu weights %.3gMB, mix %.3g(sec.) of %lu values %.3gMB, "
+                    "%.0f sentences/s with %lu shards\n", it + 1,
+                    mixer.weight().size(), mixer.memory_bytes() / 1e6,
+                    (double)(std::clock() - clock) / CLOCKS_PER_SEC,
+                    mixer.changed(), bytes / 1e6, train_Xs.size() / seconds, shards);
+
+            if (!test_Xs.size()) continue;
+
+            feature_.set_weight(ave);
+            eval.reset();
+            _eval(test_Xs, test_Ys, lg, workers, eval);
+            eval.report();
+        }
+        _stop_workers(fds, pids);
+
+        if (!iterations) ave.clear();
+        feature_.set_weight(ave);
+        return true;
+    }
+    /// the sentences s, s + shards, ... of a shard, an epoch for each message
+    template<class LG>
+    void _mixing_worker(int fd, size_t shard, size_t shards,
+            vector<lattice_t<SPAN>>& train_Xs,
+            vector<lattice_t<SPAN>>& train_Ys,
             LG& lg
             ) {
+        ShardLearner<Weight> learner;
+        feature_.set_weight(learner.weight());
         Eval<SPAN> eval;
-        eval.reset();
         lattice_t<SPAN> out;
-        for (size_t i = 0; i < test_Xs.size(); i++) {
-            lg.gen(test_Xs[i]);
-            decoder_.find_path(test_Xs[i], feature_, out);
-            eval.eval(test_Ys[i].spans, out.spans);
-            test_Xs[i].spans.clear();
-            test_Xs[i].spans.shrink_to_fit();
+        SparseGradient gradient;
+        string message;
+        while (recv_message(fd, message)) {
+            BinaryReader reader(message.data(), message.size());
+            if (!learner.apply(reader)) {
+                fprintf(stderr, "broken weights from the mixer\n");
+                return;
+            }
+            learner.begin_epoch();
+            eval.reset();
+            for (size_t i = shard; i < train_Xs.size(); i += shards) {
+                lg.gen(train_Xs[i], lattice_);
+                decoder_.find_path(train_Xs[i], lattice_, feature_, out);
+                gradient.clear();
+                feature_.calc_gradient(train_Ys[i].spans, out.spans, gradient);
+                gradient.seal();
+                learner.update(gradient);
+                eval.eval(train_Ys[i].spans, out.spans);
+            }
+            message.clear();
+            eval.serialize(message);
+            learner.serialize(message);
+            if (!send_message(fd, message)) return;
         }
-        eval.report();
-    }
-    LabelledFeature<SPAN>& feature() {
-        return feature_;
-    }
-    const shared_ptr<Indexer<string>>& tag_indexer() {
-        return tag_indexer_;
-    }
-    void save(const string& txt_model) {
-        fprintf(stderr, "saving weights and tags\n");
-        ave.dump((txt_model + ".weights").c_str());
-        tag_indexer_->dump((txt_model + ".tags").c_str());
     }
-    void load(const string& txt_model) {
-        ave.load(txt_model + ".weights");
-        tag_indexer_->load(txt_model + ".tags");
-        feature_.set_weight(ave);
+    /// the workers end at the end of their sockets
+    void _stop_workers(vector<int>& fds, vector<pid_t>& pids) {
+        for (auto fd : fds) close(fd);
+        for (auto pid : pids) waitpid(pid, nullptr, 0);
+        fds.clear();
+        pids.clear();
     }
 
-private:
     shared_ptr<Indexer<string>> tag_indexer_;
     PathFinder decoder_;
+    Lattice lattice_;
     LabelledFeature<SPAN> feature_;
     Weight ave;
 };
+
+/**
+ * re-create the features recorded in a binary model
+ * */
+template<class SPAN>
+bool load_features(const Bundle& bundle, SegTag<SPAN>& segtag) {
+    const char* data;
+    size_t size;
+    if (!bundle.get("features", data, size)) return false;
+    BinaryReader reader(data, size);
+    uint64_t n = 0;
+    reader.read(n);
+    for (uint64_t i = 0; i < n; i++) {
+        string kind;
+        string name;
+        if (!reader.read(kind) || !reader.read(name)) return false;
+        shared_ptr<ILatticeFeature<SPAN>> f;
+        if (kind == "dict") {
+            f = make_shared<DictFeature<SPAN>>(name, bundle);
+        } else if (kind == "uni_freq") {
+            f = make_shared<UnigramFeature<SPAN>>(name, bundle);
+        } else if (kind == "phrase") {
+            f = make_shared<PhraseFeature<SPAN>>(name, bundle);
+        } else {
+            fprintf(stderr, "unknown feature '%s' in binary model\n", kind.c_str());
+            return false;
+        }
+        segtag.feature().features().push_back(f);
+    }
+    return true;
+}
 }
@@ -0,0 +1,227 @@
+#pragma once
+#include "common/common.h"
+#include "common/dictionary.h"
+#include "lattice/lattice.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace tenseg {
+using namespace std;
+
+/**
+ * the tags a span of a sentence may get, to prune the lattice
+ *
+ * words seen at least `min_count` times only get the tags they were seen
+ * with. rarer words also get the open class, the tags of the words seen
+ * once, and so does every span which is not a known word. the words of
+ * external dictionaries add their tags to those seen in the corpus, but
+ * they are not counted.
+ *
+ * a dictionary is kept as lines of tags: the open class first, then
+ * `word tag ...` for each known word.
+ * */
+class TagDictionary {
+private:
+    struct word_t {
+        size_t count;
+        set<uint32_t> tags;
+    };
+    shared_ptr<Indexer<string>> _tag_indexer;
+    size_t _min_count;
+    map<string, word_t> _words;     ///< as they are counted
+    vector<size_t> _once;           ///< words seen once, by tag
+
+    Dictionary<uint32_t> _dict;     ///< the known words, to their number
+    vector<string> _words_list;     ///< the known words, in order
+    vector<uint32_t> _offs;         ///< the tags of word k are [_offs[k], _offs[k + 1])
+    vector<uint32_t> _tags;
+    vector<uint32_t> _open;
+
+    void _compile(const map<string, vector<uint32_t>>& words) {
+        map<string, uint32_t> index;
+        _words_list.clear();
+        _offs.assign(1, 0);
+        _tags.clear();
+        for (auto& word : words) {
+            index[word.first] = _words_list.size();
+            _words_list.push_back(word.first);
+            _tags.insert(_tags.end(), word.second.begin(), word.second.end());
+            _offs.push_back(_tags.size());
+        }
+        _dict.build(index);
+    }
+public:
+    TagDictionary() : _min_count(3) {}
+
+    void set_tag_indexer(shared_ptr<Indexer<string>> tag_indexer) {
+        _tag_indexer = tag_indexer;
+    }
+    void set_min_count(size_t min_count) {
+        _min_count = min_count;
+    }
+    size_t size() const {
+        return _dict.size();
+    }
+    /// the known words
+    const Dictionary<uint32_t>& words() const {
+        return _dict;
+    }
+    /// the tags of unknown spans
+    const vector<uint32_t>& open_class() const {
+        return _open;
+    }
+
+    /// count the words of a segmented corpus
+    template<class SPAN>
+    void add(const vector<lattice_t<SPAN>>& Ys) {
+        for (auto& y : Ys) {
+            const string& raw = *y.raw;
+            const vector<size_t>& off = *y.off;
+            for (auto& span : y.spans) {
+                if (span.end >= off.size()) continue;
+                string word = raw.substr(off[span.begin], off[span.end] - off[span.begin]);
+                word_t& w = _words[word];
+                w.count++;
+                w.tags.insert(_tag_indexer->get(span.label()));
+            }
+        }
+    }
+    /// lines of `word tag`, the tags out of the tagset are left out
+    bool add(const string& filename) {
+        std::ifstream input(filename);
+        if (!input) {
+            fprintf(stderr, "can not open '%s'\n", filename.c_str());
+            return false;
+        }
+        string word;
+        string tag;
+        size_t t;
+        for (std::string line; std::getline(input, line); ) {
+            std::istringstream iss(line);
+            if (!(iss >> word >> tag)) continue;
+            if (!_tag_indexer->find(tag, t)) continue;
+            _words[word].tags.insert(t);
+        }
+        return true;
+    }
+    /// the dictionary of the words counted so far
+    void build() {
+        _once.assign(_tag_indexer->size(), 0);
+        for (auto& word : _words) {
+            if (word.second.count != 1) continue;
+            for (auto t : word.second.tags) _once[t]++;
+        }
+        _open.clear();
+        for (size_t t = 0; t < _once.size(); t++) {
+            if (_once[t]) _open.push_back(t);
+        }
+        if (_open.empty()) {
+            for (size_t t = 0; t < _tag_indexer->size(); t++) _open.push_back(t);
+        }
+
+        map<string, vector<uint32_t>> words;
+        for (auto& word : _words) {
+            set<uint32_t> tags = word.second.tags;
+            if (word.second.count < _min_count) tags.insert(_open.begin(), _open.end());
+            words[word.first].assign(tags.begin(), tags.end());
+        }
+        _compile(words);
+        _words.clear();
+    }
+
+    void serialize(string& out) const {
+        std::ostringstream oss;
+        for (size_t i = 0; i < _open.size(); i++) {
+            oss << (i ? " " : "") << (*_tag_indexer)[_open[i]];
+        }
+        oss << "\n";
+        out.append(oss.str());
+        for (size_t k = 0; k < _words_list.size(); k++) {
+            out.append(_words_list[k]);
+            for (size_t i = _offs[k]; i < _offs[k + 1]; i++) {
+                out.push_back(' ');
+                out.append((*_tag_indexer)[_tags[i]]);
+            }
+            out.push_back('\n');
+        }
+    }
+    bool deserialize(const char* data, size_t size) {
+        std::istringstream input(string(data, size));
+        string line;
+        string tag;
+        size_t t;
+        if (!std::getline(input, line)) return false;
+        _open.clear();
+        std::istringstream open(line);
+        while (open >> tag) {
+            if (_tag_indexer->find(tag, t)) _open.push_back(t);
+        }
+        map<string, vector<uint32_t>> words;
+        string word;
+        while (std::getline(input, line)) {
+            std::istringstream iss(line);
+            if (!(iss >> word)) continue;
+            vector<uint32_t>& tags = words[word];
+            while (iss >> tag) {
+                if (_tag_indexer->find(tag, t)) tags.push_back(t);
+            }
+        }
+        _compile(words);
+        return true;
+    }
+    bool save(const string& filename) const {
+        string out;
+        serialize(out);
+        std::FILE* pf = fopen(filename.c_str(), "w");
+        if (!pf) {
+            fprintf(stderr, "can not write '%s'\n", filename.c_str());
+            return false;
+        }
+        fwrite(out.data(), 1, out.size(), pf);
+        fclose(pf);
+        return true;
+    }
+    bool load(const string& filename) {
+        std::ifstream input(filename);
+        if (!input) {
+            fprintf(stderr, "can not open '%s'\n", filename.c_str());
+            return false;
+        }
+        std::stringstream buffer;
+        buffer << input.rdbuf();
+        string data = buffer.str();
+        return deserialize(data.data(), data.size());
+    }
+
+    /**
+     * the known words of a sentence of up to `max_len` chars, for `tags`.
+     * the matches are kept by the caller, so that threads can share the
+     * dictionary
+     * */
+    void find(const string& raw, const vector<size_t>& off, size_t max_len,
+            DictMatches& matches) const {
+        matches.find(_dict, raw, off, max_len);
+    }
+    /// the tags of the span of chars [i, j), after `find`
+    inline void tags(const DictMatches& matches, size_t i, size_t j,
+            const uint32_t*& begin, const uint32_t*& end) const {
+        size_t e = matches.entry(i, j);
+        if (e == DictMatches::npos) {
+            begin = _open.data();
+            end = begin + _open.size();
+            return;
+        }
+        size_t k = _dict.value(e);
+        begin = _tags.data() + _offs[k];
+        end = _tags.data() + _offs[k + 1];
+    }
+};
+
+}
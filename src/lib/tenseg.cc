@@ -0,0 +1,250 @@
+#include "lib/tenseg.h"
+
+#include "common/common.h"
+#include "common/binary.h"
+#include "common/utf8.h"
+#include "lattice/segtag_model.h"
+#include "lattice/lattice_generator.h"
+
+#include <cstdio>
+#include <exception>
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace tenseg {
+
+typedef labelled_span_t lib_span_t;
+
+/**
+ * the model of segtag in prediction mode, loaded as segtag loads it
+ * */
+struct Model::Impl {
+    Bundle bundle;          ///< the binary model, its pages are used as they are
+    SegTag<lib_span_t> segtag;
+    LatticeGenerator lg;
+    shared_ptr<TagDictionary> tag_dict;
+
+    bool load(const ModelOptions& options) {
+        bool use_bundle = options.txt_model.empty() && options.bin_model.size();
+        if (!use_bundle && options.txt_model.empty()) {
+            fprintf(stderr, "no model is given\n");
+            return false;
+        }
+        if (use_bundle) {
+            if (!bundle.open(options.bin_model) || !load_features(bundle, segtag)) {
+                fprintf(stderr, "can not load binary model '%s'\n",
+                        options.bin_model.c_str());
+                return false;
+            }
+        } else {
+            auto& features = segtag.feature().features();
+            for (auto& file : options.dicts) {
+                features.push_back(make_shared<DictFeature<lib_span_t>>(file));
+            }
+            for (auto& file : options.uni_freqs) {
+                features.push_back(make_shared<UnigramFeature<lib_span_t>>(file));
+            }
+            for (auto& file : options.phrases) {
+                features.push_back(make_shared<PhraseFeature<lib_span_t>>(file));
+            }
+        }
+
+        lg.set_tag_indexer(segtag.tag_indexer());
+        lg.limit(options.span_limit, options.unknown_len);
+        if (options.char_model.size()) {
+            auto pruner = make_shared<CharPruner>();
+            if (!pruner->load(options.char_model)) return false;
+            pruner->set_margin(options.prune_margin);
+            lg.set_pruner(pruner);
+        }
+        for (auto& f : segtag.feature().features()) {
+            auto df = dynamic_pointer_cast<DictFeature<lib_span_t>>(f);
+            if (df) lg.add_words(df->dictionary());
+        }
+
+        if (use_bundle) {
+            if (!segtag.load_binary(bundle)) {
+                fprintf(stderr, "can not load binary model '%s'\n",
+                        options.bin_model.c_str());
+                return false;
+            }
+        } else if (!segtag.load(options.txt_model)) {
+            return false;
+        }
+
+        if (options.tag_dict) {
+            tag_dict = make_shared<TagDictionary>();
+            tag_dict->set_tag_indexer(segtag.tag_indexer());
+            const char* data;
+            size_t size;
+            if (use_bundle) {
+                if (!bundle.get("tag_dict", data, size)
+                        || !tag_dict->deserialize(data, size)) {
+                    fprintf(stderr, "no tag dictionary in binary model '%s'\n",
+                            options.bin_model.c_str());
+                    return false;
+                }
+            } else if (!tag_dict->load(options.txt_model + ".tag_dict")) {
+                return false;
+            }
+            lg.set_tag_dict(tag_dict);
+        }
+        return true;
+    }
+};
+
+Model::Model() : _impl(new Impl()) {}
+Model::~Model() {}
+
+bool Model::load(const ModelOptions& options) {
+    _impl.reset(new Impl());
+    return _impl->load(options);
+}
+size_t Model::tags() const {
+    return _impl->segtag.tag_indexer()->size();
+}
+const std::string& Model::tag(size_t tag) const {
+    return (*_impl->segtag.tag_indexer())[tag];
+}
+
+/**
+ * the buffers of the text, of its lattice and of its features, kept from
+ * text to text
+ * */
+struct DecoderContext::Impl {
+    shared_ptr<Indexer<string>> tags;
+    SegTagDecoder<lib_span_t, LatticeGenerator> decoder;
+    lattice_t<lib_span_t> x;
+    lattice_t<lib_span_t> y;
+
+    Impl(const Model::Impl& model)
+        : tags(model.segtag.tag_indexer()), decoder(model.segtag, model.lg) {
+        x.raw = make_shared<string>();
+        x.off = make_shared<vector<size_t>>();
+    }
+    size_t decode(const char* text, size_t len) {
+        x.raw->assign(text, len);
+        utf8_off(*x.raw, *x.off);
+        decoder.predict(x, y);
+        return y.spans.size();
+    }
+    void copy(Span* spans, size_t capacity) const {
+        const vector<size_t>& off = *x.off;
+        size_t n = std::min(capacity, y.spans.size());
+        for (size_t k = 0; k < n; k++) {
+            const lib_span_t& span = y.spans[k];
+            size_t tag = 0;
+            tags->find(span.label(), tag);
+            spans[k].begin = off[span.begin];
+            spans[k].end = off[span.end];
+            spans[k].tag = tag;
+        }
+    }
+};
+
+DecoderContext::DecoderContext(const Model& model) : _impl(new Impl(*model._impl)) {}
+DecoderContext::~DecoderContext() {}
+
+size_t DecoderContext::segment(const char* text, size_t len, Span* spans, size_t capacity) {
+    size_t n = _impl->decode(text, len);
+    _impl->copy(spans, capacity);
+    return n;
+}
+size_t DecoderContext::segment(const std::string& text, std::vector<Span>& spans) {
+    size_t n = _impl->decode(text.data(), text.size());
+    spans.resize(n);
+    _impl->copy(spans.data(), n);
+    return n;
+}
+
+}
+
+/// the C API, no exception leaves it
+using tenseg::split;
+
+struct tenseg_model {
+    tenseg::Model model;
+};
+struct tenseg_decoder {
+    tenseg::DecoderContext context;
+    tenseg_decoder(const tenseg::Model& model) : context(model) {}
+};
+
+static std::vector<std::string> _files(const char* list) {
+    if (!list || !*list) return std::vector<std::string>();
+    return split(list, ',');
+}
+
+extern "C" {
+
+void tenseg_options_init(tenseg_options* options) {
+    tenseg::ModelOptions defaults;
+    options->txt_model = nullptr;
+    options->bin_model = nullptr;
+    options->dict = nullptr;
+    options->uni_freq = nullptr;
+    options->phrase = nullptr;
+    options->tag_dict = defaults.tag_dict;
+    options->span_limit = defaults.span_limit;
+    options->unknown_len = defaults.unknown_len;
+    options->char_model = nullptr;
+    options->prune_margin = defaults.prune_margin;
+}
+
+tenseg_model* tenseg_model_load(const tenseg_options* options) {
+    tenseg::ModelOptions o;
+    o.txt_model = options->txt_model ? options->txt_model : "";
+    o.bin_model = options->bin_model ? options->bin_model : "";
+    o.dicts = _files(options->dict);
+    o.uni_freqs = _files(options->uni_freq);
+    o.phrases = _files(options->phrase);
+    o.tag_dict = options->tag_dict;
+    o.span_limit = options->span_limit;
+    o.unknown_len = options->unknown_len;
+    o.char_model = options->char_model ? options->char_model : "";
+    o.prune_margin = options->prune_margin;
+    try {
+        tenseg_model* model = new tenseg_model();
+        if (!model->model.load(o)) {
+            delete model;
+            return nullptr;
+        }
+        return model;
+    } catch (const std::exception& e) {
+        fprintf(stderr, "can not load model: %s\n", e.what());
+        return nullptr;
+    }
+}
+void tenseg_model_free(tenseg_model* model) {
+    delete model;
+}
+size_t tenseg_model_tags(const tenseg_model* model) {
+    return model->model.tags();
+}
+const char* tenseg_model_tag(const tenseg_model* model, size_t tag) {
+    return model->model.tag(tag).c_str();
+}
+
+tenseg_decoder* tenseg_decoder_new(const tenseg_model* model) {
+    try {
+        return new tenseg_decoder(model->model);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "can not create decoder: %s\n", e.what());
+        return nullptr;
+    }
+}
+void tenseg_decoder_free(tenseg_decoder* decoder) {
+    delete decoder;
+}
+size_t tenseg_segment(tenseg_decoder* decoder, const char* text, size_t len,
+        tenseg_span* spans, size_t capacity) {
+    try {
+        return decoder->context.segment(text, len, spans, capacity);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "can not segment: %s\n", e.what());
+        return 0;
+    }
+}
+
+}
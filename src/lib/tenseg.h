@@ -0,0 +1,79 @@
+#pragma once
+#include "lib/tenseg_c.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * the C++ API of libtenseg
+ *
+ *     tenseg::ModelOptions options;
+ *     options.bin_model = "model.bin";
+ *     tenseg::Model model;
+ *     if (!model.load(options)) ...
+ *
+ *     /// in each thread
+ *     tenseg::DecoderContext context(model);
+ *     size_t n = context.segment(text, len, spans, capacity);
+ *
+ * the model is not changed once loaded, the contexts keep every buffer of
+ * a sentence, so any number of them may segment at once.
+ * */
+namespace tenseg {
+
+typedef tenseg_span Span;
+
+struct ModelOptions {
+    std::string txt_model;
+    std::string bin_model;              ///< if there is no txt_model
+    std::vector<std::string> dicts;     ///< only with txt_model, a binary model has its own
+    std::vector<std::string> uni_freqs;
+    std::vector<std::string> phrases;
+    bool tag_dict;
+    bool span_limit;
+    size_t unknown_len;
+    std::string char_model;
+    double prune_margin;
+
+    ModelOptions() : tag_dict(false), span_limit(false), unknown_len(4),
+        prune_margin(10) {}
+};
+
+class Model {
+public:
+    Model();
+    ~Model();
+    /// false if it can not be loaded, the reason is on stderr
+    bool load(const ModelOptions& options);
+    size_t tags() const;
+    const std::string& tag(size_t tag) const;
+
+private:
+    friend class DecoderContext;
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+/**
+ * the decoder of one thread. the model must be loaded before and outlive
+ * the context
+ * */
+class DecoderContext {
+public:
+    explicit DecoderContext(const Model& model);
+    ~DecoderContext();
+    /**
+     * the words of the `len` bytes of `text`, the first `capacity` of them
+     * go to `spans`. returns the number of words
+     * */
+    size_t segment(const char* text, size_t len, Span* spans, size_t capacity);
+    size_t segment(const std::string& text, std::vector<Span>& spans);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+}
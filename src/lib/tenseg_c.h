@@ -0,0 +1,65 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * the C API of libtenseg
+ *
+ * a model is loaded once and shared by all threads, each thread segments
+ * with a decoder of its own. a decoder keeps its buffers from text to
+ * text, so it allocates nothing once it has seen texts as long as the next
+ * one, whatever their chars: chars the model does not know are not kept.
+ * errors are reported on stderr.
+ * */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tenseg_model tenseg_model;
+typedef struct tenseg_decoder tenseg_decoder;
+
+/** a word of the text */
+typedef struct tenseg_span {
+    uint32_t begin;     /**< byte offset of the word in the text */
+    uint32_t end;       /**< byte offset after the word */
+    uint32_t tag;       /**< see `tenseg_model_tag` */
+} tenseg_span;
+
+/** as the flags of segtag, the lists of files are separated by ',' */
+typedef struct tenseg_options {
+    const char* txt_model;
+    const char* bin_model;      /**< if there is no txt_model */
+    const char* dict;           /**< only with txt_model, a binary model has its own */
+    const char* uni_freq;
+    const char* phrase;
+    int tag_dict;
+    int span_limit;
+    int unknown_len;
+    const char* char_model;
+    double prune_margin;
+} tenseg_options;
+
+/** no files, and the defaults of segtag */
+void tenseg_options_init(tenseg_options* options);
+
+/** NULL if the model can not be loaded */
+tenseg_model* tenseg_model_load(const tenseg_options* options);
+void tenseg_model_free(tenseg_model* model);
+size_t tenseg_model_tags(const tenseg_model* model);
+const char* tenseg_model_tag(const tenseg_model* model, size_t tag);
+
+/** the model is used by the decoder, and must outlive it */
+tenseg_decoder* tenseg_decoder_new(const tenseg_model* model);
+void tenseg_decoder_free(tenseg_decoder* decoder);
+
+/**
+ * the words of the `len` bytes of `text`, of which the first `capacity`
+ * are written to `spans`. returns the number of words, so that a larger
+ * array can be given when it is more than `capacity`
+ * */
+size_t tenseg_segment(tenseg_decoder* decoder, const char* text, size_t len,
+        tenseg_span* spans, size_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
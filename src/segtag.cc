@@ -8,10 +8,19 @@
 
 #include "lattice/segtag_model.h"
 #include "lattice/ngram_feature.h"
+#include "lattice/tag_dict.h"
+#include "lattice/char_pruner.h"
+#include "lattice/lattice_generator.h"
 
 #include <cstdio>
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <memory>
 
@@ -19,83 +28,6 @@
 using namespace tenseg;
 
 
-class LatticeGenerator {
-    enum char_type_t { ///< 字符类型
-        NORMAL,     ///< 普通字符
-        PUNC        ///< 标点符号
-    };
-    set<string> _punc; ///< 标点符号集合
-    vector<char_type_t> _types;
-    shared_ptr<Indexer<string>> _tag_indexer;
-
-    void _calc_type(const string& raw,
-            const vector<size_t>& off) {
-        _types.clear();
-        for (size_t i = 0; i < off.size() - 1; i++) {
-            string ch = raw.substr(off[i], off[i + 1] - off[i]);
-            _types.push_back(char_type_t::NORMAL);
-            if (_punc.find(ch) != _punc.end()) {
-                _types.back() = char_type_t::PUNC;
-            }
-        }
-        return;
-    }
-public:
-    LatticeGenerator() {
-        _punc.insert(string("。")); _punc.insert(string("，"));
-        _punc.insert(string("？")); _punc.insert(string("！"));
-        _punc.insert(string("：")); _punc.insert(string("“"));
-        _punc.insert(string(":"));
-        _punc.insert(string("”"));
-    }
-
-    void set_tag_indexer(shared_ptr<Indexer<string>> ti) {
-        _tag_indexer = ti;
-    }
-
-    void gen(lattice_t<labelled_span_t>& lat) {
-        const string& raw = *lat.raw;
-        const vector<size_t>& off = *lat.off;
-        vector<labelled_span_t>& lattice = lat.spans;
-
-        if (off.size() == 0) return;
-
-        _calc_type(raw, off);
-        
-        size_t n = off.size() - 1;
-
-        lattice.clear();
-        // generate all spans
-        for (size_t i = 0; i < n; i++) {
-            for (size_t j = i + 1; j < n + 1; j++) {
-                if (j - i > 10) break;
-
-                for (size_t k = 0; k < _tag_indexer->size(); k++) {
-                    lattice.push_back(labelled_span_t(i, j, (*_tag_indexer)[k]));
-                }
-
-                if (_types[i] == char_type_t::PUNC) break;
-                if (j < n && _types[j] == char_type_t::PUNC) break;
-            }
-        }
-    }
-};
-
-
-template<class C>
-void utf8_off(const C& raw, vector<size_t>& off) {
-    off.clear();
-    for (size_t i = 0; i < raw.size(); i++) {
-        const char& c = raw[i];
-        if ((0xc0 == (c & 0xc0))
-                || !(c & 0x80)) {
-            off.push_back(i);
-        }
-    }
-    off.push_back(raw.size());
-}
-
-
 /**
  * load corpus from a segmented file
  * */
@@ -143,14 +75,206 @@ void load(
 };
 
 
+/**
+ * quantize the weights of `segtag`, and report how the F1 on the test set
+ * moves if there is one
+ * */
+template<class SPAN, class LG>
+bool quantize(const string& type_name, SegTag<SPAN>& segtag, LG& lg,
+        vector<lattice_t<SPAN>>& test_Xs,
+        vector<lattice_t<SPAN>>& test_Ys,
+        size_t threads) {
+    value_type_t type;
+    if (!parse_value_type(type_name, type)) {
+        fprintf(stderr, "unknown value type '%s', use float64, float32, int16 or int8\n",
+                type_name.c_str());
+        return false;
+    }
+    Eval<SPAN> before;
+    if (test_Xs.size()) {
+        before = segtag.test(test_Xs, test_Ys, lg, threads);
+    }
+    size_t bytes = segtag.weights().value_bytes();
+    if (!segtag.quantize(type)) return false;
+    fprintf(stderr, "quantize weights to %s: %lu -> %lu bytes of values\n",
+            type_name.c_str(), bytes, segtag.weights().value_bytes());
+    if (test_Xs.size()) {
+        Eval<SPAN> after = segtag.test(test_Xs, test_Ys, lg, threads);
+        fprintf(stderr, "F1 %.5g -> %.5g (%+.5g), labelled F1 %.5g -> %.5g (%+.5g)\n",
+                before.f1(), after.f1(), after.f1() - before.f1(),
+                before.label_f1(), after.label_f1(),
+                after.label_f1() - before.label_f1());
+    }
+    return true;
+}
+
+
+/**
+ * the binary model, with the tag dictionary if there is one
+ * */
+template<class SPAN>
+void save_binary(SegTag<SPAN>& segtag, shared_ptr<TagDictionary> tag_dict,
+        const string& filename) {
+    BundleWriter bundle;
+    segtag.save_binary(bundle);
+    if (tag_dict) tag_dict->serialize(bundle.add("tag_dict"));
+    bundle.write(filename);
+}
+
+
+/**
+ * the lines of stdin to stdout, decoded by `threads` threads
+ *
+ * the lines are read in batches, each thread decodes whole batches with a
+ * decoder of its own, and a writer puts the batches out in the order they
+ * were read. at most 4 batches per thread are read and not yet written, so
+ * the memory stays bounded however long the input is.
+ * */
+template<class SPAN, class LG>
+void predict(SegTag<SPAN>& segtag, LG& lg, size_t threads) {
+    enum : size_t { BATCH = 64 };
+    struct batch_t {
+        size_t seq;
+        vector<string> lines;
+        string out;
+    };
+    if (threads < 1) threads = 1;
+    size_t max_batches = 4 * threads;
+
+    std::mutex mutex;
+    std::condition_variable todo_cond;  ///< a batch to decode, or the end
+    std::condition_variable done_cond;  ///< a batch to write, or the end
+    std::condition_variable room_cond;  ///< a batch was written
+    std::deque<shared_ptr<batch_t>> todo;
+    std::map<size_t, shared_ptr<batch_t>> done;
+    size_t in_flight = 0;
+    size_t batches = 0;
+    bool eof = false;
+
+    vector<shared_ptr<SegTagDecoder<SPAN, LG>>> decoders;
+    for (size_t t = 0; t < threads; t++) {
+        decoders.push_back(make_shared<SegTagDecoder<SPAN, LG>>(segtag, lg));
+    }
+
+    vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            SegTagDecoder<SPAN, LG>& decoder = *decoders[t];
+            lattice_t<SPAN> x;
+            lattice_t<SPAN> y;
+            x.raw = make_shared<string>();
+            x.off = make_shared<vector<size_t>>();
+            std::ostringstream oss;
+            while (true) {
+                shared_ptr<batch_t> batch;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    todo_cond.wait(lock, [&]() { return !todo.empty() || eof; });
+                    if (todo.empty()) return;
+                    batch = todo.front();
+                    todo.pop_front();
+                }
+                oss.str("");
+                for (auto& line : batch->lines) {
+                    x.raw->swap(line);
+                    utf8_off(*x.raw, *x.off);
+                    decoder.predict(x, y);
+                    oss << y << '\n';
+                }
+                batch->out = oss.str();
+                batch->lines.clear();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    done[batch->seq] = batch;
+                }
+                done_cond.notify_one();
+            }
+        });
+    }
+
+    std::thread writer([&]() {
+        for (size_t seq = 0; ; seq++) {
+            shared_ptr<batch_t> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                done_cond.wait(lock, [&]() {
+                    return done.count(seq) || (eof && seq == batches);
+                });
+                if (!done.count(seq)) break;
+                batch = done[seq];
+                done.erase(seq);
+            }
+            fwrite(batch->out.data(), 1, batch->out.size(), stdout);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                in_flight--;
+            }
+            room_cond.notify_one();
+        }
+        fflush(stdout);
+    });
+
+    for (bool more = true; more; ) {
+        auto batch = make_shared<batch_t>();
+        string line;
+        while (batch->lines.size() < BATCH && std::getline(cin, line)) {
+            batch->lines.push_back(std::move(line));
+        }
+        more = (batch->lines.size() == BATCH);
+        if (batch->lines.empty()) break;
+        std::unique_lock<std::mutex> lock(mutex);
+        room_cond.wait(lock, [&]() { return in_flight < max_batches; });
+        batch->seq = batches++;
+        in_flight++;
+        todo.push_back(batch);
+        lock.unlock();
+        todo_cond.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        eof = true;
+    }
+    todo_cond.notify_all();
+    done_cond.notify_all();
+    for (auto& worker : workers) worker.join();
+    writer.join();
+}
+
+
 /// 定义参数
 DEFINE_string(train, "", "Training file");
 DEFINE_string(test, "", "Development file");
 DEFINE_string(txt_model, "", "Development file");
+DEFINE_string(bin_model, "", "Binary model, mapped read-only for test and prediction. "
+        "Given together with txt_model (and no train), the text model is converted");
+DEFINE_string(quantize, "", "Value type of the binary model: float64, float32, int16 or int8. "
+        "The F1 change is reported when a test file is given");
 DEFINE_string(dict, "", "Dict file");
 DEFINE_string(uni_freq, "", "Unigram frequence");
 DEFINE_string(phrase, "", "phrase Dict file");
+DEFINE_bool(tag_dict, false, "Only give known words the tags they were seen with in "
+        "the training file, the tag dictionary is saved with the model");
+DEFINE_int32(tag_dict_min_count, 3, "Words seen less often in the training file "
+        "may also get the tags of the open class");
+DEFINE_string(tag_dict_words, "", "Files of `word tag` lines, whose tags are added "
+        "to the tag dictionary");
+DEFINE_bool(span_limit, false, "Spans from a char are no longer than the known words "
+        "from there or unknown_len chars, runs of digits or letters are kept whole");
+DEFINE_int32(unknown_len, 4, "Chars of the longest unknown word, with span_limit");
+DEFINE_string(char_model, "", "Text model of char_segger, the word boundaries it finds "
+        "unlikely are pruned from the lattice");
+DEFINE_double(prune_margin, 10, "With char_model, a boundary is pruned if the best path "
+        "with it is this much worse than the best one, and no span crosses it if the best "
+        "path without it is");
+DEFINE_int32(threads, 1, "Threads decoding the lines of stdin in prediction mode, "
+        "the output keeps the order of the input. In training, the perceptron is "
+        "trained Hogwild with this many threads. The test file is decoded with "
+        "this many threads in any mode");
+DEFINE_int32(shards, 0, "Train the perceptron by iterative parameter mixing: the "
+        "training file is split into this many shards, each trained by a process of "
+        "its own, and their weights are mixed after each epoch");
 DEFINE_int32(iteration, 5, "Iteration");
+DEFINE_string(learner, "perceptron", "Learner: perceptron (averaged), adagrad or avg_adagrad");
 //DEFINE_int32(logtostderr, 1, "");
 
 int main(int argc, char* argv[]) {
@@ -171,22 +295,35 @@ int main(int argc, char* argv[]) {
     vector<lattice_t<span_type>> test_Xs;
     vector<lattice_t<span_type>> test_Ys;
 
+    /// 二进制模型
+    Bundle bundle;
+    bool use_bundle = (!FLAGS_train.size()) && (!FLAGS_txt_model.size())
+        && FLAGS_bin_model.size();
+    if (use_bundle) {
+        if (!bundle.open(FLAGS_bin_model) || !load_features(bundle, segtag)) {
+            fprintf(stderr, "can not load binary model '%s'\n", FLAGS_bin_model.c_str());
+            return 1;
+        }
+    }
+
     /// 外部词典
-    if (FLAGS_dict.size()) {
+    if (use_bundle) {
+        /// the features come with the binary model
+    } else if (FLAGS_dict.size()) {
         for (auto& dfile : split(FLAGS_dict, ',')) {
             auto df = make_shared<DictFeature<span_type>>(dfile);
             segtag.feature().features().push_back(df);
         }
     }
 
-    if (FLAGS_uni_freq.size()) {
+    if (!use_bundle && FLAGS_uni_freq.size()) {
         for (auto& dfile : split(FLAGS_uni_freq, ',')) {
             auto df = make_shared<UnigramFeature<span_type>>(dfile);
             segtag.feature().features().push_back(df);
         }
     }
 
-    if (FLAGS_phrase.size()) {
+    if (!use_bundle && FLAGS_phrase.size()) {
         for (auto& dfile : split(FLAGS_phrase, ',')) {
             auto df = make_shared<PhraseFeature<span_type>>(dfile);
             segtag.feature().features().push_back(df);
@@ -196,10 +333,59 @@ int main(int argc, char* argv[]) {
     /// 词图产生
     LatticeGenerator lg;
     lg.set_tag_indexer(segtag.tag_indexer());
+    lg.limit(FLAGS_span_limit, FLAGS_unknown_len);
+    if (FLAGS_char_model.size()) {
+        auto pruner = make_shared<CharPruner>();
+        if (!pruner->load(FLAGS_char_model)) return 1;
+        pruner->set_margin(FLAGS_prune_margin);
+        lg.set_pruner(pruner);
+    }
+    for (auto& f : segtag.feature().features()) {
+        auto df = dynamic_pointer_cast<DictFeature<span_type>>(f);
+        if (df) lg.add_words(df->dictionary());
+    }
+    shared_ptr<TagDictionary> tag_dict;
+    if (FLAGS_tag_dict) {
+        tag_dict = make_shared<TagDictionary>();
+        tag_dict->set_tag_indexer(segtag.tag_indexer());
+        tag_dict->set_min_count(FLAGS_tag_dict_min_count);
+    }
 
     /// load
     if ((!FLAGS_train.size()) && (FLAGS_txt_model.size())) {
-        segtag.load(FLAGS_txt_model);
+        if (!segtag.load(FLAGS_txt_model)) return 1;
+        if (tag_dict) {
+            if (!tag_dict->load(FLAGS_txt_model + ".tag_dict")) return 1;
+            lg.set_tag_dict(tag_dict);
+        }
+        /// 转换为二进制模型
+        if (FLAGS_bin_model.size()) {
+            if (FLAGS_quantize.size()) {
+                if (FLAGS_test.size()) {
+                    load(FLAGS_test, segtag.tag_indexer(), test_Xs, test_Ys);
+                }
+                if (!quantize(FLAGS_quantize, segtag, lg, test_Xs, test_Ys, FLAGS_threads)) return 1;
+            }
+            save_binary(segtag, tag_dict, FLAGS_bin_model);
+            return 0;
+        }
+    }
+    if (use_bundle && !segtag.load_binary(bundle)) {
+        fprintf(stderr, "can not load binary model '%s'\n", FLAGS_bin_model.c_str());
+        return 1;
+    }
+    if (use_bundle) {
+        fprintf(stderr, "map %lu weights\n", segtag.weights().size());
+    }
+    if (use_bundle && tag_dict) {
+        const char* data;
+        size_t size;
+        if (!bundle.get("tag_dict", data, size) || !tag_dict->deserialize(data, size)) {
+            fprintf(stderr, "no tag dictionary in binary model '%s'\n",
+                    FLAGS_bin_model.c_str());
+            return 1;
+        }
+        lg.set_tag_dict(tag_dict);
     }
 
     /// 训练模式
@@ -208,12 +394,37 @@ int main(int argc, char* argv[]) {
         if (FLAGS_test.size()) {
             load(FLAGS_test, segtag.tag_indexer(), test_Xs, test_Ys);
         }
+        if (tag_dict) {
+            tag_dict->add(train_Ys);
+            for (auto& dfile : split(FLAGS_tag_dict_words, ',')) {
+                if (!tag_dict->add(dfile)) return 1;
+            }
+            tag_dict->build();
+            fprintf(stderr, "tag dictionary of %lu words, %lu of %lu tags are open\n",
+                    tag_dict->size(), tag_dict->open_class().size(),
+                    segtag.tag_indexer()->size());
+            lg.set_tag_dict(tag_dict);
+        }
 
+        learner_type_t learner;
+        if (!parse_learner_type(FLAGS_learner, learner)) {
+            fprintf(stderr, "unknown learner '%s'\n", FLAGS_learner.c_str());
+            return 1;
+        }
         size_t iterations = FLAGS_iteration;
-        segtag.fit(train_Xs, train_Ys, test_Xs, test_Ys, lg, iterations);
+        segtag.fit(train_Xs, train_Ys, test_Xs, test_Ys, lg, iterations, learner,
+                FLAGS_threads, FLAGS_shards);
 
         if (FLAGS_txt_model.size()) {
             segtag.save(FLAGS_txt_model);
+            if (tag_dict) tag_dict->save(FLAGS_txt_model + ".tag_dict");
+        }
+        if (FLAGS_bin_model.size()) {
+            if (FLAGS_quantize.size()
+                    && !quantize(FLAGS_quantize, segtag, lg, test_Xs, test_Ys, FLAGS_threads)) {
+                return 1;
+            }
+            save_binary(segtag, tag_dict, FLAGS_bin_model);
         }
         return 0;
     }
@@ -221,23 +432,13 @@ int main(int argc, char* argv[]) {
     /// 测试模式
     if (FLAGS_test.size()) { 
         load(FLAGS_test, segtag.tag_indexer(), test_Xs, test_Ys);
-        segtag.test(test_Xs, test_Ys, lg);
+        segtag.test(test_Xs, test_Ys, lg, FLAGS_threads);
         return 0;
     }
 
     /// 预测模式
-    if (FLAGS_txt_model.size()) {
-        vector<lattice_t<span_type>> Xs(1);
-        vector<lattice_t<span_type>> Ys(1);
-        Xs.back().raw = make_shared<string>();
-        Xs.back().off = make_shared<vector<size_t>>();
-
-        
-        for (; std::getline(cin, *Xs.back().raw); ) {
-            utf8_off(*Xs.back().raw, *Xs.back().off);
-            segtag.predict(Xs, Ys, lg);
-            cout << Ys.back() << endl;
-        }
+    if (FLAGS_txt_model.size() || use_bundle) {
+        predict(segtag, lg, FLAGS_threads);
     }
 
     return 0;
@@ -0,0 +1,1300 @@
+/**
+ * micro benchmarks for the building blocks of tenseg
+ *
+ * usage: tenseg_bench <name> [args...]
+ * */
+#include "common/common.h"
+#include "common/weight.h"
+#include "common/optimizer.h"
+#include "common/dictionary.h"
+#include "lattice/feature.h"
+#include "lattice/ngram_feature.h"
+#include "lib/tenseg.h"
+
+#include <malloc.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace tenseg;
+
+/// every `new` of the program, to tell if a loop allocates
+static std::atomic<size_t> allocations(0);
+
+static void* counted_alloc(size_t size, size_t align) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = nullptr;
+    if (align <= alignof(std::max_align_t)) return malloc(size ? size : 1);
+    return posix_memalign(&p, align, size ? size : 1) ? nullptr : p;
+}
+/// kept out of line, the compiler would pair `free` with `new` otherwise
+__attribute__((noinline)) static void counted_free(void* p) noexcept {
+    free(p);
+}
+static void* counted_new(size_t size, size_t align) {
+    void* p = counted_alloc(size, align);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+/// the whole set of replaceable forms, so each `delete` matches its `new`
+void* operator new(size_t size) { return counted_new(size, 0); }
+void* operator new[](size_t size) { return counted_new(size, 0); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size, 0);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size, 0);
+}
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { counted_free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { counted_free(p); }
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, size_t) noexcept { counted_free(p); }
+void operator delete[](void* p, size_t) noexcept { counted_free(p); }
+#endif
+#ifdef __cpp_aligned_new
+void* operator new(size_t size, std::align_val_t al) {
+    return counted_new(size, (size_t)al);
+}
+void* operator new[](size_t size, std::align_val_t al) {
+    return counted_new(size, (size_t)al);
+}
+void* operator new(size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+    return counted_alloc(size, (size_t)al);
+}
+void* operator new[](size_t size, std::align_val_t al, const std::nothrow_t&) noexcept {
+    return counted_alloc(size, (size_t)al);
+}
+void operator delete(void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    counted_free(p);
+}
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    counted_free(p);
+}
+void operator delete(void* p, size_t, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { counted_free(p); }
+#endif
+
+/// heap bytes in use, from glibc, large blocks are mapped on their own
+static size_t heap_bytes() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+class Timer {
+    std::chrono::steady_clock::time_point _start;
+public:
+    Timer() : _start(std::chrono::steady_clock::now()) {}
+    double seconds() const {
+        return std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - _start).count();
+    }
+};
+
+/// random keys shaped like the ones of a segtag model
+static void make_keys(size_t n, vector<string>& keys, unsigned seed) {
+    std::mt19937 rng(seed);
+    keys.clear();
+    vector<char> buffer;
+    for (size_t i = 0; i < n; i++) {
+        buffer.clear();
+        size_t kind = rng() % 4;
+        if (kind == 0) {
+            string prefix = "d:dict.txt:";
+            buffer.insert(buffer.end(), prefix.begin(), prefix.end());
+        }
+        size_t chars = (kind == 0) ? 1 + rng() % 4 : 1 + kind % 2;
+        for (size_t c = 0; c < chars; c++) {
+            utf8(0x4e00 + rng() % 20000, buffer);
+        }
+        /// make keys unique
+        string suffix = (kind == 0) ? "" : std::to_string(i);
+        buffer.insert(buffer.end(), suffix.begin(), suffix.end());
+        keys.push_back(string(buffer.begin(), buffer.end()));
+    }
+}
+
+template<class W>
+static void bench_weight_backend(const char* name, const vector<string>& keys,
+        const vector<string>& queries, size_t row_len) {
+    vector<double> row(row_len, 1.0);
+    size_t before = heap_bytes();
+    Timer build;
+    W* weight = new W();
+    for (auto& key : keys) {
+        weight->add_from(key, row.data(), row_len);
+    }
+    double build_sec = build.seconds();
+    size_t bytes = heap_bytes() - before;
+
+    double sum = 0;
+    Timer lookup;
+    for (auto& key : queries) {
+        double* ptr = weight->get(key);
+        if (ptr) sum += *ptr;
+    }
+    double lookup_sec = lookup.seconds();
+
+    vector<double> acc(row_len, 0);
+    Timer add_to;
+    for (auto& key : queries) {
+        weight->add_to(key, acc.data());
+    }
+    double add_to_sec = add_to.seconds();
+
+    printf("%-10s build %.3fs  get %.2fM/s  add_to %.2fM/s  %.1f bytes/feature"
+            " (%.1f besides values)  [%g]\n",
+            name, build_sec,
+            queries.size() / lookup_sec / 1e6,
+            queries.size() / add_to_sec / 1e6,
+            1.0 * bytes / keys.size(),
+            1.0 * bytes / keys.size() - row_len * sizeof(double),
+            sum + acc[0]);
+    delete weight;
+}
+
+/// Weight vs the former std::map based store
+static void bench_weight(int argc, char* argv[]) {
+    size_t n = (argc > 0) ? atol(argv[0]) : 1000000;
+    size_t row_len = (argc > 1) ? atol(argv[1]) : 4;
+
+    vector<string> keys;
+    make_keys(n, keys, 1);
+    /// half hits, half misses
+    vector<string> misses;
+    make_keys(n, misses, 2);
+    vector<string> queries;
+    std::mt19937 rng(3);
+    for (size_t i = 0; i < n * 2; i++) {
+        queries.push_back((i % 2) ? keys[rng() % n] : misses[rng() % n]);
+    }
+    printf("%lu features, %lu values each, %lu lookups (50%% hits)\n",
+            n, row_len, queries.size());
+    bench_weight_backend<MapWeight>("map", keys, queries, row_len);
+    bench_weight_backend<HashWeight>("hash", keys, queries, row_len);
+
+    /// ids resolved ahead of time skip the key hashing
+    HashWeight weight;
+    vector<double> row(row_len, 1.0);
+    for (auto& key : keys) weight.add_from(key, row.data(), row_len);
+    vector<uint64_t> ids;
+    for (auto& key : queries) ids.push_back(feature_id(key));
+    double sum = 0;
+    Timer lookup;
+    for (auto id : ids) {
+        double* ptr = weight.get(id);
+        if (ptr) sum += *ptr;
+    }
+    printf("%-10s get %.2fM/s  [%g]\n", "hash(id)",
+            ids.size() / lookup.seconds() / 1e6, sum);
+}
+
+/// the averaging SegTag::fit does before decoding the dev set
+static void average_for_dev(Learner<HashWeight>& learner, HashWeight& ave) {
+    learner.average(ave);
+}
+static void average_for_dev(LazyLearner<HashWeight>& learner, HashWeight&) {
+    learner.average();
+}
+
+/**
+ * one epoch of perceptron updates with random sparse gradients
+ * */
+template<class LEARNER>
+static void run_epoch(LEARNER& learner, HashWeight& ave,
+        const vector<string>& keys, size_t steps, size_t touched,
+        std::mt19937& rng, double& update_sec, double& average_sec) {
+    Timer update;
+    double delta = 1;
+    SparseGradient gradient;
+    for (size_t s = 0; s < steps; s++) {
+        gradient.clear();
+        for (size_t k = 0; k < touched; k++) {
+            delta = -delta;
+            gradient.add(keys[rng() % keys.size()], delta);
+        }
+        gradient.seal();
+        learner.update(gradient);
+    }
+    update_sec = update.seconds();
+    Timer average;
+    average_for_dev(learner, ave);
+    average_sec = average.seconds();
+}
+
+template<class LEARNER>
+static void bench_learner_backend(const char* name, const vector<string>& keys,
+        size_t epochs, size_t steps, size_t touched) {
+    std::mt19937 rng(5);
+    size_t before = heap_bytes();
+    LEARNER* learner = new LEARNER();
+    HashWeight* ave = new HashWeight();
+    for (size_t it = 0; it < epochs; it++) {
+        double update_sec, average_sec;
+        run_epoch(*learner, *ave, keys, steps, touched, rng, update_sec, average_sec);
+        printf("%-8s epoch %lu: update %.3fs  average %.3fs  heap %.1fMB\n",
+                name, it + 1, update_sec, average_sec,
+                (heap_bytes() - before) / 1e6);
+    }
+    delete ave;
+    delete learner;
+}
+
+/// the averaged perceptron: copying average vs timestamps
+static void bench_learner(int argc, char* argv[]) {
+    size_t n = (argc > 0) ? atol(argv[0]) : 1000000;
+    size_t steps = (argc > 1) ? atol(argv[1]) : 100000;
+    size_t touched = (argc > 2) ? atol(argv[2]) : 50;
+    size_t epochs = 3;
+
+    vector<string> keys;
+    make_keys(n, keys, 1);
+    printf("%lu features, %lu updates of %lu features per epoch\n",
+            n, steps, touched);
+    bench_learner_backend<Learner<HashWeight>>("copy", keys, epochs, steps, touched);
+    bench_learner_backend<LazyLearner<HashWeight>>("lazy", keys, epochs, steps, touched);
+}
+
+/**
+ * the gradient of a sentence the way LabelledFeature fills it: a row of
+ * `(n + 2) * 4 * tags` values per char ngram with a few non-zero deltas
+ * around the differing spans, and the transitions between spans
+ * */
+static void bench_gradient(int argc, char* argv[]) {
+    size_t sentences = (argc > 0) ? atol(argv[0]) : 20000;
+    size_t chars = (argc > 1) ? atol(argv[1]) : 40;
+    size_t tags = (argc > 2) ? atol(argv[2]) : 30;
+    const size_t N = 4, MAX_LEN = 4;
+    size_t trans_len = MAX_LEN * tags * MAX_LEN * tags;
+
+    vector<string> keys;
+    make_keys(5000, keys, 1);
+    printf("%lu sentences of %lu chars, %lu tags\n", sentences, chars, tags);
+
+    for (int sparse = 0; sparse < 2; sparse++) {
+        std::mt19937 rng(7);
+        Learner<HashWeight> learner;
+        HashWeight weight, acc;
+        SparseGradient gradient;
+        vector<double> emission;
+        size_t before = heap_bytes();
+        Timer fill;
+        double update_sec = 0;
+        for (size_t s = 0; s < sentences; s++) {
+            /// deltas of the emission, gold minus output
+            emission.assign(chars * N * tags, 0);
+            for (size_t k = 0; k < 8; k++) {
+                emission[rng() % emission.size()] += (k % 2) ? -1 : 1;
+            }
+            size_t first = rng() % keys.size();
+            if (sparse) {
+                gradient.clear();
+                for (size_t n = 1; n <= 2; n++) {
+                    for (size_t i = 0; i + n <= chars; i++) {
+                        const string& key = keys[(first + i * n) % keys.size()];
+                        size_t row = gradient.row(key, (n + 2) * N * tags);
+                        int b = ((int)i - 1) * N * tags;
+                        int e = std::min((int)(2 + n), (int)(chars + 1 - i)) * N * tags;
+                        for (int j = std::max(0, -b); j < e && b + j < (int)emission.size(); j++) {
+                            gradient.add(row, j, emission[b + j]);
+                        }
+                    }
+                }
+                size_t trans = gradient.row("transition", trans_len);
+                for (size_t k = 0; k < chars / 2; k++) {
+                    gradient.add(trans, rng() % trans_len, (k % 2) ? -1 : 1);
+                }
+                gradient.seal();
+                Timer update;
+                learner.update(gradient);
+                update_sec += update.seconds();
+            } else {
+                HashWeight dense;
+                for (size_t n = 1; n <= 2; n++) {
+                    for (size_t i = 0; i + n <= chars; i++) {
+                        const string& key = keys[(first + i * n) % keys.size()];
+                        dense.insert(key, (n + 2) * N * tags);
+                        double* m = dense.get(key);
+                        int b = ((int)i - 1) * N * tags;
+                        int e = std::min((int)(2 + n), (int)(chars + 1 - i)) * N * tags;
+                        for (int j = std::max(0, -b); j < e && b + j < (int)emission.size(); j++) {
+                            m[j] += emission[b + j];
+                        }
+                    }
+                }
+                vector<double> g_trans(trans_len);
+                for (size_t k = 0; k < chars / 2; k++) {
+                    g_trans[rng() % trans_len] += (k % 2) ? -1 : 1;
+                }
+                dense.add_from("transition", &g_trans[0], g_trans.size());
+                /// what Learner::update used to do
+                Timer update;
+                weight.update(dense, 1.0);
+                acc.update(dense, s + 1);
+                update_sec += update.seconds();
+            }
+        }
+        printf("%-8s %.0f sentences/s  (update %.3fs)  heap %.1fMB\n",
+                sparse ? "sparse" : "weight", sentences / fill.seconds(),
+                update_sec, (heap_bytes() - before) / 1e6);
+    }
+}
+
+/**
+ * the double-array trie vs a std::map: building, loading a compiled
+ * dictionary, and finding every entry of up to 11 chars in sentences
+ * */
+static void bench_dict(int argc, char* argv[]) {
+    size_t n = (argc > 0) ? atol(argv[0]) : 1000000;
+    size_t sentences = (argc > 1) ? atol(argv[1]) : 20000;
+    const size_t MAX_PHRASE = 12;
+    const char* filename = "/tmp/tenseg_bench.dict";
+
+    std::mt19937 rng(11);
+    std::map<string, string> items;
+    vector<char> buffer;
+    for (size_t i = 0; i < n; i++) {
+        buffer.clear();
+        size_t chars = 1 + rng() % 4;
+        for (size_t c = 0; c < chars; c++) utf8(0x4e00 + rng() % 3000, buffer);
+        items[string(buffer.begin(), buffer.end())] = "n";
+    }
+    /// sentences over the same chars, so that entries are found
+    vector<string> raws(sentences);
+    vector<vector<size_t>> offs(sentences);
+    for (size_t s = 0; s < sentences; s++) {
+        buffer.clear();
+        for (size_t c = 0; c < 40; c++) {
+            offs[s].push_back(buffer.size());
+            utf8(0x4e00 + rng() % 3000, buffer);
+        }
+        offs[s].push_back(buffer.size());
+        raws[s].assign(buffer.begin(), buffer.end());
+    }
+    printf("%lu entries, %lu sentences of 40 chars\n", items.size(), sentences);
+
+    Timer build;
+    Dictionary<string> trie;
+    trie.build(items);
+    printf("%-6s build %.3fs\n", "trie", build.seconds());
+    trie.save(filename);
+    Timer load;
+    Dictionary<string> mapped;
+    mapped.load(filename);
+    printf("%-6s load %.4fs\n", "trie", load.seconds());
+
+    size_t found = 0;
+    Timer map_find;
+    string value;
+    for (size_t s = 0; s < sentences; s++) {
+        auto& raw = raws[s];
+        auto& off = offs[s];
+        for (size_t i = 0; i + 1 < off.size(); i++) {
+            for (size_t j = i + 1; j < i + MAX_PHRASE && j < off.size(); j++) {
+                auto it = items.find(raw.substr(off[i], off[j] - off[i]));
+                if (it != items.end()) found++;
+            }
+        }
+    }
+    printf("%-6s %.0f sentences/s  [%lu]\n", "map",
+            sentences / map_find.seconds(), found);
+
+    found = 0;
+    DictMatches matches;
+    Timer trie_find;
+    for (size_t s = 0; s < sentences; s++) {
+        matches.find(mapped, raws[s], offs[s], MAX_PHRASE - 1);
+        for (size_t i = 0; i + 1 < offs[s].size(); i++) {
+            found += matches.end(i) - matches.begin(i);
+        }
+    }
+    printf("%-6s %.0f sentences/s  [%lu]\n", "trie",
+            sentences / trie_find.seconds(), found);
+    remove(filename);
+}
+
+struct bench_span_t {
+    size_t begin;
+    size_t end;
+    string label_;
+    bench_span_t(size_t b, size_t e, string& l) : begin(b), end(e), label_(l) {}
+    const string& label() const { return label_; }
+};
+
+/// PhraseFeature::prepare as it was: a walk from every char, all pairs checked for crossing
+static size_t previous_prepare(const Dictionary<string>& dict, DictMatches& matches,
+        const string& raw, const vector<size_t>& off) {
+    const size_t MAX_PHRASE = 12;
+    vector<bench_span_t> found;
+    matches.find(dict, raw, off, MAX_PHRASE - 1);
+    for (size_t i = 0; i + 1 < off.size(); i++) {
+        for (auto m = matches.begin(i); m != matches.end(i); m++) {
+            string value = dict.value(m->entry);
+            found.push_back(bench_span_t(i, m->end, value));
+        }
+    }
+    size_t crossing = 0;
+    for (auto& pa : found) {
+        for (auto& pb : found) {
+            if ((pa.begin < pb.begin && pb.begin < pa.end && pa.end < pb.end) ||
+                    (pb.begin < pa.begin && pa.begin < pb.end && pb.end < pa.end)) {
+                crossing++;
+                break;
+            }
+        }
+    }
+    return found.size() + crossing;
+}
+
+/**
+ * finding the phrases of long paragraphs, with and without the crossing
+ * filter, per KB of text
+ * */
+static void bench_phrase(int argc, char* argv[]) {
+    size_t n = (argc > 0) ? atol(argv[0]) : 200000;
+    size_t paragraph_kb = (argc > 1) ? atol(argv[1]) : 4;
+    size_t paragraphs = (argc > 2) ? atol(argv[2]) : 200;
+    const char* filename = "/tmp/tenseg_bench.phrase";
+
+    std::mt19937 rng(13);
+    vector<string> phrases;
+    vector<char> buffer;
+    std::FILE* pf = fopen(filename, "w");
+    for (size_t i = 0; i < n; i++) {
+        buffer.clear();
+        size_t chars = 2 + rng() % 7;
+        for (size_t c = 0; c < chars; c++) utf8(0x4e00 + rng() % 2000, buffer);
+        phrases.push_back(string(buffer.begin(), buffer.end()));
+        fprintf(pf, "%s NP\n", phrases.back().c_str());
+    }
+    fclose(pf);
+
+    /// paragraphs of phrases and random chars
+    vector<shared_ptr<string>> raws;
+    vector<shared_ptr<vector<size_t>>> offs;
+    size_t bytes = 0;
+    for (size_t p = 0; p < paragraphs; p++) {
+        buffer.clear();
+        while (buffer.size() < paragraph_kb * 1024) {
+            if (rng() % 2) {
+                auto& phrase = phrases[rng() % phrases.size()];
+                buffer.insert(buffer.end(), phrase.begin(), phrase.end());
+            } else {
+                utf8(0x4e00 + rng() % 2000, buffer);
+            }
+        }
+        raws.push_back(make_shared<string>(buffer.begin(), buffer.end()));
+        offs.push_back(make_shared<vector<size_t>>());
+        for (size_t i = 0; i < buffer.size(); i++) {
+            if ((buffer[i] & 0xc0) != 0x80) offs.back()->push_back(i);
+        }
+        offs.back()->push_back(buffer.size());
+        bytes += buffer.size();
+    }
+    printf("%lu phrases, %lu paragraphs of %luKB\n", n, paragraphs, paragraph_kb);
+
+    Timer load;
+    Dictionary<string> dict;
+    dict.load(filename);
+    printf("%-22s %.3fs\n", "dictionary load", load.seconds());
+    Timer build;
+    AhoCorasick<Dictionary<string>> automaton;
+    automaton.build(dict);
+    printf("%-22s %.3fs\n", "automaton build", build.seconds());
+    DictMatches matches;
+    size_t found = 0;
+    Timer previous;
+    for (size_t p = 0; p < paragraphs; p++) {
+        found += previous_prepare(dict, matches, *raws[p], *offs[p]);
+    }
+    printf("%-22s %.1fus/KB  [%lu]\n", "walk + all pairs",
+            previous.seconds() * 1e6 / (bytes / 1024.0), found);
+
+    PhraseFeature<bench_span_t> feature(filename);
+    HashWeight weight;
+    feature.set_weight(weight);
+    Lattice lattice;
+    for (int drop = 0; drop < 2; drop++) {
+        feature.drop_crossing(drop);
+        /// a first pass grows the buffers of the feature, the second should not allocate
+        for (size_t p = 0; p < paragraphs; p++) {
+            feature.prepare(raws[p], offs[p], lattice);
+        }
+        size_t allocated = allocations.load();
+        Timer prepare;
+        for (size_t p = 0; p < paragraphs; p++) {
+            feature.prepare(raws[p], offs[p], lattice);
+        }
+        printf("%-22s %.1fus/KB  %lu allocations\n", drop ? "automaton + sweep" : "automaton",
+                prepare.seconds() * 1e6 / (bytes / 1024.0), allocations.load() - allocated);
+    }
+    remove(filename);
+}
+
+/// all spans of up to 10 chars, each with every tag
+static void full_lattice(size_t chars, size_t tags,
+        shared_ptr<Indexer<string>> indexer, Lattice& lattice) {
+    lattice.reset(chars, indexer);
+    for (size_t i = 0; i < chars; i++) {
+        for (size_t j = i + 1; j <= chars && j - i <= 10; j++) {
+            for (size_t t = 0; t < tags; t++) lattice.add(i, j, t);
+        }
+    }
+    lattice.seal();
+}
+
+/**
+ * scoring the spans of a lattice (all spans of up to 10 chars, each with
+ * every tag) with a dictionary feature: keys built per span as before,
+ * vs ids resolved once per match in DictFeature::prepare
+ * */
+static void bench_feature(int argc, char* argv[]) {
+    size_t n = (argc > 0) ? atol(argv[0]) : 100000;
+    size_t sentences = (argc > 1) ? atol(argv[1]) : 5000;
+    size_t tags = (argc > 2) ? atol(argv[2]) : 30;
+    const char* filename = "/tmp/tenseg_bench.words";
+
+    std::mt19937 rng(17);
+    vector<string> words;
+    vector<char> buffer;
+    std::FILE* pf = fopen(filename, "w");
+    for (size_t i = 0; i < n; i++) {
+        buffer.clear();
+        size_t chars = 1 + rng() % 4;
+        for (size_t c = 0; c < chars; c++) utf8(0x4e00 + rng() % 2000, buffer);
+        words.push_back(string(buffer.begin(), buffer.end()));
+        fprintf(pf, "%s %s\n", words.back().c_str(), (rng() % 2) ? "NN" : "VV");
+    }
+    fclose(pf);
+
+    vector<shared_ptr<string>> raws;
+    vector<shared_ptr<vector<size_t>>> offs;
+    for (size_t s = 0; s < sentences; s++) {
+        buffer.clear();
+        while (buffer.size() < 120) {
+            auto& word = words[rng() % words.size()];
+            buffer.insert(buffer.end(), word.begin(), word.end());
+        }
+        raws.push_back(make_shared<string>(buffer.begin(), buffer.end()));
+        offs.push_back(make_shared<vector<size_t>>());
+        for (size_t i = 0; i < buffer.size(); i++) {
+            if ((buffer[i] & 0xc0) != 0x80) offs.back()->push_back(i);
+        }
+        offs.back()->push_back(buffer.size());
+    }
+
+    vector<Lattice> lattices(sentences);
+    size_t spans = 0;
+    for (size_t s = 0; s < sentences; s++) {
+        full_lattice(offs[s]->size() - 1, tags, nullptr, lattices[s]);
+        spans += lattices[s].size();
+    }
+
+    Dictionary<string> dict;
+    dict.load(filename);
+    DictFeature<bench_span_t> feature(filename);
+    HashWeight weight;
+    for (auto& value : {"NN", "VV"}) {
+        double one = 1;
+        weight.add_from(string("d:") + filename + ":" + value, &one, 1);
+    }
+    feature.set_weight(weight);
+    printf("%lu words, %lu sentences, %lu spans\n", n, sentences, spans);
+
+    /// as DictFeature did it before
+    string prefix = string("d:") + filename + ":";
+    DictMatches matches;
+    double sum = 0;
+    Timer keys;
+    for (size_t s = 0; s < sentences; s++) {
+        matches.find(dict, *raws[s], *offs[s]);
+        for (size_t k = 0; k < lattices[s].size(); k++) {
+            size_t entry = matches.entry(lattices[s].begin(k), lattices[s].end(k));
+            if (entry == DictMatches::npos) continue;
+            string key = prefix + dict.value(entry);
+            sum += weight.value(key);
+        }
+    }
+    printf("%-10s %.1fM spans/s  [%g]\n", "keys", spans / keys.seconds() / 1e6, sum);
+
+    sum = 0;
+    Timer ids;
+    for (size_t s = 0; s < sentences; s++) {
+        feature.prepare(raws[s], offs[s], lattices[s]);
+        for (size_t k = 0; k < lattices[s].size(); k++) {
+            sum += feature.unigram(k);
+        }
+    }
+    printf("%-10s %.1fM spans/s  [%g]\n", "ids", spans / ids.seconds() / 1e6, sum);
+    remove(filename);
+}
+
+/// LabelledFeature's char emission as it was: a substring key per ngram
+static double previous_emission(const HashWeight& weight, size_t tags,
+        const string& raw, const vector<size_t>& begins, vector<double>& emission) {
+    const size_t N = 4;
+    emission.assign(N * tags * (begins.size() - 1), 0);
+    for (size_t n = 1; n <= 2; n++) {
+        for (size_t i = 0; i + n < begins.size(); i++) {
+            string uni = raw.substr(begins[i], begins[i + n] - begins[i]);
+            if (n == 1 && uni[0] == '|') uni = string("，");
+            int b = (((int)i - 1) * (int)N * (int)tags);
+            int e = (std::min(((int)(2 + n)), ((int)begins.size() - (int)i)) * N * tags);
+            row_t m = weight.row(uni);
+            if (m) m.add_to(emission.data() + b, std::max(0, - b), e);
+        }
+    }
+    return emission.empty() ? 0 : emission[0];
+}
+
+/**
+ * LabelledFeature::prepare on the sentences of a file with the weights of
+ * a text model, against the char emission with substring keys, in chars/s
+ * */
+static void bench_emission(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "emission needs a text model and a raw file\n");
+        return;
+    }
+    string model = argv[0];
+    size_t rounds = (argc > 2) ? atol(argv[2]) : 5;
+    HashWeight weight;
+    if (!weight.load(model + ".weights")) return;
+    auto tags = make_shared<Indexer<string>>();
+    tags->load(model + ".tags");
+
+    vector<shared_ptr<string>> raws;
+    vector<shared_ptr<vector<size_t>>> offs;
+    size_t chars = 0;
+    std::ifstream input(argv[1]);
+    string line;
+    while (std::getline(input, line)) {
+        if (line.empty()) continue;
+        raws.push_back(make_shared<string>(line));
+        offs.push_back(make_shared<vector<size_t>>());
+        for (size_t i = 0; i < line.size(); i++) {
+            if ((line[i] & 0xc0) != 0x80) offs.back()->push_back(i);
+        }
+        offs.back()->push_back(line.size());
+        chars += offs.back()->size() - 1;
+    }
+    printf("%lu weights, %lu tags, %lu sentences, %lu chars\n",
+            weight.size(), tags->size(), raws.size(), chars);
+
+    Normalizer normalizer;
+    string norm_raw;
+    vector<size_t> norm_off;
+    vector<double> emission;
+    double check = 0;
+    Timer keys;
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t s = 0; s < raws.size(); s++) {
+            normalizer(*raws[s], *offs[s], norm_raw, norm_off);
+            check += previous_emission(weight, tags->size(), norm_raw, norm_off, emission);
+        }
+    }
+    printf("%-12s %.2fM chars/s\n", "string keys", chars * rounds / keys.seconds() / 1e6);
+
+    LabelledFeature<bench_span_t> feature;
+    feature.set_tag_indexer(tags);
+    feature.set_weight(weight);
+    Lattice lattice;
+    Timer ids;
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t s = 0; s < raws.size(); s++) {
+            feature.prepare(raws[s], offs[s], lattice);
+        }
+    }
+    printf("%-12s %.2fM chars/s  [%g]\n", "char ids", chars * rounds / ids.seconds() / 1e6, check);
+}
+
+/**
+ * the bytes of the lattice of each sentence, as vectors of labelled spans
+ * with begin and end lists before and packed now, and the time to decode
+ * a sentence with the weights of a text model
+ * */
+static void bench_lattice(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "lattice needs a text model and a raw file\n");
+        return;
+    }
+    string model = argv[0];
+    HashWeight weight;
+    if (!weight.load(model + ".weights")) return;
+    auto tags = make_shared<Indexer<string>>();
+    tags->load(model + ".tags");
+
+    vector<lattice_t<labelled_span_t>> sentences;
+    std::ifstream input(argv[1]);
+    for (string line; std::getline(input, line); ) {
+        if (line.empty()) continue;
+        sentences.push_back(lattice_t<labelled_span_t>());
+        sentences.back().raw = make_shared<string>(line);
+        sentences.back().off = make_shared<vector<size_t>>();
+        utf8_off(line, *sentences.back().off);
+    }
+
+    LabelledFeature<labelled_span_t> feature;
+    feature.set_tag_indexer(tags);
+    feature.set_weight(weight);
+    PathFinder decoder;
+    Lattice lattice;
+    lattice_t<labelled_span_t> out;
+    size_t spans = 0;
+    size_t words = 0;
+    double before = 0;
+    double after = 0;
+    Timer decode;
+    for (auto& sentence : sentences) {
+        size_t chars = sentence.off->size() - 1;
+        full_lattice(chars, tags->size(), tags, lattice);
+        decoder.find_path(sentence, lattice, feature, out);
+        spans += lattice.size();
+        words += out.spans.size();
+        /// the spans, and a vector of span indices per char for begins and ends
+        before += lattice.size() * (sizeof(labelled_span_t) + 2 * sizeof(size_t))
+            + 2 * (chars + 1) * sizeof(vector<size_t>);
+        after += lattice.size() * (sizeof(packed_span_t) + sizeof(uint32_t))
+            + 2 * (chars + 2) * sizeof(uint32_t);
+    }
+    double seconds = decode.seconds();
+    size_t n = sentences.size();
+    printf("%lu sentences, %.0f spans and %.1f words per sentence\n",
+            n, (double)spans / n, (double)words / n);
+    printf("lattice bytes per sentence: %.0f -> %.0f\n", before / n, after / n);
+    printf("decode %.1fus per sentence\n", seconds * 1e6 / n);
+}
+
+/**
+ * decoding with every pair of spans scored vs by (tag, length) class,
+ * for tagsets of growing size, with random weights
+ * */
+static void bench_viterbi(int argc, char* argv[]) {
+    size_t sentences = (argc > 0) ? atol(argv[0]) : 200;
+    size_t chars = (argc > 1) ? atol(argv[1]) : 30;
+    const size_t N = 4;
+    const size_t MAX_LEN = 4;
+    printf("%lu sentences of %lu chars\n", sentences, chars);
+    printf("%6s %12s %12s %8s\n", "tags", "pairs(us)", "classes(us)", "speedup");
+    for (size_t tags : {1, 4, 9, 16, 32, 64}) {
+        std::mt19937 rng(tags);
+        std::uniform_real_distribution<double> uniform(-1, 1);
+        auto indexer = make_shared<Indexer<string>>();
+        for (size_t t = 0; t < tags; t++) indexer->get("T" + std::to_string(t));
+
+        HashWeight weight;
+        vector<double> values((MAX_LEN * tags) * (MAX_LEN * tags));
+        for (auto& v : values) v = uniform(rng);
+        weight.add_from("transition", values.data(), values.size());
+        vector<vector<char>> vocab(500);
+        values.resize(3 * N * tags);
+        for (size_t c = 0; c < vocab.size(); c++) {
+            utf8(0x4e00 + c, vocab[c]);
+            for (auto& v : values) v = uniform(rng);
+            weight.add_from(string(vocab[c].begin(), vocab[c].end()), values.data(), values.size());
+        }
+
+        vector<lattice_t<labelled_span_t>> xs(sentences);
+        for (auto& x : xs) {
+            vector<char> buffer;
+            for (size_t i = 0; i < chars; i++) {
+                auto& c = vocab[rng() % vocab.size()];
+                buffer.insert(buffer.end(), c.begin(), c.end());
+            }
+            x.raw = make_shared<string>(buffer.begin(), buffer.end());
+            x.off = make_shared<vector<size_t>>();
+            utf8_off(*x.raw, *x.off);
+        }
+
+        LabelledFeature<labelled_span_t> feature;
+        feature.set_tag_indexer(indexer);
+        feature.set_weight(weight);
+        Lattice lattice;
+        PathFinder decoder;
+        vector<lattice_t<labelled_span_t>> outs[2];
+        double us[2];
+        for (int by_class = 0; by_class < 2; by_class++) {
+            decoder.pairwise(!by_class);
+            outs[by_class].resize(sentences);
+            Timer timer;
+            for (size_t s = 0; s < sentences; s++) {
+                full_lattice(chars, tags, indexer, lattice);
+                decoder.find_path(xs[s], lattice, feature, outs[by_class][s]);
+            }
+            us[by_class] = timer.seconds() * 1e6 / sentences;
+        }
+        for (size_t s = 0; s < sentences; s++) {
+            auto& a = outs[0][s].spans;
+            auto& b = outs[1][s].spans;
+            bool same = a.size() == b.size();
+            for (size_t k = 0; same && k < a.size(); k++) same = (a[k] == b[k]);
+            if (!same) fprintf(stderr, "different paths for sentence %lu\n", s);
+        }
+        printf("%6lu %12.1f %12.1f %7.1fx\n", tags, us[0], us[1], us[0] / us[1]);
+    }
+}
+
+/**
+ * decoding with the dictionary, frequency and phrase features of a text
+ * model held as a vector of virtual features vs as a FeatureSet
+ * */
+static void bench_featureset(int argc, char* argv[]) {
+    if (argc < 5) {
+        fprintf(stderr, "featureset needs a text model, a raw file, a dictionary,"
+                " word frequencies and phrases\n");
+        return;
+    }
+    string model = argv[0];
+    size_t rounds = (argc > 5) ? atol(argv[5]) : 3;
+    HashWeight weight;
+    if (!weight.load(model + ".weights")) return;
+    auto tags = make_shared<Indexer<string>>();
+    tags->load(model + ".tags");
+
+    vector<lattice_t<labelled_span_t>> sentences;
+    std::ifstream input(argv[1]);
+    for (string line; std::getline(input, line); ) {
+        if (line.empty()) continue;
+        sentences.push_back(lattice_t<labelled_span_t>());
+        sentences.back().raw = make_shared<string>(line);
+        sentences.back().off = make_shared<vector<size_t>>();
+        utf8_off(line, *sentences.back().off);
+    }
+
+    typedef DictFeature<labelled_span_t> dict_t;
+    typedef UnigramFeature<labelled_span_t> uni_t;
+    typedef PhraseFeature<labelled_span_t> phrase_t;
+    dict_t dict(argv[2]);
+    uni_t uni(argv[3]);
+    phrase_t phrase(argv[4]);
+
+    LabelledFeature<labelled_span_t> dynamic;
+    dynamic.features().push_back(make_shared<dict_t>(dict));
+    dynamic.features().push_back(make_shared<uni_t>(uni));
+    dynamic.features().push_back(make_shared<phrase_t>(phrase));
+    LabelledFeature<labelled_span_t, FeatureSet<labelled_span_t, dict_t, uni_t, phrase_t>> fixed;
+    fixed.features() = FeatureSet<labelled_span_t, dict_t, uni_t, phrase_t>(dict, uni, phrase);
+    dynamic.set_tag_indexer(tags);
+    dynamic.set_weight(weight);
+    fixed.set_tag_indexer(tags);
+    fixed.set_weight(weight);
+
+    PathFinder decoder;
+    Lattice lattice;
+    vector<lattice_t<labelled_span_t>> outs[2];
+    outs[0].resize(sentences.size());
+    outs[1].resize(sentences.size());
+    double us[2];
+    for (int set = 0; set < 2; set++) {
+        Timer timer;
+        for (size_t r = 0; r < rounds; r++) {
+            for (size_t s = 0; s < sentences.size(); s++) {
+                full_lattice(sentences[s].off->size() - 1, tags->size(), tags, lattice);
+                if (set) {
+                    decoder.find_path(sentences[s], lattice, fixed, outs[set][s]);
+                } else {
+                    decoder.find_path(sentences[s], lattice, dynamic, outs[set][s]);
+                }
+            }
+        }
+        us[set] = timer.seconds() * 1e6 / (rounds * sentences.size());
+    }
+    for (size_t s = 0; s < sentences.size(); s++) {
+        auto& a = outs[0][s].spans;
+        auto& b = outs[1][s].spans;
+        bool same = a.size() == b.size();
+        for (size_t k = 0; same && k < a.size(); k++) same = (a[k] == b[k]);
+        if (!same) fprintf(stderr, "different paths for sentence %lu\n", s);
+    }
+    printf("%lu sentences, %lu tags\n", sentences.size(), tags->size());
+    printf("%-12s %.1fus per sentence\n", "virtual", us[0]);
+    printf("%-12s %.1fus per sentence\n", "FeatureSet", us[1]);
+}
+
+/// ns per call of `kernel`, run `rounds` times
+template<class KERNEL>
+static double time_kernel(size_t rounds, KERNEL kernel) {
+    Timer timer;
+    for (size_t r = 0; r < rounds; r++) kernel();
+    return timer.seconds() * 1e9 / rounds;
+}
+
+/**
+ * the emission kernels at each SIMD level of the cpu, then decoding with
+ * double and float scores, with random weights
+ * */
+static void bench_kernels(int argc, char* argv[]) {
+    size_t tags = (argc > 0) ? atol(argv[0]) : 9;
+    size_t rounds = (argc > 1) ? atol(argv[1]) : 200000;
+    size_t sentences = (argc > 2) ? atol(argv[2]) : 300;
+    const size_t N = 4;
+    const size_t chars = 40;
+    size_t top = simd_detect();
+    std::mt19937 rng(tags);
+    std::uniform_real_distribution<double> uniform(-1, 1);
+
+    size_t row_len = 4 * N * tags;
+    vector<double> row_f64(row_len);
+    vector<int8_t> row_i8(row_len);
+    for (size_t i = 0; i < row_len; i++) {
+        row_f64[i] = uniform(rng);
+        row_i8[i] = rng() % 255 - 127;
+    }
+    aligned_vector<double> out_f64(row_len);
+    aligned_vector<float> out_f32(row_len);
+    aligned_vector<double> emission_f64(chars * N * tags);
+    aligned_vector<float> emission_f32(chars * N * tags);
+    for (size_t i = 0; i < emission_f64.size(); i++) {
+        emission_f64[i] = emission_f32[i] = uniform(rng);
+    }
+    aligned_vector<double> prefix_f64((chars + 1) * tags);
+    aligned_vector<float> prefix_f32((chars + 1) * tags);
+
+    printf("%lu tags, rows of %lu values, prefix sums over %lu chars, ns per call\n",
+            tags, row_len, chars);
+    printf("%-22s", "kernel");
+    for (size_t level = 0; level <= top; level++) {
+        printf(" %10s", simd_name((simd_level_t)level));
+    }
+    printf("\n");
+    const char* names[] = {"add f64 -> double", "add f64 -> float", "add i8 -> double",
+        "prefix sum double", "prefix sum float"};
+    for (size_t kernel = 0; kernel < 5; kernel++) {
+        printf("%-22s", names[kernel]);
+        for (size_t level = 0; level <= top; level++) {
+            set_simd_level((simd_level_t)level);
+            double ns = 0;
+            switch (kernel) {
+                case 0: ns = time_kernel(rounds, [&]() {
+                            add_row(row_f64.data(), out_f64.data(), row_len); });
+                        break;
+                case 1: ns = time_kernel(rounds, [&]() {
+                            add_row(row_f64.data(), 1.0, out_f32.data(), row_len); });
+                        break;
+                case 2: ns = time_kernel(rounds, [&]() {
+                            add_row(row_i8.data(), 0.01, out_f64.data(), row_len); });
+                        break;
+                case 3: ns = time_kernel(rounds / 10, [&]() {
+                            lane_prefix_sum<N>(emission_f64.data(), 1, tags, chars,
+                                    prefix_f64.data()); });
+                        break;
+                case 4: ns = time_kernel(rounds / 10, [&]() {
+                            lane_prefix_sum<N>(emission_f32.data(), 1, tags, chars,
+                                    prefix_f32.data()); });
+                        break;
+            }
+            printf(" %10.1f", ns);
+        }
+        printf("\n");
+    }
+    printf("[%g %g %g %g]\n", out_f64[0], out_f32[0], prefix_f64.back(), prefix_f32.back());
+
+    auto indexer = make_shared<Indexer<string>>();
+    for (size_t t = 0; t < tags; t++) indexer->get("T" + std::to_string(t));
+    HashWeight weight;
+    vector<double> values((4 * tags) * (4 * tags));
+    for (auto& v : values) v = uniform(rng);
+    weight.add_from("transition", values.data(), values.size());
+    vector<vector<char>> vocab(500);
+    values.resize(3 * N * tags);
+    for (size_t c = 0; c < vocab.size(); c++) {
+        utf8(0x4e00 + c, vocab[c]);
+        for (auto& v : values) v = uniform(rng);
+        weight.add_from(string(vocab[c].begin(), vocab[c].end()), values.data(), values.size());
+    }
+    vector<lattice_t<labelled_span_t>> xs(sentences);
+    for (auto& x : xs) {
+        vector<char> buffer;
+        for (size_t i = 0; i < chars; i++) {
+            auto& c = vocab[rng() % vocab.size()];
+            buffer.insert(buffer.end(), c.begin(), c.end());
+        }
+        x.raw = make_shared<string>(buffer.begin(), buffer.end());
+        x.off = make_shared<vector<size_t>>();
+        utf8_off(*x.raw, *x.off);
+    }
+    LabelledFeature<labelled_span_t> feature_f64;
+    LabelledFeature<labelled_span_t, DynamicFeatures<labelled_span_t>, 4, float> feature_f32;
+    feature_f64.set_tag_indexer(indexer);
+    feature_f64.set_weight(weight);
+    feature_f32.set_tag_indexer(indexer);
+    feature_f32.set_weight(weight);
+    PathFinder decoder_f64;
+    BasicPathFinder<float> decoder_f32;
+    Lattice lattice;
+    vector<lattice_t<labelled_span_t>> outs(sentences);
+    lattice_t<labelled_span_t> out;
+
+    printf("\n%lu sentences of %lu chars, us per sentence\n", sentences, chars);
+    printf("%-22s", "decode");
+    for (size_t level = 0; level <= top; level++) {
+        printf(" %10s", simd_name((simd_level_t)level));
+    }
+    printf("\n");
+    for (int f32 = 0; f32 < 2; f32++) {
+        printf("%-22s", f32 ? "float" : "double");
+        size_t differ = 0;
+        for (size_t level = 0; level <= top; level++) {
+            set_simd_level((simd_level_t)level);
+            Timer timer;
+            for (size_t s = 0; s < sentences; s++) {
+                full_lattice(chars, tags, indexer, lattice);
+                if (f32) {
+                    decoder_f32.find_path(xs[s], lattice, feature_f32, out);
+                } else {
+                    decoder_f64.find_path(xs[s], lattice, feature_f64, out);
+                }
+                if (!f32 && level == 0) {
+                    outs[s] = out;
+                    continue;
+                }
+                bool same = out.spans.size() == outs[s].spans.size();
+                for (size_t k = 0; same && k < out.spans.size(); k++) {
+                    same = (out.spans[k] == outs[s].spans[k]);
+                }
+                if (!same) differ++;
+            }
+            printf(" %10.1f", timer.seconds() * 1e6 / sentences);
+        }
+        printf("   %lu paths differ from scalar double\n", differ);
+    }
+    set_simd_level(simd_detect());
+}
+
+/// utf8_off and the Normalizer as they were: byte by byte, with a map
+static void previous_normalize(const std::map<size_t, size_t>& replace,
+        const string& src_raw, string& tgt_raw, vector<size_t>& tgt_off) {
+    vector<size_t> src_off;
+    for (size_t i = 0; i < src_raw.size(); i++) {
+        const char& c = src_raw[i];
+        if ((0xc0 == (c & 0xc0)) || !(c & 0x80)) src_off.push_back(i);
+    }
+    src_off.push_back(src_raw.size());
+
+    vector<char> buffer;
+    buffer.reserve(src_raw.size());
+    tgt_off.clear();
+    tgt_off.push_back(0);
+    for (size_t i = 0; i < src_off.size() - 1; i++) {
+        size_t code = unicode(src_raw.data() + src_off[i], src_off[i + 1] - src_off[i]);
+        auto res = replace.find(code);
+        if (res == replace.end()) {
+            for (size_t j = src_off[i]; j < src_off[i + 1]; j++) buffer.push_back(src_raw[j]);
+        } else {
+            utf8(res->second, buffer);
+        }
+        tgt_off.push_back(buffer.size());
+    }
+    buffer.push_back(0);
+    tgt_raw = string(buffer.data());
+}
+
+/**
+ * finding the chars of the lines of a file and normalizing them, in GB/s
+ * */
+static void bench_normalize(int argc, char* argv[]) {
+    if (argc < 1) {
+        fprintf(stderr, "normalize needs a text file\n");
+        return;
+    }
+    size_t rounds = (argc > 1) ? atol(argv[1]) : 10;
+    vector<string> lines;
+    size_t bytes = 0;
+    std::ifstream input(argv[0]);
+    for (string line; std::getline(input, line); ) {
+        bytes += line.size();
+        lines.push_back(line);
+    }
+    double gb = bytes * rounds / 1e9;
+    printf("%lu lines, %.1fMB\n", lines.size(), bytes / 1e6);
+
+    std::map<size_t, size_t> replace;
+    for (size_t code = 0xff01; code <= 0xff5e; code++) replace[code] = code - 65248;
+    replace[9675] = 38646;
+    string raw;
+    vector<size_t> off;
+    size_t chars = 0;
+    Timer previous;
+    for (size_t r = 0; r < rounds; r++) {
+        for (auto& line : lines) {
+            previous_normalize(replace, line, raw, off);
+            chars += off.size();
+        }
+    }
+    printf("%-20s %.3fGB/s  [%lu]\n", "map, byte by byte", gb / previous.seconds(), chars);
+
+    chars = 0;
+    Timer scan;
+    for (size_t r = 0; r < rounds; r++) {
+        for (auto& line : lines) {
+            utf8_off(line, off);
+            chars += off.size();
+        }
+    }
+    printf("%-20s %.3fGB/s  [%lu]\n", "utf8_off", gb / scan.seconds(), chars);
+
+    Normalizer normalizer;
+    chars = 0;
+    Timer fused;
+    for (size_t r = 0; r < rounds; r++) {
+        for (auto& line : lines) {
+            normalizer(line, raw, off);
+            chars += off.size();
+        }
+    }
+    printf("%-20s %.3fGB/s  [%lu]\n", "table + blocks", gb / fused.seconds(), chars);
+}
+
+/**
+ * segmenting the lines of a file with libtenseg on 1, 2, 4 ... threads,
+ * each with a context of its own over one model. every context segments
+ * the first half of the lines before the time is taken on the second
+ * half, so the allocations are counted for text the contexts have not
+ * seen, in the first round and in the rounds after it
+ * */
+static void bench_threads(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "threads needs a model and a raw file\n");
+        return;
+    }
+    ModelOptions options;
+    if (Bundle::is_bundle(argv[0])) {
+        options.bin_model = argv[0];
+    } else {
+        options.txt_model = argv[0];
+    }
+    size_t max_threads = (argc > 2) ? atol(argv[2]) : std::thread::hardware_concurrency();
+    size_t rounds = (argc > 3) ? atol(argv[3]) : 5;
+    if (max_threads < 1) max_threads = 1;
+    if (rounds < 1) rounds = 1;
+    Model model;
+    if (!model.load(options)) return;
+
+    vector<string> seen;
+    vector<string> lines;
+    std::ifstream input(argv[1]);
+    for (string line; std::getline(input, line); ) {
+        lines.push_back(line);
+    }
+    seen.assign(lines.begin(), lines.begin() + lines.size() / 2);
+    lines.erase(lines.begin(), lines.begin() + lines.size() / 2);
+    size_t bytes = 0;
+    for (auto& line : lines) bytes += line.size();
+    printf("%lu + %lu lines, %.1fMB, %u cores\n", seen.size(), lines.size(),
+            bytes / 1e6, std::thread::hardware_concurrency());
+
+    double single = 0;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        vector<shared_ptr<DecoderContext>> contexts;
+        vector<vector<Span>> spans(threads, vector<Span>(256));
+        for (size_t t = 0; t < threads; t++) {
+            contexts.push_back(make_shared<DecoderContext>(model));
+        }
+        vector<size_t> words(threads, 0);
+        std::atomic<size_t> ready(0);
+        std::atomic<size_t> done(0);
+        std::atomic<bool> go(false);
+        size_t first = 0;
+        auto run = [&](size_t t, size_t rounds) {
+            ready++;
+            while (!go) std::this_thread::yield();
+            for (size_t r = 0; r < rounds; r++) {
+                for (size_t i = t; i < lines.size(); i += threads) {
+                    words[t] += contexts[t]->segment(lines[i].data(), lines[i].size(),
+                            spans[t].data(), spans[t].size());
+                }
+                /// the last thread done with the first round takes its count
+                if (r == 0 && ++done == threads) first = allocations.load();
+            }
+        };
+        /// every context sees the first half of the lines before
+        for (size_t t = 0; t < threads; t++) {
+            for (auto& line : seen) {
+                contexts[t]->segment(line.data(), line.size(),
+                        spans[t].data(), spans[t].size());
+            }
+        }
+        vector<std::thread> workers;
+        for (size_t t = 0; t < threads; t++) {
+            workers.emplace_back(run, t, rounds);
+        }
+        while (ready < threads) std::this_thread::yield();
+        size_t allocated = allocations.load();
+        Timer timer;
+        go = true;
+        for (auto& worker : workers) worker.join();
+        double seconds = timer.seconds();
+        size_t news = allocations.load() - first;
+        first -= allocated;
+        size_t total = 0;
+        for (auto w : words) total += w;
+        double mb = bytes * rounds / seconds / 1e6;
+        if (threads == 1) single = mb;
+        printf("%2lu threads %8.2fMB/s  x%.2f  %lu + %lu allocations  [%lu words]\n",
+                threads, mb, mb / single, first, news, total);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s weight [features] [values]\n", argv[0]);
+        fprintf(stderr, "       %s learner [features] [updates] [touched]\n", argv[0]);
+        fprintf(stderr, "       %s gradient [sentences] [chars] [tags]\n", argv[0]);
+        fprintf(stderr, "       %s dict [entries] [sentences]\n", argv[0]);
+        fprintf(stderr, "       %s phrase [phrases] [paragraph KB] [paragraphs]\n", argv[0]);
+        fprintf(stderr, "       %s feature [words] [sentences] [tags]\n", argv[0]);
+        fprintf(stderr, "       %s emission model raw_file [rounds]\n", argv[0]);
+        fprintf(stderr, "       %s normalize text_file [rounds]\n", argv[0]);
+        fprintf(stderr, "       %s lattice model raw_file\n", argv[0]);
+        fprintf(stderr, "       %s viterbi [sentences] [chars]\n", argv[0]);
+        fprintf(stderr, "       %s kernels [tags] [rounds] [sentences]\n", argv[0]);
+        fprintf(stderr, "       %s featureset model raw_file dict uni_freq phrase [rounds]\n", argv[0]);
+        fprintf(stderr, "       %s threads model raw_file [max threads] [rounds]\n", argv[0]);
+        return 1;
+    }
+    string name = argv[1];
+    if (name == "weight") {
+        bench_weight(argc - 2, argv + 2);
+    } else if (name == "learner") {
+        bench_learner(argc - 2, argv + 2);
+    } else if (name == "gradient") {
+        bench_gradient(argc - 2, argv + 2);
+    } else if (name == "dict") {
+        bench_dict(argc - 2, argv + 2);
+    } else if (name == "phrase") {
+        bench_phrase(argc - 2, argv + 2);
+    } else if (name == "feature") {
+        bench_feature(argc - 2, argv + 2);
+    } else if (name == "emission") {
+        bench_emission(argc - 2, argv + 2);
+    } else if (name == "normalize") {
+        bench_normalize(argc - 2, argv + 2);
+    } else if (name == "lattice") {
+        bench_lattice(argc - 2, argv + 2);
+    } else if (name == "viterbi") {
+        bench_viterbi(argc - 2, argv + 2);
+    } else if (name == "kernels") {
+        bench_kernels(argc - 2, argv + 2);
+    } else if (name == "featureset") {
+        bench_featureset(argc - 2, argv + 2);
+    } else if (name == "threads") {
+        bench_threads(argc - 2, argv + 2);
+    } else {
+        fprintf(stderr, "unknown benchmark '%s'\n", name.c_str());
+        return 1;
+    }
+    return 0;
+}
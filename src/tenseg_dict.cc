@@ -0,0 +1,38 @@
+/**
+ * compiles a `key value` dictionary into a trie that loads by mapping
+ *
+ * usage: tenseg_dict <dict|uni_freq|phrase> <input> <output>
+ *
+ * the output can be given to segtag in place of the text file, e.g.
+ * `--dict=dict.bin`.
+ * */
+#include "common/dictionary.h"
+
+#include <cstdio>
+#include <string>
+
+using namespace tenseg;
+
+template<class V>
+static int compile(const char* input, const char* output) {
+    Dictionary<V> dict;
+    dict.load(input);
+    if (!dict.save(output)) return 1;
+    fprintf(stderr, "%lu entries\n", dict.size());
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <dict|uni_freq|phrase> <input> <output>\n", argv[0]);
+        return 1;
+    }
+    string kind = argv[1];
+    if (kind == "dict" || kind == "phrase") {
+        return compile<string>(argv[2], argv[3]);
+    } else if (kind == "uni_freq") {
+        return compile<double>(argv[2], argv[3]);
+    }
+    fprintf(stderr, "unknown kind '%s'\n", kind.c_str());
+    return 1;
+}